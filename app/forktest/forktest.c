@@ -0,0 +1,49 @@
+typedef unsigned int size_t;
+int write(int fd, const void *, size_t);
+int write_below_page_boundary(int fd, const void *, size_t);
+int fork(void);
+void exit(int);
+
+// The parent keeps a canary on its stack while the child makes syscalls on
+// the same stack pages, which are still shared by fork. The kernel writes
+// syscall frames there, so the pages have to be copied on writes in ring 0
+// as well.
+#define CANARY_SIZE (4 * 4096)
+#define NUM_OF_CHILD_SYSCALLS 1000
+#define NUM_OF_PARENT_SPINS 1000000000L
+
+// Returns 0 in the child, 1 if the canary is intact and -1 if not.
+__attribute__((noinline)) static int ForkUnderCanary() {
+  volatile char canary[CANARY_SIZE];
+  for (int i = 0; i < CANARY_SIZE; i++) {
+    canary[i] = (char)i;
+  }
+  if (fork() == 0)
+    return 0;
+  // Gives the child time to run.
+  for (volatile long i = 0; i < NUM_OF_PARENT_SPINS; i++) {
+  }
+  for (int i = 0; i < CANARY_SIZE; i++) {
+    if (canary[i] != (char)i)
+      return -1;
+  }
+  return 1;
+}
+
+int main() {
+  int result = ForkUnderCanary();
+  if (result == 0) {
+    // The stack of the child is back above the canary of the parent.
+    for (int i = 0; i < NUM_OF_CHILD_SYSCALLS; i++) {
+      write_below_page_boundary(1, "", 0);
+    }
+    exit(0);
+  }
+  if (result < 0) {
+    write(1, "forktest: stack of the parent is broken\n", 40);
+    exit(1);
+  }
+  write(1, "forktest: OK\n", 13);
+  exit(0);
+  return 0;
+}
@@ -0,0 +1,6 @@
+LLVM_CC:=
+LLVM_CXX:=
+LLVM_LLD_LINK:=
+LLVM_LD_LLD:=
+LLVM_AR:=
+LLVM_RANLIB:=
@@ -0,0 +1,150 @@
+#pragma once
+
+#include "generic.h"
+
+// Allocates ranges of addresses from [base, base + size).
+// Free ranges are kept as an array of extents sorted by address and are
+// merged with their neighbors when a range is freed.
+template <int TMaxNumOfExtents>
+class AddressRangeAllocator {
+ public:
+  void Init(uint64_t base, uint64_t byte_size) {
+    assert(byte_size);
+    extents_[0].begin = base;
+    extents_[0].end = base + byte_size;
+    num_of_extents_ = 1;
+  }
+  // Returns the lowest address of the first extent that is large enough, or
+  // 0 if there is no such extent.
+  uint64_t Alloc(uint64_t byte_size) {
+    assert(byte_size);
+    for (int i = 0; i < num_of_extents_; i++) {
+      Extent& e = extents_[i];
+      if (e.end - e.begin < byte_size)
+        continue;
+      uint64_t addr = e.begin;
+      e.begin += byte_size;
+      if (e.begin == e.end)
+        RemoveExtentAt(i);
+      return addr;
+    }
+    return 0;
+  }
+  void Free(uint64_t addr, uint64_t byte_size) {
+    assert(byte_size);
+    const uint64_t end = addr + byte_size;
+    const int idx = FindFirstExtentAfter(addr);
+    Extent* prev = idx > 0 ? &extents_[idx - 1] : nullptr;
+    Extent* next = idx < num_of_extents_ ? &extents_[idx] : nullptr;
+    if ((prev && addr < prev->end) || (next && next->begin < end))
+      Panic("AddressRangeAllocator: double free");
+    const bool merge_prev = prev && prev->end == addr;
+    const bool merge_next = next && next->begin == end;
+    if (merge_prev && merge_next) {
+      prev->end = next->end;
+      RemoveExtentAt(idx);
+      return;
+    }
+    if (merge_prev) {
+      prev->end = end;
+      return;
+    }
+    if (merge_next) {
+      next->begin = addr;
+      return;
+    }
+    if (num_of_extents_ >= TMaxNumOfExtents)
+      Panic("AddressRangeAllocator: too many free extents");
+    for (int i = num_of_extents_; i > idx; i--) {
+      extents_[i] = extents_[i - 1];
+    }
+    extents_[idx].begin = addr;
+    extents_[idx].end = end;
+    num_of_extents_++;
+  }
+  // Removes [addr, addr + byte_size) from free extents. Returns false if the
+  // range is not free or there is no room to split an extent.
+  bool Reserve(uint64_t addr, uint64_t byte_size) {
+    assert(byte_size);
+    const uint64_t end = addr + byte_size;
+    const int idx = FindFirstExtentAfter(addr) - 1;
+    if (idx < 0 || extents_[idx].end < end)
+      return false;
+    Extent& e = extents_[idx];
+    if (e.begin == addr) {
+      e.begin = end;
+      if (e.begin == e.end)
+        RemoveExtentAt(idx);
+      return true;
+    }
+    if (e.end == end) {
+      e.end = addr;
+      return true;
+    }
+    if (IsFull())
+      return false;
+    for (int i = num_of_extents_; i > idx + 1; i--) {
+      extents_[i] = extents_[i - 1];
+    }
+    extents_[idx + 1].begin = end;
+    extents_[idx + 1].end = e.end;
+    e.end = addr;
+    num_of_extents_++;
+    return true;
+  }
+  // Returns true if no part of [addr, addr + byte_size) is free.
+  bool IsAllocated(uint64_t addr, uint64_t byte_size) const {
+    assert(byte_size);
+    const int idx = FindFirstExtentAfter(addr);
+    if (idx > 0 && addr < extents_[idx - 1].end)
+      return false;
+    return idx >= num_of_extents_ || addr + byte_size <= extents_[idx].begin;
+  }
+  // Free may need one more extent if this is true.
+  bool IsFull() const { return num_of_extents_ >= TMaxNumOfExtents; }
+  int GetNumOfFreeExtents() const { return num_of_extents_; }
+  uint64_t GetNumOfFreeBytes() const {
+    uint64_t sum = 0;
+    for (int i = 0; i < num_of_extents_; i++) {
+      sum += extents_[i].end - extents_[i].begin;
+    }
+    return sum;
+  }
+  uint64_t GetLargestFreeExtentByteSize() const {
+    uint64_t largest = 0;
+    for (int i = 0; i < num_of_extents_; i++) {
+      const uint64_t size = extents_[i].end - extents_[i].begin;
+      if (size > largest)
+        largest = size;
+    }
+    return largest;
+  }
+
+ private:
+  struct Extent {
+    uint64_t begin;
+    uint64_t end;
+  };
+  // Binary search for the index of the first extent that begins after addr.
+  int FindFirstExtentAfter(uint64_t addr) const {
+    int lo = 0;
+    int hi = num_of_extents_;
+    while (lo < hi) {
+      const int mid = (lo + hi) / 2;
+      if (extents_[mid].begin <= addr)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    return lo;
+  }
+  void RemoveExtentAt(int idx) {
+    for (int i = idx; i + 1 < num_of_extents_; i++) {
+      extents_[i] = extents_[i + 1];
+    }
+    num_of_extents_--;
+  }
+
+  Extent extents_[TMaxNumOfExtents];
+  int num_of_extents_;
+};
@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <cassert>
+
+[[noreturn]] void Panic(const char* s) {
+  puts(s);
+  exit(EXIT_FAILURE);
+}
+
+#include "address_range_allocator.h"
+
+constexpr uint64_t kBase = 0x1000'0000;
+constexpr uint64_t kSize = 0x10'0000;
+
+void TestAllocAndMerge() {
+  puts("TestAllocAndMerge");
+  AddressRangeAllocator<8> allocator;
+  allocator.Init(kBase, kSize);
+  uint64_t a = allocator.Alloc(0x1000);
+  uint64_t b = allocator.Alloc(0x2000);
+  uint64_t c = allocator.Alloc(0x3000);
+  assert(a == kBase);
+  assert(b == a + 0x1000);
+  assert(c == b + 0x2000);
+  assert(allocator.GetNumOfFreeBytes() == kSize - 0x6000);
+
+  // Freed ranges are reused by first fit.
+  allocator.Free(b, 0x2000);
+  assert(allocator.GetNumOfFreeExtents() == 2);
+  assert(allocator.Alloc(0x1000) == b);
+  allocator.Free(b, 0x1000);
+
+  // Freeing a and c merges everything into a single extent again.
+  allocator.Free(a, 0x1000);
+  assert(allocator.GetNumOfFreeExtents() == 2);
+  allocator.Free(c, 0x3000);
+  assert(allocator.GetNumOfFreeExtents() == 1);
+  assert(allocator.GetNumOfFreeBytes() == kSize);
+  assert(allocator.GetLargestFreeExtentByteSize() == kSize);
+}
+
+void TestExhaustion() {
+  puts("TestExhaustion");
+  AddressRangeAllocator<8> allocator;
+  allocator.Init(kBase, kSize);
+  assert(allocator.Alloc(kSize + 0x1000) == 0);
+  assert(allocator.Alloc(kSize) == kBase);
+  assert(allocator.GetNumOfFreeExtents() == 0);
+  assert(allocator.Alloc(0x1000) == 0);
+  allocator.Free(kBase, kSize);
+  assert(allocator.GetLargestFreeExtentByteSize() == kSize);
+}
+
+void TestFragmentedFree() {
+  puts("TestFragmentedFree");
+  constexpr int kNumOfRanges = 16;
+  AddressRangeAllocator<kNumOfRanges> allocator;
+  allocator.Init(kBase, kSize);
+  uint64_t addrs[kNumOfRanges];
+  for (int i = 0; i < kNumOfRanges; i++) {
+    addrs[i] = allocator.Alloc(0x1000);
+  }
+  // Leave holes between freed ranges, then fill them in.
+  for (int i = 0; i < kNumOfRanges; i += 2) {
+    allocator.Free(addrs[i], 0x1000);
+  }
+  assert(allocator.GetNumOfFreeExtents() == kNumOfRanges / 2 + 1);
+  for (int i = kNumOfRanges - 1; i > 0; i -= 2) {
+    allocator.Free(addrs[i], 0x1000);
+  }
+  assert(allocator.GetNumOfFreeExtents() == 1);
+  assert(allocator.GetNumOfFreeBytes() == kSize);
+}
+
+void TestReserve() {
+  puts("TestReserve");
+  AddressRangeAllocator<2> allocator;
+  allocator.Init(kBase, kSize);
+  // Reserving the middle of an extent splits it.
+  assert(allocator.Reserve(kBase + 0x2000, 0x1000));
+  assert(allocator.GetNumOfFreeExtents() == 2);
+  assert(allocator.IsFull());
+  // Ranges which are not entirely free cannot be reserved.
+  assert(!allocator.Reserve(kBase + 0x1000, 0x2000));
+  assert(!allocator.Reserve(kBase + 0x2000, 0x1000));
+  // No room to split the extent again.
+  assert(!allocator.Reserve(kBase + 0x8000, 0x1000));
+  // Reserving at the edges of extents does not need a new one.
+  assert(allocator.Reserve(kBase, 0x1000));
+  assert(allocator.Reserve(kBase + 0x1000, 0x1000));
+  assert(allocator.Reserve(kBase + kSize - 0x1000, 0x1000));
+  assert(allocator.GetNumOfFreeExtents() == 1);
+  assert(allocator.GetNumOfFreeBytes() == kSize - 0x4000);
+  assert(allocator.Alloc(0x1000) == kBase + 0x3000);
+}
+
+void TestIsAllocated() {
+  puts("TestIsAllocated");
+  AddressRangeAllocator<8> allocator;
+  allocator.Init(kBase, kSize);
+  assert(!allocator.IsAllocated(kBase, 0x1000));
+  uint64_t a = allocator.Alloc(0x3000);
+  assert(allocator.IsAllocated(a, 0x3000));
+  assert(allocator.IsAllocated(a + 0x1000, 0x1000));
+  assert(!allocator.IsAllocated(a + 0x2000, 0x2000));
+  allocator.Free(a + 0x1000, 0x1000);
+  assert(allocator.IsAllocated(a, 0x1000));
+  assert(!allocator.IsAllocated(a, 0x2000));
+  assert(!allocator.IsAllocated(a + 0x1000, 0x1000));
+  assert(allocator.IsAllocated(a + 0x2000, 0x1000));
+}
+
+int main() {
+  TestAllocAndMerge();
+  TestExhaustion();
+  TestFragmentedFree();
+  TestReserve();
+  TestIsAllocated();
+  puts("PASS");
+  return 0;
+}
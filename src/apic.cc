@@ -34,7 +34,18 @@ void LocalAPIC::Init(void) {
   ReadCPUID(&cpuid, CPUIDIndex::kXTopology, 0);
   id_ = cpuid.edx;
   PutStringAndHex(" id", id_);
-  liumos->bsp_local_apic = this;
+
+  // Application processors start with their LocalAPIC software-disabled,
+  // which blocks fixed interrupts.
+  if (is_x2apic_) {
+    WriteMSR(MSRIndex::kx2APICSpuriousInterruptVector,
+             ReadMSR(MSRIndex::kx2APICSpuriousInterruptVector) |
+                 kSpuriousInterruptVectorBitAPICEnabled);
+  } else {
+    WriteRegister(kRegisterOffsetSpuriousInterruptVector,
+                  ReadRegister(kRegisterOffsetSpuriousInterruptVector) |
+                      kSpuriousInterruptVectorBitAPICEnabled);
+  }
 }
 
 void LocalAPIC::SendEndOfInterrupt(void) {
@@ -46,6 +57,82 @@ void LocalAPIC::SendEndOfInterrupt(void) {
   WriteRegister(0xB0ULL, 0);
 }
 
+void LocalAPIC::SendINIT(uint32_t dest_apic_id) {
+  SendInterProcessorInterrupt(
+      dest_apic_id,
+      kInterruptCommandDeliveryModeINIT | kInterruptCommandBitLevelAssert);
+}
+
+void LocalAPIC::SendStartup(uint32_t dest_apic_id, uint64_t start_paddr) {
+  // The processor starts in real mode at (vector << 12).
+  assert((start_paddr & kPageAddrMask) == 0 && start_paddr < 0x10'0000);
+  const uint32_t vector =
+      static_cast<uint32_t>(start_paddr >> kPageSizeExponent);
+  SendInterProcessorInterrupt(dest_apic_id,
+                              kInterruptCommandDeliveryModeStartup |
+                                  kInterruptCommandBitLevelAssert | vector);
+}
+
+void LocalAPIC::SendFixedInterrupt(uint32_t dest_apic_id, uint8_t vector) {
+  SendInterProcessorInterrupt(dest_apic_id,
+                              kInterruptCommandDeliveryModeFixed |
+                                  kInterruptCommandBitLevelAssert | vector);
+}
+
+void LocalAPIC::SendInterProcessorInterrupt(uint32_t dest_apic_id,
+                                            uint32_t command) {
+  if (is_x2apic_) {
+    WriteMSR(MSRIndex::kx2APICInterruptCommand,
+             (static_cast<uint64_t>(dest_apic_id) << 32) | command);
+    return;
+  }
+  WriteRegister(kRegisterOffsetInterruptCommandHigh, dest_apic_id << 24);
+  WriteRegister(kRegisterOffsetInterruptCommandLow, command);
+  while (ReadRegister(kRegisterOffsetInterruptCommandLow) &
+         kInterruptCommandBitDeliveryPending) {
+    __builtin_ia32_pause();
+  }
+}
+
+void LocalAPIC::StartOneShotTimer(uint8_t vector, uint32_t count) {
+  // An initial count of 0 stops the timer.
+  assert(count);
+  WriteTimerRegisters(kTimerLVTModeOneShot | vector, count);
+}
+
+void LocalAPIC::StartTSCDeadlineTimer(uint8_t vector, uint64_t deadline_tsc) {
+  WriteTimerRegisters(kTimerLVTModeTSCDeadline | vector, 0);
+  // The MMIO write to LVT should be ordered before WRMSR to the deadline.
+  if (!is_x2apic_)
+    __asm__ volatile("mfence" ::: "memory");
+  WriteMSR(MSRIndex::kTSCDeadline, deadline_tsc);
+}
+
+// Switching the mode also disarms the TSC deadline.
+void LocalAPIC::StopTimer(void) {
+  WriteTimerRegisters(kTimerLVTModeOneShot | kTimerLVTBitMasked, 0);
+}
+
+uint32_t LocalAPIC::ReadTimerCurrentCount(void) {
+  if (is_x2apic_)
+    return static_cast<uint32_t>(
+        ReadMSR(MSRIndex::kx2APICTimerCurrentCount));
+  return ReadRegister(kRegisterOffsetTimerCurrentCount);
+}
+
+// The initial count is ignored in the TSC-deadline mode.
+void LocalAPIC::WriteTimerRegisters(uint32_t lvt, uint32_t initial_count) {
+  if (is_x2apic_) {
+    WriteMSR(MSRIndex::kx2APICTimerDivideConfig, kTimerDivideBy1);
+    WriteMSR(MSRIndex::kx2APICTimerLVT, lvt);
+    WriteMSR(MSRIndex::kx2APICTimerInitialCount, initial_count);
+    return;
+  }
+  WriteRegister(kRegisterOffsetTimerDivideConfig, kTimerDivideBy1);
+  WriteRegister(kRegisterOffsetTimerLVT, lvt);
+  WriteRegister(kRegisterOffsetTimerInitialCount, initial_count);
+}
+
 static uint32_t ReadIOAPICRegister(uint8_t reg_index) {
   *reinterpret_cast<volatile uint32_t*>(kIOAPICRegIndexAddr) = reg_index;
   return *reinterpret_cast<volatile uint32_t*>(kIOAPICRegDataAddr);
@@ -1,20 +1,54 @@
 #pragma once
 #include "generic.h"
 
+// Each processor has its own LocalAPIC at the same address, so an instance
+// should be initialized and used only on the processor it belongs to.
 class LocalAPIC {
  public:
   void Init(void);
   uint32_t GetID() { return id_; }
   bool Isx2APIC() { return is_x2apic_; }
   void SendEndOfInterrupt(void);
+  // Inter-processor interrupts to the processor with dest_apic_id.
+  void SendINIT(uint32_t dest_apic_id);
+  void SendStartup(uint32_t dest_apic_id, uint64_t start_paddr);
+  void SendFixedInterrupt(uint32_t dest_apic_id, uint8_t vector);
+  // The timer interrupts this processor with vector once. It counts down
+  // count at the bus clock, or waits for TSC to reach deadline_tsc.
+  void StartOneShotTimer(uint8_t vector, uint32_t count);
+  void StartTSCDeadlineTimer(uint8_t vector, uint64_t deadline_tsc);
+  void StopTimer(void);
+  uint32_t ReadTimerCurrentCount(void);
 
  private:
+  static constexpr uint64_t kRegisterOffsetSpuriousInterruptVector = 0xF0;
+  static constexpr uint64_t kRegisterOffsetInterruptCommandLow = 0x300;
+  static constexpr uint64_t kRegisterOffsetInterruptCommandHigh = 0x310;
+  static constexpr uint64_t kRegisterOffsetTimerLVT = 0x320;
+  static constexpr uint64_t kRegisterOffsetTimerInitialCount = 0x380;
+  static constexpr uint64_t kRegisterOffsetTimerCurrentCount = 0x390;
+  static constexpr uint64_t kRegisterOffsetTimerDivideConfig = 0x3E0;
+  static constexpr uint32_t kSpuriousInterruptVectorBitAPICEnabled = 1 << 8;
+  static constexpr uint32_t kInterruptCommandDeliveryModeFixed = 0b000 << 8;
+  static constexpr uint32_t kInterruptCommandDeliveryModeINIT = 0b101 << 8;
+  static constexpr uint32_t kInterruptCommandDeliveryModeStartup = 0b110 << 8;
+  static constexpr uint32_t kInterruptCommandBitDeliveryPending = 1 << 12;
+  static constexpr uint32_t kInterruptCommandBitLevelAssert = 1 << 14;
+  static constexpr uint32_t kTimerLVTModeOneShot = 0b00 << 17;
+  static constexpr uint32_t kTimerLVTModeTSCDeadline = 0b10 << 17;
+  static constexpr uint32_t kTimerLVTBitMasked = 1 << 16;
+  static constexpr uint32_t kTimerDivideBy1 = 0b1011;
+
   uint32_t ReadRegister(uint64_t offset) {
-    return *reinterpret_cast<uint32_t*>(kernel_virt_base_addr_ + offset);
+    return *reinterpret_cast<volatile uint32_t*>(kernel_virt_base_addr_ +
+                                                 offset);
   }
   void WriteRegister(uint64_t offset, uint32_t data) {
-    *reinterpret_cast<uint32_t*>(kernel_virt_base_addr_ + offset) = data;
+    *reinterpret_cast<volatile uint32_t*>(kernel_virt_base_addr_ + offset) =
+        data;
   }
+  void SendInterProcessorInterrupt(uint32_t dest_apic_id, uint32_t command);
+  void WriteTimerRegisters(uint32_t lvt, uint32_t initial_count);
   uint32_t* GetRegisterAddr(uint64_t offset) {
     return (uint32_t*)(base_addr_ + offset);
   }
@@ -11,7 +11,11 @@ constexpr uint32_t kMaxAddr = 0x8000'0008;
 
 constexpr uint32_t kCPUID01H_EDXBitAPIC = (1 << 9);
 constexpr uint32_t kCPUID01H_ECXBitx2APIC = (1 << 21);
+constexpr uint32_t kCPUID01H_ECXBitPCID = (1 << 17);
+constexpr uint32_t kCPUID01H_ECXBitTSCDeadline = (1 << 24);
 constexpr uint32_t kCPUID01H_EDXBitMSR = (1 << 5);
+constexpr uint32_t kCPUID80000001H_EDXBitPage1GB = (1 << 26);
+constexpr uint32_t kCPUID80000007H_EDXBitInvariantTSC = (1 << 8);
 constexpr uint64_t kIOAPICRegIndexAddr = 0xfec00000;
 constexpr uint64_t kIOAPICRegDataAddr = kIOAPICRegIndexAddr + 0x10;
 constexpr uint64_t kLocalAPICBaseBitAPICEnabled = (1 << 11);
@@ -19,6 +23,9 @@ constexpr uint64_t kLocalAPICBaseBitx2APICEnabled = (1 << 10);
 
 constexpr uint64_t kRFlagsInterruptEnable = (1ULL << 9);
 
+constexpr uint64_t kCR0BitWriteProtect = (1ULL << 16);
+constexpr uint64_t kCR4BitPCIDE = (1ULL << 17);
+
 packed_struct CPUFeatureSet {
   uint64_t max_phy_addr;
   uint64_t phy_addr_mask;               // = (1ULL << max_phy_addr) - 1
@@ -29,6 +36,11 @@ packed_struct CPUFeatureSet {
   bool x2apic;
   bool clfsh;
   bool clflushopt;
+  bool clwb;
+  bool page1gb;
+  bool pcid;
+  bool tsc_deadline;
+  bool invariant_tsc;
   char brand_string[48];
 };
 
@@ -158,7 +170,14 @@ static_assert(sizeof(IA_TSS64) == 104);
 
 enum class MSRIndex : uint32_t {
   kLocalAPICBase = 0x1b,
+  kTSCDeadline = 0x6e0,
   kx2APICEndOfInterrupt = 0x80b,
+  kx2APICSpuriousInterruptVector = 0x80f,
+  kx2APICInterruptCommand = 0x830,
+  kx2APICTimerLVT = 0x832,
+  kx2APICTimerInitialCount = 0x838,
+  kx2APICTimerCurrentCount = 0x839,
+  kx2APICTimerDivideConfig = 0x83e,
   kEFER = 0xC0000080,
   kSTAR = 0xC0000081,
   kLSTAR = 0xC0000082,
@@ -172,6 +191,7 @@ __attribute__((ms_abi)) void ReadCPUID(CPUID*, uint32_t eax, uint32_t ecx);
 
 __attribute__((ms_abi)) uint64_t ReadMSR(MSRIndex);
 __attribute__((ms_abi)) void WriteMSR(MSRIndex, uint64_t);
+__attribute__((ms_abi)) uint64_t ReadTSC(void);
 
 __attribute__((ms_abi)) void ReadGDTR(GDTR*);
 __attribute__((ms_abi)) void WriteGDTR(GDTR*);
@@ -186,6 +206,7 @@ __attribute__((ms_abi)) void WriteIOPort32(uint16_t addr, uint32_t data);
 __attribute__((ms_abi)) void StoreIntFlag(void);
 __attribute__((ms_abi)) void StoreIntFlagAndHalt(void);
 __attribute__((ms_abi)) void ClearIntFlag(void);
+__attribute__((ms_abi)) uint64_t ReadRFlags(void);
 [[noreturn]] __attribute__((ms_abi)) void Die(void);
 __attribute__((ms_abi)) uint16_t ReadCSSelector(void);
 __attribute__((ms_abi)) uint16_t ReadSSSelector(void);
@@ -193,12 +214,22 @@ __attribute__((ms_abi)) void WriteCSSelector(uint16_t);
 __attribute__((ms_abi)) void WriteSSSelector(uint16_t);
 __attribute__((ms_abi)) void WriteDataAndExtraSegmentSelectors(uint16_t);
 __attribute__((ms_abi)) uint64_t ReadCR2(void);
+__attribute__((ms_abi)) uint64_t ReadCR0(void);
+__attribute__((ms_abi)) void WriteCR0(uint64_t);
 __attribute__((ms_abi)) uint64_t ReadCR3(void);
 __attribute__((ms_abi)) void WriteCR3(uint64_t);
+__attribute__((ms_abi)) uint64_t ReadCR4(void);
+__attribute__((ms_abi)) void WriteCR4(uint64_t);
+__attribute__((ms_abi)) void InvalidateTLBEntry(const void*);
 __attribute__((ms_abi)) uint64_t CompareAndSwap(uint64_t*, uint64_t);
 __attribute__((ms_abi)) void SwapGS(void);
 __attribute__((ms_abi)) uint64_t ReadRSP(void);
 __attribute__((ms_abi)) void ChangeRSP(uint64_t);
+typedef void(__attribute__((ms_abi)) * StackedFunc)(void*);
+// Calls func(arg) on the stack which ends at stack_top.
+__attribute__((ms_abi)) void CallWithStack(uint64_t stack_top,
+                                           StackedFunc func,
+                                           void* arg);
 __attribute__((ms_abi)) void RepeatMoveBytes(size_t count,
                                              const void* dst,
                                              const void* src);
@@ -215,6 +246,14 @@ __attribute__((ms_abi)) void RepeatStore8Bytes(size_t count,
                                                const void* dst,
                                                uint64_t data);
 __attribute__((ms_abi)) void CLFlushOptimized(const void*);
+__attribute__((ms_abi)) void CLFlushLines(uint64_t addr, uint64_t num_of_lines);
+__attribute__((ms_abi)) void CLFlushOptLines(uint64_t addr,
+                                             uint64_t num_of_lines);
+__attribute__((ms_abi)) void CLWBLines(uint64_t addr, uint64_t num_of_lines);
+__attribute__((ms_abi)) void StoreFence(void);
+__attribute__((ms_abi)) void NonTemporalCopy8BytesAndFence(size_t count,
+                                                           void* dst,
+                                                           const void* src);
 __attribute__((ms_abi)) void JumpToKernel(void* kernel_entry_point,
                                           void* vram_sheet,
                                           uint64_t kernel_stack_pointer);
@@ -230,6 +269,7 @@ __attribute__((ms_abi)) void AsmIntHandler10_x87FPUError(void);
 __attribute__((ms_abi)) void AsmIntHandler13_SIMDFPException(void);
 __attribute__((ms_abi)) void AsmIntHandler20(void);
 __attribute__((ms_abi)) void AsmIntHandler21(void);
+__attribute__((ms_abi)) void AsmIntHandler22(void);
 __attribute__((ms_abi)) void AsmIntHandlerNotImplemented(void);
 __attribute__((ms_abi)) void Disable8259PIC(void);
 }
@@ -0,0 +1,43 @@
+#include "checkpointer.h"
+
+#include "clock.h"
+#include "liumos.h"
+
+void Checkpointer::Run() {
+  for (;;) {
+    wait_queue_.WaitUntil([this] { return !queue_.IsEmpty(); });
+    ClearIntFlag();
+    Process* proc = queue_.Pop();
+    StoreIntFlag();
+    Checkpoint(*proc);
+  }
+}
+
+void Checkpointer::Checkpoint(Process& proc) {
+  assert(proc.checkpoint_ctx_);
+  PersistentProcessInfo& pp_info = *proc.pp_info_;
+  assert(&pp_info.GetWorkingContext() == proc.checkpoint_ctx_);
+  const uint64_t t0 = Clock::NowNs();
+  // The snapshot cannot be modified here since pages written by the process
+  // are moved to copies.
+  pp_info.FlushWorkingContext(proc.num_of_clflush_issued_in_ctx_sw_,
+                              proc.is_checkpoint_incremental_);
+  pp_info.CommitWorkingContext();
+  // The new working context is not used until checkpoint_ctx_ is cleared.
+  pp_info.CopyValidContextToWorking(proc.copied_bytes_in_ctx_sw_,
+                                    proc.is_checkpoint_incremental_);
+
+  ClearIntFlag();
+  proc.WriteBackSnapshotPageCopies();
+  pp_info.GetWorkingContext().SetCPUContextExceptCR3(
+      proc.cpu_context_in_checkpoint_);
+  proc.checkpoint_ctx_->SetCopiedSegmentsWritable(true);
+  proc.checkpoint_ctx_ = nullptr;
+  liumos->scheduler->WakeUp(proc);
+  StoreIntFlag();
+
+  const uint64_t t1 = Clock::NowNs();
+  const uint64_t elapsed_fs = (t1 - t0) * kFemtosecondPerNs;
+  proc.time_consumed_in_bg_checkpoint_femto_sec_ += elapsed_fs;
+  Persistence::AddElapsedTimeFemtoSec(elapsed_fs);
+}
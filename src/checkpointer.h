@@ -0,0 +1,31 @@
+#pragma once
+
+#include "generic.h"
+#include "ring_buffer.h"
+#include "wait_queue.h"
+
+class Process;
+
+// Makes snapshots of persistent processes durable in a kernel task, so that
+// taking a snapshot in the timer interrupt only needs to save registers and
+// write-protect the snapshot.
+class Checkpointer {
+ public:
+  // Called with interrupts disabled. Returns false if the queue is full.
+  bool Enqueue(Process& proc) {
+    if (queue_.IsFull())
+      return false;
+    queue_.Push(&proc);
+    wait_queue_.WakeUpAll();
+    return true;
+  }
+  // Entry of the checkpointer task.
+  [[noreturn]] void Run();
+
+ private:
+  void Checkpoint(Process& proc);
+
+  static constexpr int kQueueSize = 64;
+  RingBuffer<Process*, kQueueSize> queue_;
+  WaitQueue wait_queue_;
+};
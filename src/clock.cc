@@ -0,0 +1,81 @@
+#include "clock.h"
+
+#include "liumos.h"
+
+namespace Clock {
+
+constexpr uint64_t kCalibrationMs = 10;
+// NowNs multiplies TSC by ns_per_tsc_scaled_ in two halves split at this
+// bit, so that neither product overflows.
+constexpr int kScaleShift = 24;
+constexpr uint64_t kScaleMask = (1ULL << kScaleShift) - 1;
+
+static HPET* hpet_;
+static bool is_tsc_used_;
+static uint64_t tsc_at_init_;
+static uint64_t ns_at_init_;
+// Nanoseconds per TSC count << kScaleShift.
+static uint64_t ns_per_tsc_scaled_;
+static uint64_t tsc_count_per_ms_;
+
+static uint64_t ReadHPETNs() {
+  const uint64_t count = hpet_->ReadMainCounterValue();
+  const uint64_t fs_per_count = hpet_->GetFemtosecondPerCount();
+  return count / kFemtosecondPerNs * fs_per_count +
+         count % kFemtosecondPerNs * fs_per_count / kFemtosecondPerNs;
+}
+
+// Assumes TSCs of all processors are in sync, which holds for invariant TSCs
+// of processors in one package.
+void Init(HPET& hpet, const CPUFeatureSet& f) {
+  hpet_ = &hpet;
+  is_tsc_used_ = false;
+  if (!f.invariant_tsc) {
+    Print();
+    return;
+  }
+  const uint64_t hpet_begin = ReadHPETNs();
+  const uint64_t tsc_begin = ReadTSC();
+  uint64_t hpet_end;
+  do {
+    __builtin_ia32_pause();
+    hpet_end = ReadHPETNs();
+  } while (hpet_end - hpet_begin < kCalibrationMs * kNsPerMs);
+  const uint64_t tsc_end = ReadTSC();
+  ns_per_tsc_scaled_ =
+      ((hpet_end - hpet_begin) << kScaleShift) / (tsc_end - tsc_begin);
+  tsc_count_per_ms_ =
+      (tsc_end - tsc_begin) * kNsPerMs / (hpet_end - hpet_begin);
+  tsc_at_init_ = tsc_end;
+  ns_at_init_ = hpet_end;
+  is_tsc_used_ = true;
+  Print();
+}
+
+uint64_t NowNs() {
+  if (!is_tsc_used_)
+    return ReadHPETNs();
+  const uint64_t tsc = ReadTSC() - tsc_at_init_;
+  return ns_at_init_ + (tsc >> kScaleShift) * ns_per_tsc_scaled_ +
+         (((tsc & kScaleMask) * ns_per_tsc_scaled_) >> kScaleShift);
+}
+
+bool IsTSCUsed() {
+  return is_tsc_used_;
+}
+
+uint64_t NsToTSCCount(uint64_t ns) {
+  assert(is_tsc_used_);
+  return ns / kNsPerMs * tsc_count_per_ms_ +
+         ns % kNsPerMs * tsc_count_per_ms_ / kNsPerMs;
+}
+
+void Print() {
+  PutString("Clock: ");
+  PutString(is_tsc_used_ ? "invariant TSC\n" : "HPET\n");
+  if (is_tsc_used_) {
+    PutStringAndDecimal("  TSC count per ms", tsc_count_per_ms_);
+  }
+}
+
+}  // namespace Clock
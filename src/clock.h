@@ -0,0 +1,24 @@
+#pragma once
+
+#include "asm.h"
+#include "generic.h"
+
+class HPET;
+
+constexpr uint64_t kNsPerMs = 1000'000;
+constexpr uint64_t kFemtosecondPerNs = 1000'000;
+
+// Monotonic time since boot for measurements and deadlines. It is read from
+// TSC if TSC is invariant, which costs tens of cycles instead of an HPET read
+// over MMIO which costs about a microsecond. The rate of TSC is measured
+// against HPET at boot. Otherwise, the HPET main counter is read.
+namespace Clock {
+
+void Init(HPET& hpet, const CPUFeatureSet& f);
+uint64_t NowNs();
+bool IsTSCUsed();
+// Converts a duration into TSC counts. Valid only if IsTSCUsed().
+uint64_t NsToTSCCount(uint64_t ns);
+void Print();
+
+}  // namespace Clock
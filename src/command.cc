@@ -3,9 +3,11 @@
 
 #include <vector>
 
+#include "clock.h"
 #include "liumos.h"
 #include "pci.h"
 #include "pmem.h"
+#include "timer.h"
 #include "xhci.h"
 
 namespace ConsoleCommand {
@@ -360,6 +362,11 @@ void ShowEFIMemoryMap() {
 void Free() {
   PutString("DRAM Free List:\n");
   liumos->dram_allocator->Print();
+  PutStringAndHex("Kernel heap free bytes",
+                  liumos->kernel_heap_allocator->GetNumOfFreeBytes());
+  PutStringAndHex("Kernel heap leaked bytes",
+                  liumos->kernel_heap_allocator->GetNumOfLeakedBytes());
+  liumos->slab_allocator->Print();
 }
 
 bool IsEqualString(const char* a, const char* b) {
@@ -378,8 +385,9 @@ void label(uint64_t i) {
   PutString(",");
 }
 
+// Returns nanoseconds. Read in tight loops, so it avoids HPET accesses.
 uint64_t get_seconds() {
-  return liumos->hpet->ReadMainCounterValue();
+  return Clock::NowNs();
 }
 
 void TestMem(PhysicalPageAllocator* allocator, uint32_t proximity_domain) {
@@ -388,8 +396,8 @@ void TestMem(PhysicalPageAllocator* allocator, uint32_t proximity_domain) {
   PutStringAndHex("Test memory on proximity_domain", proximity_domain);
   constexpr uint64_t array_size_in_pages =
       (sizeof(int) * kRangeMax + kPageSize - 1) >> kPageSizeExponent;
-  int* array = allocator->AllocPagesInProximityDomain<int*>(array_size_in_pages,
-                                                            proximity_domain);
+  int* array = allocator->TryAllocPagesStrictlyInProximityDomain<int*>(
+      array_size_in_pages, proximity_domain);
   if (!array) {
     PutString("Alloc failed.");
     return;
@@ -412,8 +420,7 @@ void TestMem(PhysicalPageAllocator* allocator, uint32_t proximity_domain) {
   uint64_t csize, stride;
   uint64_t steps, tsteps;
   uint64_t t0, t1, tick_sum_overall, tick_sum_loop_only;
-  uint64_t kDurationTick =
-      (uint64_t)(0.1 * 1e15) / liumos->hpet->GetFemtosecondPerCount();
+  constexpr uint64_t kDurationTick = 100 * kNsPerMs;
 
   PutString(" ,");
   for (stride = 1; stride <= kRangeMax / 2; stride = stride * 2)
@@ -469,8 +476,7 @@ void TestMem(PhysicalPageAllocator* allocator, uint32_t proximity_domain) {
       const uint64_t tick_sum_of_mem_read =
           tick_sum_overall - tick_sum_loop_only;
       const uint64_t pico_second_per_mem_read =
-          tick_sum_of_mem_read * liumos->hpet->GetFemtosecondPerCount() /
-          (steps * csize) / 1000;
+          tick_sum_of_mem_read * 1000 / (steps * csize);
       PutString("0x");
       PutHex64(pico_second_per_mem_read > 0 ? pico_second_per_mem_read : 1);
       PutString(", ");
@@ -486,8 +492,8 @@ void TestMemWrite(PhysicalPageAllocator* allocator, uint32_t proximity_domain) {
   PutStringAndHex("Test memory on proximity_domain", proximity_domain);
   constexpr uint64_t array_size_in_pages =
       (sizeof(int) * kRangeMax + kPageSize - 1) >> kPageSizeExponent;
-  int* array = allocator->AllocPagesInProximityDomain<int*>(array_size_in_pages,
-                                                            proximity_domain);
+  int* array = allocator->TryAllocPagesStrictlyInProximityDomain<int*>(
+      array_size_in_pages, proximity_domain);
   if (!array) {
     PutString("Alloc failed.");
     return;
@@ -510,8 +516,7 @@ void TestMemWrite(PhysicalPageAllocator* allocator, uint32_t proximity_domain) {
   uint64_t csize, stride;
   uint64_t steps, tsteps;
   uint64_t t0, t1;
-  uint64_t kDurationTick =
-      (uint64_t)(0.1 * 1e15) / liumos->hpet->GetFemtosecondPerCount();
+  constexpr uint64_t kDurationTick = 100 * kNsPerMs;
 
   PutString(" ,");
   for (stride = 1; stride <= kRangeMax / 2; stride = stride * 2)
@@ -568,8 +573,7 @@ void TestMemWrite(PhysicalPageAllocator* allocator, uint32_t proximity_domain) {
       const uint64_t tick_sum_access_only =
           tick_sum_overall - tick_sum_loop_only;
       const uint64_t pico_second_per_mem_read =
-          tick_sum_access_only * liumos->hpet->GetFemtosecondPerCount() /
-          (steps * csize) / 1000;
+          tick_sum_access_only * 1000 / (steps * csize);
       if (pico_second_per_mem_read == 0) {
         PutString(", ");
         continue;
@@ -593,6 +597,105 @@ void Version() {
   PutString("\n\n");
 }
 
+static void SetPersistenceStrategy(const char* name) {
+  for (int i = 0;
+       i < static_cast<int>(Persistence::Strategy::kNumOfStrategies); i++) {
+    Persistence::Strategy strategy = static_cast<Persistence::Strategy>(i);
+    if (!IsEqualString(name, Persistence::GetStrategyName(strategy)))
+      continue;
+    if (!Persistence::IsAvailable(strategy)) {
+      PutString("Not supported on this CPU\n");
+      return;
+    }
+    Persistence::SetStrategy(strategy);
+    return;
+  }
+  PutString("Unknown flush instruction\n");
+}
+
+// Parses "<N> ms" or "<N> switches".
+static void SetCheckpointPeriod(const char* arg) {
+  using Trigger = CheckpointPolicy::Trigger;
+  const int period = atoi(arg);
+  while ('0' <= *arg && *arg <= '9')
+    arg++;
+  while (*arg == ' ')
+    arg++;
+  if (period <= 0) {
+    PutString("Period should be a positive number\n");
+    return;
+  }
+  CheckpointPolicy policy;
+  if (IsEqualString(arg, "ms")) {
+    policy.trigger = Trigger::kInterval;
+  } else if (IsEqualString(arg, "switches")) {
+    policy.trigger = Trigger::kSwitches;
+  } else {
+    PutString("Unit should be ms or switches\n");
+    return;
+  }
+  policy.period = period;
+  liumos->checkpoint_policy = policy;
+}
+
+static void RestorePersistentProcess(PersistentProcessInfo* pp_info) {
+  if (!pp_info || !pp_info->IsValid() || !pp_info->HasValidContext()) {
+    PutString("No persistent process info found.\n");
+    return;
+  }
+  PutString("Restoring process...\n");
+  pp_info->Print();
+  Process& proc = liumos->proc_ctrl->RestoreFromPersistentProcessInfo(*pp_info);
+  liumos->scheduler->RegisterProcess(proc);
+  liumos->scheduler->WaitUntilExit(proc);
+  liumos->scheduler->UnregisterProcess(proc);
+  liumos->proc_ctrl->Destroy(proc);
+}
+
+// Runs num_of_procs instances of file at the same time. The real time should
+// shrink with the number of processors.
+static void RunInParallel(EFIFile& file, int num_of_procs) {
+  constexpr int kMaxNumOfProcs = 64;
+  if (num_of_procs <= 0 || kMaxNumOfProcs < num_of_procs) {
+    PutStringAndDecimal("Number of processes should be 1 to", kMaxNumOfProcs);
+    return;
+  }
+  Process* procs[kMaxNumOfProcs];
+  for (int i = 0; i < num_of_procs; i++) {
+    procs[i] = &LoadELFAndCreateEphemeralProcess(file);
+  }
+  uint64_t t0 = Clock::NowNs();
+  for (int i = 0; i < num_of_procs; i++) {
+    liumos->scheduler->RegisterProcess(*procs[i]);
+  }
+  for (int i = 0; i < num_of_procs; i++) {
+    liumos->scheduler->WaitUntilExit(*procs[i]);
+  }
+  uint64_t t1 = Clock::NowNs();
+  PutStringAndDecimalWithPointPos("  realtime           (sec)", t1 - t0, 9);
+  for (int i = 0; i < num_of_procs; i++) {
+    PutStringAndDecimal("  process ran on CPU #", procs[i]->GetCPUIndex());
+    liumos->scheduler->UnregisterProcess(*procs[i]);
+    liumos->proc_ctrl->Destroy(*procs[i]);
+  }
+}
+
+static void ShowCPUs() {
+  for (int i = 0; i < GetNumOfCPUs(); i++) {
+    CPU& cpu = GetCPU(i);
+    PutString("CPU #");
+    PutDecimal64(i);
+    PutString(cpu.IsStarted() ? " started" : " not started");
+    PutStringAndHex(", APIC ID", cpu.GetAPICID());
+    if (!cpu.IsStarted())
+      continue;
+    PutStringAndDecimal("  proximity_domain", cpu.GetProximityDomain());
+    PutStringAndDecimal("  processes",
+                        liumos->scheduler->GetNumOfProcessesOnCPU(i));
+    PutStringAndDecimal("  steals", liumos->scheduler->GetNumOfStealsOnCPU(i));
+  }
+}
+
 static void ListPCIDevices() {
   PutString("lspci:\n");
   PCI::GetInstance().PrintDevices();
@@ -622,6 +725,9 @@ void Run(TextBox& tbox) {
     ShowEFIMemoryMap();
   } else if (IsEqualString(line, "show hpet")) {
     liumos->hpet->Print();
+  } else if (IsEqualString(line, "show timer")) {
+    Clock::Print();
+    liumos->timer->Print();
   } else if (IsEqualString(line, "show cpu")) {
     PutString("APIC Mode: ");
     PutString(liumos->bsp_local_apic->Isx2APIC() ? "x2APIC" : "xAPIC");
@@ -631,60 +737,93 @@ void Run(TextBox& tbox) {
       PutStringAndHex("  proximity_domain",
                       liumos->acpi.srat->GetProximityDomainForLocalAPIC(
                           *liumos->bsp_local_apic));
+    ShowCPUs();
   } else if (IsEqualString(line, "pmem show")) {
     for (int i = 0; i < LiumOS::kNumOfPMEMManagers; i++) {
       if (!liumos->pmem[i])
         break;
       liumos->pmem[i]->Print();
     }
+    liumos->pmem_allocator->Print();
   } else if (IsEqualString(line, "pmem init")) {
     for (int i = 0; i < LiumOS::kNumOfPMEMManagers; i++) {
       if (!liumos->pmem[i])
         break;
       liumos->pmem[i]->Init();
     }
+  } else if (IsEqualString(line, "pmem gc")) {
+    liumos->pmem_allocator->CollectGarbage();
+    liumos->pmem_allocator->Print();
   } else if (IsEqualString(line, "pmem alloc")) {
     if (!liumos->pmem[0]) {
       PutString("PMEM not found\n");
       return;
     }
-    uint64_t obj_addr = liumos->pmem[0]->AllocPages<uint64_t>(3);
+    uint64_t obj_addr = liumos->pmem_allocator->AllocPages<uint64_t>(3);
     PutStringAndHex("Allocated object at", obj_addr);
   } else if (IsEqualString(line, "pmem ls")) {
     if (!liumos->pmem[0]) {
       PutString("PMEM not found\n");
       return;
     }
-    PersistentProcessInfo* pp_info =
-        liumos->pmem[0]->GetLastPersistentProcessInfo();
-    pp_info->Print();
+    liumos->pmem[0]->PrintNamedObjects();
   } else if (IsEqualString(line, "pmem restore")) {
     if (!liumos->pmem[0]) {
       PutString("PMEM not found\n");
       return;
     }
-    PersistentProcessInfo* pp_info =
-        liumos->pmem[0]->GetLastPersistentProcessInfo();
-    if (!pp_info) {
-      PutString("No persistent process info found.\n");
+    RestorePersistentProcess(liumos->pmem[0]->GetLastPersistentProcessInfo());
+  } else if (strncmp(line, "pmem restore #", 14) == 0) {
+    if (!liumos->pmem[0]) {
+      PutString("PMEM not found\n");
       return;
     }
-    PutString("Restoring process...\n");
-    pp_info->Print();
-    Process& proc =
-        liumos->proc_ctrl->RestoreFromPersistentProcessInfo(*pp_info);
-    liumos->scheduler->RegisterProcess(proc);
-    proc.WaitUntilExit();
+    RestorePersistentProcess(
+        liumos->pmem_allocator->FindPersistentProcessInfoByID(
+            atoi(&line[14])));
+  } else if (strncmp(line, "pmem restore ", 13) == 0) {
+    if (!liumos->pmem[0]) {
+      PutString("PMEM not found\n");
+      return;
+    }
+    RestorePersistentProcess(
+        liumos->pmem_allocator->FindPersistentProcessInfoByName(&line[13]));
   } else if (IsEqualString(line, "pmem run pi.bin")) {
     assert(liumos->pmem[0]);
     Process& proc = LoadELFAndCreatePersistentProcess(
-        *liumos->loader_info.files.pi_bin, *liumos->pmem[0]);
+        *liumos->loader_info.files.pi_bin, *liumos->pmem_allocator);
     liumos->scheduler->LaunchAndWaitUntilExit(proc);
   } else if (IsEqualString(line, "pmem run hello.bin")) {
     assert(liumos->pmem[0]);
     Process& proc = LoadELFAndCreatePersistentProcess(
-        *liumos->loader_info.files.hello_bin, *liumos->pmem[0]);
+        *liumos->loader_info.files.hello_bin, *liumos->pmem_allocator);
     liumos->scheduler->LaunchAndWaitUntilExit(proc);
+  } else if (IsEqualString(line, "checkpoint full")) {
+    liumos->is_incremental_checkpoint_enabled = false;
+  } else if (IsEqualString(line, "checkpoint incremental")) {
+    liumos->is_incremental_checkpoint_enabled = true;
+  } else if (IsEqualString(line, "checkpoint policy")) {
+    CheckpointPolicy policy = liumos->checkpoint_policy;
+    PutString("checkpoint policy: ");
+    policy.Print();
+  } else if (strncmp(line, "checkpoint every ", 17) == 0) {
+    SetCheckpointPeriod(&line[17]);
+  } else if (IsEqualString(line, "checkpoint on syscall")) {
+    liumos->checkpoint_policy.trigger = CheckpointPolicy::Trigger::kSyscall;
+  } else if (IsEqualString(line, "checkpoint sync")) {
+    liumos->is_async_checkpoint_enabled = false;
+  } else if (IsEqualString(line, "checkpoint async")) {
+    // Writes from the kernel to write-protected snapshots fault as well
+    // since CR0.WP is set on every processor at boot.
+    liumos->is_async_checkpoint_enabled = true;
+  } else if (IsEqualString(line, "persist show")) {
+    Persistence::PrintStatistics();
+  } else if (strncmp(line, "persist flush ", 14) == 0) {
+    SetPersistenceStrategy(&line[14]);
+  } else if (IsEqualString(line, "persist copy nt")) {
+    Persistence::SetNonTemporalCopyEnabled(true);
+  } else if (IsEqualString(line, "persist copy memcpy")) {
+    Persistence::SetNonTemporalCopyEnabled(false);
   } else if (strncmp(line, "test mem ", 9) == 0) {
     int proximity_domain = atoi(&line[9]);
     TestMem(liumos->dram_allocator, proximity_domain);
@@ -703,15 +842,16 @@ void Run(TextBox& tbox) {
     Process& proc =
         LoadELFAndCreateEphemeralProcess(*liumos->loader_info.files.pi_bin);
     liumos->scheduler->LaunchAndWaitUntilExit(proc);
+  } else if (IsEqualString(line, "forktest.bin")) {
+    Process& proc = LoadELFAndCreateEphemeralProcess(
+        *liumos->loader_info.files.forktest_bin);
+    liumos->scheduler->LaunchAndWaitUntilExit(proc);
+  } else if (strncmp(line, "pi.bin ", 7) == 0) {
+    RunInParallel(*liumos->loader_info.files.pi_bin, atoi(&line[7]));
   } else if (strncmp(line, "eval ", 5) == 0) {
     int us = atoi(&line[5]);
     PutStringAndHex("Eval in time slice", us);
-    ClearIntFlag();
-    liumos->hpet->SetTimerNs(
-        0, us,
-        HPET::TimerConfig::kUsePeriodicMode | HPET::TimerConfig::kEnable);
-
-    StoreIntFlag();
+    liumos->timer->SetTimeSliceNs(static_cast<uint64_t>(us) * 1000);
 
     assert(liumos->pmem[0]);
     constexpr int kNumOfTestRun = 5;
@@ -728,7 +868,7 @@ void Run(TextBox& tbox) {
     uint64_t ns_sum_persistent = 0;
     for (int i = 0; i < kNumOfTestRun; i++) {
       Process& proc = LoadELFAndCreatePersistentProcess(
-          *liumos->loader_info.files.pi_bin, *liumos->pmem[0]);
+          *liumos->loader_info.files.pi_bin, *liumos->pmem_allocator);
       ns_sum_persistent += liumos->scheduler->LaunchAndWaitUntilExit(proc);
     }
     PutString("timeslice(us), ephemeral avg(ns), persistent avg(ns)\n");
@@ -755,6 +895,10 @@ void Run(TextBox& tbox) {
     PutStringAndHex("phy_addr_mask", f.phy_addr_mask);
     PutStringAndBool("CLFLUSH supported", f.clfsh);
     PutStringAndBool("CLFLUSHOPT supported", f.clflushopt);
+    PutStringAndBool("CLWB supported", f.clwb);
+    PutStringAndBool("1GB pages supported", f.page1gb);
+    PutStringAndBool("PCID supported", f.pcid);
+    PutStringAndBool("PCID enabled", liumos->is_pcid_enabled);
   } else if (IsEqualString(line, "lspci")) {
     ListPCIDevices();
   } else if (IsEqualString(line, "version")) {
@@ -768,8 +912,25 @@ void Run(TextBox& tbox) {
     PutString("show slit: Print SLIT Entries\n");
     PutString("show mmap: Print UEFI MemoryMap\n");
     PutString("test mem: Test memory access \n");
-    PutString("free: show memory free entries\n");
+    PutString("free: show memory free entries and slab usage\n");
     PutString("time: show HPET main counter value\n");
+    PutString(
+        "checkpoint full|incremental: copy whole segments or only dirty "
+        "pages on checkpoints\n");
+    PutString(
+        "checkpoint sync|async: make checkpoints durable in the timer "
+        "interrupt or in a kernel task\n");
+    PutString(
+        "checkpoint every <N> ms|switches, checkpoint on syscall: set the "
+        "policy for new processes\n");
+    PutString("checkpoint policy: show the policy for new processes\n");
+    PutString("persist show: show flush strategy and statistics\n");
+    PutString("persist flush clflush|clflushopt|clwb: select flush insn\n");
+    PutString("persist copy nt|memcpy: select copy method into pmem\n");
+    PutString("pmem gc: reclaim pmem of exited persistent processes\n");
+    PutString("pmem ls: list persistent processes\n");
+    PutString("pmem restore [<name>|#<id>]: restore a persistent process\n");
+    PutString("forktest.bin: check the stack of a parent after fork\n");
   } else if (IsEqualString(line, "testscroll")) {
     uint64_t t0 = liumos->hpet->ReadMainCounterValue();
     uint64_t t1 =
@@ -841,6 +1002,8 @@ void Run(TextBox& tbox) {
 }
 
 void WaitAndProcess(TextBox& tbox) {
+  // Events of xHCI are polled one by one since it does not raise interrupts.
+  constexpr uint64_t kInputPollIntervalMs = 1;
   PutString("> ");
   tbox.StartRecording();
   while (1) {
@@ -848,7 +1011,7 @@ void WaitAndProcess(TextBox& tbox) {
     while ((keyid = liumos->main_console->GetCharWithoutBlocking()) ==
            KeyID::kNoInput) {
       XHCI::Controller::GetInstance().PollEvents();
-      StoreIntFlagAndHalt();
+      liumos->timer->SleepForMs(kInputPollIntervalMs);
     }
     if (keyid == '\n') {
       tbox.StopRecording();
@@ -6,6 +6,7 @@
 #endif
 
 void Console::PutChar(char c) {
+  SpinLockGuard guard(lock_);
   if (serial_port_) {
     if (c == '\n')
       serial_port_->SendChar('\r');
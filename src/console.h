@@ -1,5 +1,6 @@
 #pragma once
 #include "generic.h"
+#include "spin_lock.h"
 
 class Sheet;
 class SerialPort;
@@ -41,6 +42,8 @@ class Console {
   int cursor_x_, cursor_y_;
   Sheet* sheet_;
   SerialPort* serial_port_;
+  // Processes on any processor may print.
+  SpinLock lock_;
 };
 
 void PutChar(char c);
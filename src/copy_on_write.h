@@ -0,0 +1,255 @@
+#pragma once
+
+#ifdef LIUMOS_TEST
+#include "paging.h"
+#else
+// paging.h depends on declarations in liumos.h when it is not for tests.
+#include "liumos.h"
+#endif
+#include "spin_lock.h"
+
+// Reference counts of page frames mapped by more than one page table.
+// Frames which are not in the table are referenced only once, so only frames
+// shared by fork take a slot. Slots are found by linear probing and removed
+// by shifting back the following slots, so no tombstones are left.
+// Processes sharing frames may run on different processors, so every
+// operation takes the lock.
+class PageFrameTable {
+ public:
+  static constexpr int kNumOfSlotsExponent = 13;
+  static constexpr int kNumOfSlots = 1 << kNumOfSlotsExponent;
+  // Probe sequences are kept short by leaving a quarter of slots empty.
+  static constexpr int kMaxNumOfSharedFrames = kNumOfSlots / 4 * 3;
+
+  void Init() {
+    for (auto& slot : slots_) {
+      slot.ref_count = 0;
+    }
+    num_of_shared_frames_ = 0;
+  }
+  uint64_t GetRefCount(uint64_t paddr) {
+    SpinLockGuard guard(lock_);
+    const int idx = FindSlot(paddr);
+    return slots_[idx].ref_count ? slots_[idx].ref_count : 1;
+  }
+  // Returns false if there is no room to track one more shared frame.
+  bool AddRef(uint64_t paddr) {
+    SpinLockGuard guard(lock_);
+    const int idx = FindSlot(paddr);
+    Slot& slot = slots_[idx];
+    if (slot.ref_count) {
+      slot.ref_count++;
+      return true;
+    }
+    if (num_of_shared_frames_ >= kMaxNumOfSharedFrames)
+      return false;
+    slot.paddr = paddr;
+    slot.ref_count = 2;
+    num_of_shared_frames_++;
+    return true;
+  }
+  // Drops a reference to paddr. Returns true if it was the last one and the
+  // frame should be freed by the caller.
+  bool Release(uint64_t paddr) {
+    SpinLockGuard guard(lock_);
+    const int idx = FindSlot(paddr);
+    Slot& slot = slots_[idx];
+    if (!slot.ref_count)
+      return true;
+    if (--slot.ref_count == 1)
+      RemoveSlotAt(idx);
+    return false;
+  }
+  int GetNumOfSharedFrames() const { return num_of_shared_frames_; }
+
+ private:
+  struct Slot {
+    uint64_t paddr;
+    uint64_t ref_count;  // 0 if the slot is empty
+  };
+  static constexpr int kSlotIndexMask = kNumOfSlots - 1;
+  static int GetHomeIndex(uint64_t paddr) {
+    // Fibonacci hashing of the frame number.
+    return static_cast<int>(((paddr >> kPageSizeExponent) *
+                             0x9E37'79B9'7F4A'7C15ULL) >>
+                            (64 - kNumOfSlotsExponent));
+  }
+  // Returns the slot of paddr, or the empty slot to put it in.
+  int FindSlot(uint64_t paddr) const {
+    int idx = GetHomeIndex(paddr);
+    while (slots_[idx].ref_count && slots_[idx].paddr != paddr) {
+      idx = (idx + 1) & kSlotIndexMask;
+    }
+    return idx;
+  }
+  void RemoveSlotAt(int hole) {
+    for (int idx = (hole + 1) & kSlotIndexMask; slots_[idx].ref_count;
+         idx = (idx + 1) & kSlotIndexMask) {
+      // The slot can be moved to the hole unless the hole is before its home.
+      const int dist_from_home =
+          (idx - GetHomeIndex(slots_[idx].paddr)) & kSlotIndexMask;
+      const int dist_from_hole = (idx - hole) & kSlotIndexMask;
+      if (dist_from_home < dist_from_hole)
+        continue;
+      slots_[hole] = slots_[idx];
+      hole = idx;
+    }
+    slots_[hole].ref_count = 0;
+    num_of_shared_frames_--;
+  }
+
+  Slot slots_[kNumOfSlots];
+  int num_of_shared_frames_;
+  SpinLock lock_;
+};
+
+// Forwards to TAllocator, except that frames which are still mapped by other
+// page tables are not freed. Pass this to DestroyUserPageTables to destroy
+// page tables cloned by CloneUserPageTables.
+template <class TAllocator>
+class SharedFrameAwareAllocator {
+ public:
+  SharedFrameAwareAllocator(TAllocator& allocator, PageFrameTable& table)
+      : allocator_(allocator), table_(table) {}
+  template <typename T>
+  T AllocPages(uint64_t num_of_pages) {
+    return allocator_.template AllocPages<T>(num_of_pages);
+  }
+  void FreePages(void* phys_addr, uint64_t num_of_pages) {
+    if (!table_.Release(reinterpret_cast<uint64_t>(phys_addr)))
+      return;
+    allocator_.FreePages(phys_addr, num_of_pages);
+  }
+
+ private:
+  TAllocator& allocator_;
+  PageFrameTable& table_;
+};
+
+static inline void CopyPageFrames(uint64_t dst_paddr,
+                                  uint64_t src_paddr,
+                                  uint64_t num_of_pages) {
+  uint64_t* dst = reinterpret_cast<uint64_t*>(dst_paddr);
+  const uint64_t* src = reinterpret_cast<const uint64_t*>(src_paddr);
+  for (uint64_t i = 0; i < (num_of_pages << kPageSizeExponent) / 8; i++) {
+    dst[i] = src[i];
+  }
+}
+
+template <class TAllocator, class TEntry>
+void inline CloneLeafMapping(TAllocator& allocator,
+                             PageFrameTable& table,
+                             TEntry& from,
+                             TEntry& to) {
+  const uint64_t paddr = from.GetPageBaseAddr();
+  if (from.IsShared()) {
+    to.data = from.data;
+    return;
+  }
+  const bool is_read_only = !from.IsWritable() && !from.IsCopyOnWrite();
+  if ((TEntry::kChunkSize == kPageSize || is_read_only) &&
+      table.AddRef(paddr)) {
+    if (from.IsWritable()) {
+      from.SetWritable(false);
+      from.SetCopyOnWrite(true);
+    }
+    to.data = from.data;
+    return;
+  }
+  // Writable large pages and pages which cannot be tracked are copied now.
+  const uint64_t num_of_pages = TEntry::kChunkSize >> kPageSizeExponent;
+  const uint64_t copy = allocator.template AllocPages<uint64_t>(num_of_pages);
+  CopyPageFrames(copy, paddr, num_of_pages);
+  to.data = from.data;
+  to.SetPageBaseAddr(copy, from.data & kPageAttrMask);
+  if (to.IsCopyOnWrite()) {
+    to.SetCopyOnWrite(false);
+    to.SetWritable(true);
+  }
+}
+
+// Maps every page in the lower (user) half of `from` to `to` for fork.
+// Writable 4KB pages are made read-only and copy-on-write in both of them.
+// Pages mapped with kPageAttrShared are mapped as they are. Page tables are
+// accessed with their physical addresses. The caller flushes the TLB for
+// `from` since its pages may have been made read-only.
+template <class TAllocator>
+void inline CloneUserPageTables(TAllocator& allocator,
+                                PageFrameTable& table,
+                                IA_PML4& from,
+                                IA_PML4& to) {
+  for (int pml4_idx = 0; pml4_idx < IA_PML4::kNumOfEntries / 2; pml4_idx++) {
+    auto& pml4e = from.entries[pml4_idx];
+    if (!pml4e.IsPresent())
+      continue;
+    IA_PDPT& pdpt = *pml4e.GetTableAddr();
+    IA_PDPT& new_pdpt = AllocPageTable<TAllocator, IA_PDPT>(allocator);
+    to.entries[pml4_idx].SetTableAddr(&new_pdpt, pml4e.data & kPageAttrMask);
+    for (int pdpt_idx = 0; pdpt_idx < IA_PDPT::kNumOfEntries; pdpt_idx++) {
+      auto& pdpte = pdpt.entries[pdpt_idx];
+      if (!pdpte.IsPresent())
+        continue;
+      if (pdpte.IsPage()) {
+        CloneLeafMapping(allocator, table, pdpte, new_pdpt.entries[pdpt_idx]);
+        continue;
+      }
+      IA_PDT& pdt = *pdpte.GetTableAddr();
+      IA_PDT& new_pdt = AllocPageTable<TAllocator, IA_PDT>(allocator);
+      new_pdpt.entries[pdpt_idx].SetTableAddr(&new_pdt,
+                                              pdpte.data & kPageAttrMask);
+      for (int pdt_idx = 0; pdt_idx < IA_PDT::kNumOfEntries; pdt_idx++) {
+        auto& pdte = pdt.entries[pdt_idx];
+        if (!pdte.IsPresent())
+          continue;
+        if (pdte.IsPage()) {
+          CloneLeafMapping(allocator, table, pdte, new_pdt.entries[pdt_idx]);
+          continue;
+        }
+        IA_PT& pt = *pdte.GetTableAddr();
+        IA_PT& new_pt = AllocPageTable<TAllocator, IA_PT>(allocator);
+        new_pdt.entries[pdt_idx].SetTableAddr(&new_pt,
+                                              pdte.data & kPageAttrMask);
+        for (int pt_idx = 0; pt_idx < IA_PT::kNumOfEntries; pt_idx++) {
+          auto& pte = pt.entries[pt_idx];
+          if (!pte.IsPresent())
+            continue;
+          CloneLeafMapping(allocator, table, pte, new_pt.entries[pt_idx]);
+        }
+      }
+    }
+  }
+}
+
+// Makes the page at vaddr writable if it is mapped copy-on-write. The page is
+// copied unless no other page table maps it anymore. Returns false if the
+// page is not mapped copy-on-write. The caller invalidates the TLB entry.
+template <class TAllocator>
+bool inline ResolveCopyOnWrite(TAllocator& allocator,
+                               PageFrameTable& table,
+                               IA_PML4& pml4,
+                               uint64_t vaddr) {
+  auto& pml4e = pml4.GetEntryForAddr(vaddr);
+  if (!pml4e.IsPresent())
+    return false;
+  auto& pdpte = pml4e.GetTableAddr()->GetEntryForAddr(vaddr);
+  if (!pdpte.IsPresent() || pdpte.IsPage())
+    return false;
+  auto& pdte = pdpte.GetTableAddr()->GetEntryForAddr(vaddr);
+  if (!pdte.IsPresent() || pdte.IsPage())
+    return false;
+  auto& pte = pdte.GetTableAddr()->GetEntryForAddr(vaddr);
+  if (!pte.IsPresent() || !pte.IsCopyOnWrite())
+    return false;
+  const uint64_t paddr = pte.GetPageBaseAddr();
+  if (table.GetRefCount(paddr) > 1) {
+    const uint64_t copy = allocator.template AllocPages<uint64_t>(1);
+    CopyPageFrames(copy, paddr, 1);
+    // The other sharer may have copied it at the same time.
+    if (table.Release(paddr))
+      allocator.FreePages(reinterpret_cast<void*>(paddr), 1);
+    pte.SetPageBaseAddr(copy, pte.data & kPageAttrMask);
+  }
+  pte.SetCopyOnWrite(false);
+  pte.SetWritable(true);
+  return true;
+}
@@ -117,13 +117,7 @@ static const Elf64_Ehdr* ParseProgramHeader(EFIFile& file,
   return ehdr;
 }
 
-template <class TAllocator>
-static void LoadAndMapSegment(TAllocator& allocator,
-                              IA_PML4& page_root,
-                              SegmentMapping& seg_map,
-                              PhdrInfo& phdr_info,
-                              uint64_t page_attr,
-                              bool should_clflush) {
+static void LoadSegment(SegmentMapping& seg_map, PhdrInfo& phdr_info) {
   assert(seg_map.GetVirtAddr() == phdr_info.vaddr);
   assert(seg_map.GetMapSize() == phdr_info.map_size);
   assert(seg_map.GetPhysAddr());
@@ -131,23 +125,116 @@ static void LoadAndMapSegment(TAllocator& allocator,
   memcpy(phys_buf, phdr_info.data, phdr_info.copy_size);
   bzero(phys_buf + phdr_info.copy_size,
         phdr_info.map_size - phdr_info.copy_size);
+}
+
+static bool IsSegmentLoaded(const uint8_t* phys_buf, PhdrInfo& phdr_info) {
+  for (size_t i = 0; i < phdr_info.map_size; i++) {
+    const uint8_t expected = i < phdr_info.copy_size ? phdr_info.data[i] : 0;
+    if (phys_buf[i] != expected)
+      return false;
+  }
+  return true;
+}
+
+template <class TAllocator>
+static void LoadAndMapSegment(TAllocator& allocator,
+                              IA_PML4& page_root,
+                              SegmentMapping& seg_map,
+                              PhdrInfo& phdr_info,
+                              uint64_t page_attr,
+                              bool should_clflush) {
+  LoadSegment(seg_map, phdr_info);
   seg_map.Map(allocator, page_root, page_attr, should_clflush);
 }
 
+// Code pages of ELF files in DRAM, kept loaded to be shared read-only by
+// ephemeral processes of the same file.
+struct LoadedCodeImage {
+  EFIFile* file;
+  uint64_t paddr;
+};
+static constexpr int kNumOfLoadedCodeImages = 16;
+static LoadedCodeImage loaded_code_images_[kNumOfLoadedCodeImages];
+
+// Returns false without loading if there is no room to cache the code.
+static bool LoadSharedCodeToDRAM(EFIFile& file,
+                                 SegmentMapping& code,
+                                 PhdrInfo& phdr_info) {
+  LoadedCodeImage* free_image = nullptr;
+  for (auto& image : loaded_code_images_) {
+    if (image.file == &file) {
+      code.SetPhysAddr(image.paddr);
+      return true;
+    }
+    if (!image.file && !free_image)
+      free_image = &image;
+  }
+  if (!free_image)
+    return false;
+  code.SetPhysAddr(liumos->dram_allocator->AllocPages<uint64_t>(
+      ByteSizeToPageSize(code.GetMapSize())));
+  LoadSegment(code, phdr_info);
+  free_image->file = &file;
+  free_image->paddr = code.GetPhysAddr();
+  return true;
+}
+
+// Code pages in PMEM are kept as an object named after the file and shared
+// by persistent processes of the file across reboots. They are compared
+// with the file before being reused since the file may have been updated.
+static void LoadSharedCodeToPersistentMemory(
+    StripedPersistentMemoryAllocator& pmem,
+    EFIFile& file,
+    SegmentMapping& code,
+    PhdrInfo& phdr_info) {
+  constexpr int kNameSize = PersistentObjectHeader::kMaxNameSize;
+  char name[kNameSize] = "text:";
+  const char* file_name = file.GetFileName();
+  for (int i = 0, p = 5; file_name[i] && p < kNameSize - 1; i++, p++) {
+    name[p] = file_name[i];
+    name[p + 1] = 0;
+  }
+  PersistentObjectHeader* h = pmem.FindObjectByName(name);
+  if (h && !h->IsReleased() && h->GetByteSize() >= code.GetMapSize() &&
+      IsSegmentLoaded(h->GetObjectBase<uint8_t*>(), phdr_info)) {
+    code.SetPhysAddr(h->GetObjectBase<uint64_t>());
+    return;
+  }
+  // The stale object is left for GC to reclaim.
+  if (h && !h->IsReleased())
+    h->SetReleased(true);
+  uint8_t* buf = pmem.AllocNamedPages<uint8_t*>(
+      ByteSizeToPageSize(code.GetMapSize()), name);
+  code.SetPhysAddr(reinterpret_cast<uint64_t>(buf));
+  LoadSegment(code, phdr_info);
+  Persistence::Flush(buf, code.GetMapSize());
+  PersistentObjectHeader::FromObjectBase(buf)->SetReleased(false);
+}
+
+// Code pages should be loaded in advance if is_code_shared is true.
+// Data segment without physical pages is left unmapped to be demand paged.
 template <class TAllocator>
 static void LoadAndMap(TAllocator& allocator,
                        IA_PML4& page_root,
                        ProcessMappingInfo& proc_map_info,
                        PhdrMappingInfo& phdr_map_info,
                        uint64_t base_attr,
-                       bool should_clflush) {
+                       bool should_clflush,
+                       bool is_code_shared) {
   uint64_t page_attr = kPageAttrPresent | base_attr;
 
-  LoadAndMapSegment(allocator, page_root, proc_map_info.code,
-                    phdr_map_info.code, page_attr, should_clflush);
-  LoadAndMapSegment(allocator, page_root, proc_map_info.data,
-                    phdr_map_info.data, page_attr | kPageAttrWritable,
-                    should_clflush);
+  if (is_code_shared) {
+    proc_map_info.code.Map(allocator, page_root, page_attr | kPageAttrShared,
+                           should_clflush);
+  } else {
+    LoadAndMapSegment(allocator, page_root, proc_map_info.code,
+                      phdr_map_info.code, page_attr, should_clflush);
+  }
+  if (proc_map_info.data.GetPhysAddr()) {
+    LoadAndMapSegment(allocator, page_root, proc_map_info.data,
+                      phdr_map_info.data, page_attr | kPageAttrWritable,
+                      should_clflush);
+  }
   proc_map_info.stack.Map(allocator, page_root, page_attr | kPageAttrWritable,
                           should_clflush);
   proc_map_info.heap.Map(allocator, page_root, page_attr | kPageAttrWritable,
@@ -155,8 +242,7 @@ static void LoadAndMap(TAllocator& allocator,
 }
 
 Process& LoadELFAndCreateEphemeralProcess(EFIFile& file) {
-  ExecutionContext& ctx =
-      *liumos->kernel_heap_allocator->Alloc<ExecutionContext>();
+  ExecutionContext& ctx = liumos->proc_ctrl->AllocExecutionContext();
   ProcessMappingInfo& map_info = ctx.GetProcessMappingInfo();
   PhdrMappingInfo phdr_map_info;
   IA_PML4& user_page_table = AllocPageTable(*liumos->dram_allocator);
@@ -165,20 +251,21 @@ Process& LoadELFAndCreateEphemeralProcess(EFIFile& file) {
   const Elf64_Ehdr* ehdr = ParseProgramHeader(file, map_info, phdr_map_info);
   assert(ehdr);
 
-  map_info.code.SetPhysAddr(liumos->dram_allocator->AllocPages<uint64_t>(
-      ByteSizeToPageSize(map_info.code.GetMapSize())));
-  map_info.data.SetPhysAddr(liumos->dram_allocator->AllocPages<uint64_t>(
-      ByteSizeToPageSize(map_info.data.GetMapSize())));
-
+  const bool is_code_shared =
+      LoadSharedCodeToDRAM(file, map_info.code, phdr_map_info.code);
+  if (!is_code_shared) {
+    map_info.code.SetPhysAddr(liumos->dram_allocator->AllocPages<uint64_t>(
+        ByteSizeToPageSize(map_info.code.GetMapSize())));
+  }
+  // Pages of data, stack and heap are allocated on the first access.
   const int kNumOfStackPages = 32;
-  map_info.stack.Set(
-      0xBEEF0000,
-      liumos->dram_allocator->AllocPages<uint64_t>(kNumOfStackPages),
-      kNumOfStackPages << kPageSizeExponent);
+  map_info.stack.Set(0xBEEF0000, 0, kNumOfStackPages << kPageSizeExponent);
+  constexpr uint64_t kHeapByteSize = 1ULL << 30;
+  map_info.heap.Set(map_info.data.GetVirtEndAddr(), 0, kHeapByteSize);
 
   map_info.Print();
   LoadAndMap(*liumos->dram_allocator, user_page_table, map_info, phdr_map_info,
-             kPageAttrUser, false);
+             kPageAttrUser, false, is_code_shared);
 
   uint8_t* entry_point = reinterpret_cast<uint8_t*>(ehdr->e_entry);
 
@@ -195,17 +282,23 @@ Process& LoadELFAndCreateEphemeralProcess(EFIFile& file) {
                        kPageSize * kKernelStackPagesForEachProcess);
   Process& proc = liumos->proc_ctrl->Create();
   proc.InitAsEphemeralProcess(ctx);
+  const PhdrInfo& data = phdr_map_info.data;
+  proc.SetDemandPagedSegments(
+      {data.vaddr, data.map_size, data.data, data.copy_size},
+      {map_info.stack.GetVirtAddr(), map_info.stack.GetMapSize(), nullptr, 0});
   return proc;
 }
 
-Process& LoadELFAndCreatePersistentProcess(EFIFile& file,
-                                           PersistentMemoryManager& pmem) {
+Process& LoadELFAndCreatePersistentProcess(
+    EFIFile& file,
+    StripedPersistentMemoryAllocator& pmem) {
   constexpr uint64_t kUserStackBaseAddr = 0xBEEF0000;
   const int kNumOfStackPages = 32;
-  PersistentProcessInfo& pp_info = *pmem.AllocPersistentProcessInfo();
+  PersistentProcessInfo& pp_info =
+      *pmem.AllocPersistentProcessInfo(file.GetFileName());
   pp_info.Init();
+  pmem.SetOwnerOfNewObjects(&pp_info);
   ExecutionContext& ctx = pp_info.GetContext(0);
-  pp_info.SetValidContextIndex(0);
   ProcessMappingInfo& map_info = ctx.GetProcessMappingInfo();
   PhdrMappingInfo phdr_map_info;
   IA_PML4& user_page_table = AllocPageTable(pmem);
@@ -215,13 +308,14 @@ Process& LoadELFAndCreatePersistentProcess(EFIFile& file,
   map_info.stack.Set(kUserStackBaseAddr, 0,
                      kNumOfStackPages << kPageSizeExponent);
 
-  map_info.code.AllocSegmentFromPersistentMemory(pmem);
+  LoadSharedCodeToPersistentMemory(pmem, file, map_info.code,
+                                   phdr_map_info.code);
   map_info.data.AllocSegmentFromPersistentMemory(pmem);
   map_info.stack.AllocSegmentFromPersistentMemory(pmem);
 
   map_info.Print();
   LoadAndMap(pmem, user_page_table, map_info, phdr_map_info, kPageAttrUser,
-             true);
+             true, true);
 
   uint8_t* entry_point = reinterpret_cast<uint8_t*>(ehdr->e_entry);
 
@@ -240,10 +334,15 @@ Process& LoadELFAndCreatePersistentProcess(EFIFile& file,
   working_ctx_map.stack.AllocSegmentFromPersistentMemory(pmem);
 
   IA_PML4& pt = AllocPageTable(pmem);
-  working_ctx_map.code.Map(pmem, pt, kPageAttrUser, true);
+  working_ctx_map.code.Map(pmem, pt, kPageAttrUser | kPageAttrShared, true);
   working_ctx_map.data.Map(pmem, pt, kPageAttrUser | kPageAttrWritable, true);
   working_ctx_map.stack.Map(pmem, pt, kPageAttrUser | kPageAttrWritable, true);
   working_ctx.SetCR3(pt);
+  pmem.SetOwnerOfNewObjects<PersistentProcessInfo*>(nullptr);
+  // Published after the context is durable so that a crash while loading
+  // never leaves a partially built context restorable.
+  Persistence::Flush(&ctx);
+  pp_info.SetValidContextIndex(0);
 
   return liumos->proc_ctrl->RestoreFromPersistentProcessInfo(pp_info);
 }
@@ -277,7 +376,7 @@ void LoadKernelELF(EFIFile& file) {
       kNumOfKernelHeapPages << kPageSizeExponent);
 
   LoadAndMap(*liumos->dram_allocator, GetKernelPML4(), map_info, phdr_map_info,
-             0, false);
+             0, false, false);
 
   uint8_t* entry_point = reinterpret_cast<uint8_t*>(ehdr->e_entry);
   PutStringAndHex("Entry address: ", entry_point);
@@ -6,11 +6,12 @@
 
 class EFIFile;
 class Process;
-class PersistentMemoryManager;
+class StripedPersistentMemoryAllocator;
 
 const Elf64_Shdr* FindSectionHeader(EFIFile& file, const char* name);
 
 Process& LoadELFAndCreateEphemeralProcess(EFIFile& file);
-Process& LoadELFAndCreatePersistentProcess(EFIFile& file,
-                                           PersistentMemoryManager& pmem);
+Process& LoadELFAndCreatePersistentProcess(
+    EFIFile& file,
+    StripedPersistentMemoryAllocator& pmem);
 void LoadKernelELF(EFIFile& file);
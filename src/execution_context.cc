@@ -12,21 +12,49 @@ void SegmentMapping::Print() {
 }
 
 void SegmentMapping::AllocSegmentFromPersistentMemory(
-    PersistentMemoryManager& pmem) {
+    StripedPersistentMemoryAllocator& pmem) {
   SetPhysAddr(pmem.AllocPages<uint64_t>(ByteSizeToPageSize(GetMapSize())));
 }
 
 void SegmentMapping::CopyDataFrom(SegmentMapping& from,
                                   uint64_t& stat_copied_bytes) {
   assert(map_size_ == from.map_size_);
-  memcpy(reinterpret_cast<void*>(GetKernelVirtAddrForPhysAddr(paddr_)),
-         reinterpret_cast<void*>(GetKernelVirtAddrForPhysAddr(from.paddr_)),
-         map_size_);
+  Persistence::CopyAndFlush(
+      reinterpret_cast<void*>(GetKernelVirtAddrForPhysAddr(paddr_)),
+      reinterpret_cast<void*>(GetKernelVirtAddrForPhysAddr(from.paddr_)),
+      map_size_);
   stat_copied_bytes += map_size_;
 };
 
-void SegmentMapping::Flush(IA_PML4& pml4, uint64_t& num_of_clflush_issued) {
-  FlushDirtyPages(pml4, vaddr_, map_size_, num_of_clflush_issued);
+void SegmentMapping::CopyDirtyPagesFrom(SegmentMapping& from,
+                                        IA_PML4& from_pml4,
+                                        uint64_t& stat_copied_bytes) {
+  assert(map_size_ == from.map_size_);
+  if (!paddr_)
+    return;
+  CopyDirtyPages(from_pml4, from.vaddr_, from.map_size_, paddr_,
+                 stat_copied_bytes);
+}
+
+void SegmentMapping::SetWritable(IA_PML4& pml4, bool writable) {
+  if (!paddr_)
+    return;
+  SetPagesWritable(pml4, vaddr_, map_size_, writable);
+}
+
+void SegmentMapping::Remap(IA_PML4& pml4) {
+  if (!paddr_)
+    return;
+  RemapPages(pml4, vaddr_, map_size_, paddr_);
+}
+
+void SegmentMapping::Flush(IA_PML4& pml4,
+                           uint64_t& num_of_clflush_issued,
+                           bool should_clear_dirty_bit) {
+  if (!paddr_)
+    return;
+  FlushDirtyPages(pml4, vaddr_, map_size_, num_of_clflush_issued,
+                  should_clear_dirty_bit);
 }
 
 void ProcessMappingInfo::Print() {
@@ -50,9 +78,11 @@ void ExecutionContext::ExpandHeap(int64_t diff) {
     Panic("No more heap");
 };
 
-void ExecutionContext::Flush(IA_PML4& pml4, uint64_t& num_of_clflush_issued) {
-  map_info_.Flush(pml4, num_of_clflush_issued);
-  CLFlush(this, sizeof(*this), num_of_clflush_issued);
+void ExecutionContext::Flush(IA_PML4& pml4,
+                             uint64_t& num_of_clflush_issued,
+                             bool should_clear_dirty_bit) {
+  map_info_.Flush(pml4, num_of_clflush_issued, should_clear_dirty_bit);
+  Persistence::Flush(this, sizeof(*this), num_of_clflush_issued);
 }
 
 void PersistentProcessInfo::Print() {
@@ -71,8 +101,27 @@ void PersistentProcessInfo::Print() {
 }
 
 void PersistentProcessInfo::SwitchContext(uint64_t& stat_copied_bytes,
-                                          uint64_t& stat_num_of_clflush) {
-  GetWorkingContext().Flush(GetWorkingContext().GetCR3(), stat_num_of_clflush);
-  SetValidContextIndex(1 - valid_ctx_idx_);
+                                          uint64_t& stat_num_of_clflush,
+                                          bool incremental) {
+  FlushWorkingContext(stat_num_of_clflush, incremental);
+  CommitWorkingContext();
+  CopyValidContextToWorking(stat_copied_bytes, incremental);
+}
+
+void PersistentProcessInfo::FlushWorkingContext(uint64_t& stat_num_of_clflush,
+                                                bool incremental) {
+  // In incremental mode, dirty bits are kept until the pages are copied.
+  GetWorkingContext().Flush(GetWorkingContext().GetCR3(), stat_num_of_clflush,
+                            !incremental);
+}
+
+void PersistentProcessInfo::CopyValidContextToWorking(
+    uint64_t& stat_copied_bytes,
+    bool incremental) {
+  if (incremental) {
+    GetWorkingContext().CopyDirtyContextFrom(GetValidContext(),
+                                             stat_copied_bytes);
+    return;
+  }
   GetWorkingContext().CopyContextFrom(GetValidContext(), stat_copied_bytes);
 }
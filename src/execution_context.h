@@ -3,8 +3,9 @@
 #include "asm.h"
 #include "kernel_virtual_heap_allocator.h"
 #include "paging.h"
+#include "persistence.h"
 
-class PersistentMemoryManager;
+class StripedPersistentMemoryAllocator;
 
 class SegmentMapping {
  public:
@@ -12,12 +13,12 @@ class SegmentMapping {
     vaddr_ = vaddr;
     paddr_ = paddr;
     map_size_ = map_size;
-    CLFlush(this);
+    Persistence::Flush(this);
   }
   uint64_t GetPhysAddr() { return paddr_; }
   void SetPhysAddr(uint64_t paddr) {
     paddr_ = paddr;
-    CLFlush(&paddr);
+    Persistence::Flush(&paddr_);
   }
   uint64_t GetVirtAddr() { return vaddr_; }
   uint64_t GetMapSize() { return map_size_; }
@@ -26,11 +27,16 @@ class SegmentMapping {
     paddr_ = 0;
     vaddr_ = 0;
     map_size_ = 0;
-    CLFlush(this);
+    Persistence::Flush(this);
   }
-  void AllocSegmentFromPersistentMemory(PersistentMemoryManager& pmem);
+  void AllocSegmentFromPersistentMemory(
+      StripedPersistentMemoryAllocator& pmem);
   void Print();
   void CopyDataFrom(SegmentMapping& from, uint64_t& stat_copied_bytes);
+  // Copies pages of `from` that are dirty in from_pml4.
+  void CopyDirtyPagesFrom(SegmentMapping& from,
+                          IA_PML4& from_pml4,
+                          uint64_t& stat_copied_bytes);
   template <class TAllocator>
   void Map(TAllocator& allocator,
            IA_PML4& page_root,
@@ -43,7 +49,15 @@ class SegmentMapping {
                       shoud_clflush);
   }
 
-  void Flush(IA_PML4& pml4, uint64_t& num_of_clflush_issued);
+  void Flush(IA_PML4& pml4,
+             uint64_t& num_of_clflush_issued,
+             bool should_clear_dirty_bit);
+  void SetWritable(IA_PML4& pml4, bool writable);
+  // Maps the segment to its own pages again.
+  void Remap(IA_PML4& pml4);
+  bool Contains(uint64_t vaddr) {
+    return paddr_ && vaddr_ <= vaddr && vaddr < vaddr_ + map_size_;
+  }
 
  private:
   uint64_t vaddr_;
@@ -63,10 +77,13 @@ struct ProcessMappingInfo {
     stack.Clear();
     heap.Clear();
   }
-  void Flush(IA_PML4& pml4, uint64_t& num_of_clflush_issued) {
-    code.Flush(pml4, num_of_clflush_issued);
-    data.Flush(pml4, num_of_clflush_issued);
-    heap.Flush(pml4, num_of_clflush_issued);
+  void Flush(IA_PML4& pml4,
+             uint64_t& num_of_clflush_issued,
+             bool should_clear_dirty_bit) {
+    code.Flush(pml4, num_of_clflush_issued, should_clear_dirty_bit);
+    data.Flush(pml4, num_of_clflush_issued, should_clear_dirty_bit);
+    stack.Flush(pml4, num_of_clflush_issued, should_clear_dirty_bit);
+    heap.Flush(pml4, num_of_clflush_issued, should_clear_dirty_bit);
   }
 };
 
@@ -80,6 +97,14 @@ class ExecutionContext {
   uint64_t GetHeapEndVirtAddr() {
     return heap_used_size_ + map_info_.heap.GetVirtAddr();
   }
+  // Returns false if end is out of the heap segment.
+  bool SetHeapEndVirtAddr(uint64_t end) {
+    if (end < map_info_.heap.GetVirtAddr() ||
+        end > map_info_.heap.GetVirtEndAddr())
+      return false;
+    heap_used_size_ = end - map_info_.heap.GetVirtAddr();
+    return true;
+  }
   void SetCR3(IA_PML4& cr3) {
     cpu_context_.cr3 = reinterpret_cast<uint64_t>(&cr3);
   }
@@ -100,15 +125,45 @@ class ExecutionContext {
     kernel_rsp_ = kernel_rsp;
     heap_used_size_ = 0;
   }
-  void Flush(IA_PML4& pml4, uint64_t& stat);
-  void CopyContextFrom(ExecutionContext& from, uint64_t& stat_copied_bytes) {
+  void Flush(IA_PML4& pml4, uint64_t& stat, bool should_clear_dirty_bit);
+  // Copies registers from cpu_context but keeps CR3 of this context.
+  void SetCPUContextExceptCR3(const CPUContext& cpu_context) {
     uint64_t cr3 = cpu_context_.cr3;
-    cpu_context_ = from.cpu_context_;
+    cpu_context_ = cpu_context;
     cpu_context_.cr3 = cr3;
+  }
+  void CopyContextFrom(ExecutionContext& from, uint64_t& stat_copied_bytes) {
+    SetCPUContextExceptCR3(from.cpu_context_);
 
     map_info_.data.CopyDataFrom(from.map_info_.data, stat_copied_bytes);
     map_info_.stack.CopyDataFrom(from.map_info_.stack, stat_copied_bytes);
   }
+  // Same as CopyContextFrom but copies only pages written since the last
+  // copy from `from`. This context should have been identical to `from`
+  // before `from` started running.
+  void CopyDirtyContextFrom(ExecutionContext& from,
+                            uint64_t& stat_copied_bytes) {
+    SetCPUContextExceptCR3(from.cpu_context_);
+
+    map_info_.data.CopyDirtyPagesFrom(from.map_info_.data, from.GetCR3(),
+                                      stat_copied_bytes);
+    map_info_.stack.CopyDirtyPagesFrom(from.map_info_.stack, from.GetCR3(),
+                                       stat_copied_bytes);
+  }
+  uint64_t GetCopyContextByteSize() {
+    return map_info_.data.GetMapSize() + map_info_.stack.GetMapSize();
+  }
+  // Changes the writable bit of pages copied by CopyContextFrom.
+  void SetCopiedSegmentsWritable(bool writable) {
+    map_info_.data.SetWritable(GetCR3(), writable);
+    map_info_.stack.SetWritable(GetCR3(), writable);
+  }
+  // Maps pages copied by CopyContextFrom to the segments of this context
+  // again.
+  void RemapCopiedSegments() {
+    map_info_.data.Remap(GetCR3());
+    map_info_.stack.Remap(GetCR3());
+  }
 
  private:
   CPUContext cpu_context_;
@@ -123,14 +178,18 @@ class PersistentProcessInfo {
   void Print();
   void Init() {
     valid_ctx_idx_ = kNumOfExecutionContext;
-    CLFlush(&valid_ctx_idx_);
+    Persistence::Flush(&valid_ctx_idx_);
     signature_ = kSignature;
-    CLFlush(&signature_);
+    Persistence::Flush(&signature_);
   }
   ExecutionContext& GetContext(int idx) {
     assert(0 <= idx && idx < kNumOfExecutionContext);
     return ctx_[idx];
   }
+  // False until the first context is built.
+  bool HasValidContext() {
+    return 0 <= valid_ctx_idx_ && valid_ctx_idx_ < kNumOfExecutionContext;
+  }
   ExecutionContext& GetValidContext() {
     assert(0 <= valid_ctx_idx_ && valid_ctx_idx_ < kNumOfExecutionContext);
     return ctx_[valid_ctx_idx_];
@@ -141,12 +200,21 @@ class PersistentProcessInfo {
   }
   void SetValidContextIndex(int idx) {
     valid_ctx_idx_ = idx;
-    CLFlush(&valid_ctx_idx_);
+    Persistence::Flush(&valid_ctx_idx_);
   }
   static constexpr uint64_t kSignature = 0x4F50534F6D75696CULL;
   static constexpr int kNumOfExecutionContext = 2;
+  // Makes the working context valid and copies it into the other one.
+  // Only dirty pages are copied if incremental is true.
   void SwitchContext(uint64_t& stat_copied_bytes,
-                     uint64_t& stat_num_of_clflush);
+                     uint64_t& stat_num_of_clflush,
+                     bool incremental);
+  // Steps of SwitchContext. They can be run separately as long as the
+  // working context is not modified until CommitWorkingContext.
+  void FlushWorkingContext(uint64_t& stat_num_of_clflush, bool incremental);
+  void CommitWorkingContext() { SetValidContextIndex(1 - valid_ctx_idx_); }
+  void CopyValidContextToWorking(uint64_t& stat_copied_bytes,
+                                 bool incremental);
 
  private:
   ExecutionContext ctx_[kNumOfExecutionContext];
@@ -32,6 +32,8 @@ class GDT {
   static constexpr uint64_t kTSS64Selector = kTSS64Index << 3;
 
   void Init(uint64_t kernel_stack_pointer, uint64_t ist1_pointer);
+  // Stack used on interrupts from user mode.
+  uint64_t GetKernelStackPointer() { return tss64_.rsp[0]; }
   void Print(void);
 
  private:
@@ -20,7 +20,6 @@ class HPET {
                   HPET::TimerConfig flags);
   uint64_t ReadMainCounterValue();
   uint64_t GetFemtosecondPerCount();
-  void BusyWait(uint64_t ms);
   void Print(void);
 
  private:
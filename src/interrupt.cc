@@ -26,6 +26,8 @@ void IDT::IntHandler(uint64_t intcode, InterruptInfo* info) {
     PutStringAndHex("Context#", proc.GetID());
     Panic("Handling exception in user mode stack");
   }
+  if (intcode == 0x0E && page_fault_handler_ && page_fault_handler_(info))
+    return;
   if (intcode <= 0xFF && handler_list_[intcode]) {
     handler_list_[intcode](intcode, info);
     return;
@@ -51,7 +53,8 @@ void IDT::IntHandler(uint64_t intcode, InterruptInfo* info) {
     PutStringAndHex("CR2", ReadCR2());
     if (info->error_code & 1) {
       // present but not ok. print entries.
-      reinterpret_cast<IA_PML4*>(ReadCR3())->DebugPrintEntryForAddr(ReadCR2());
+      reinterpret_cast<IA_PML4*>(ReadCR3() & ~kCR3PCIDMask)
+          ->DebugPrintEntryForAddr(ReadCR2());
     }
     Panic("Page Fault");
   }
@@ -112,17 +115,21 @@ void IDT::SetEntry(int index,
   desc->reserved2 = 0;
 }
 
-void IDT::Init() {
-  uint16_t cs = ReadCSSelector();
-
+void IDT::Load() {
   IDTR idtr;
   idtr.limit = sizeof(descriptors_) - 1;
   idtr.base = descriptors_;
+  WriteIDTR(&idtr);
+}
+
+void IDT::Init() {
+  uint16_t cs = ReadCSSelector();
 
   for (int i = 0; i < 0x100; i++) {
     SetEntry(i, cs, 1, IDTType::kInterruptGate, 0, AsmIntHandlerNotImplemented);
     handler_list_[i] = nullptr;
   }
+  page_fault_handler_ = nullptr;
 
   SetEntry(0x00, cs, 0, IDTType::kInterruptGate, 0,
            AsmIntHandler00_DivideError);
@@ -139,6 +146,7 @@ void IDT::Init() {
            AsmIntHandler13_SIMDFPException);
   SetEntry(0x20, cs, 0, IDTType::kInterruptGate, 0, AsmIntHandler20);
   SetEntry(0x21, cs, 0, IDTType::kInterruptGate, 0, AsmIntHandler21);
-  WriteIDTR(&idtr);
+  SetEntry(0x22, cs, 0, IDTType::kInterruptGate, 0, AsmIntHandler22);
+  Load();
   liumos->idt = this;
 }
@@ -3,16 +3,25 @@
 #include "scheduler.h"
 
 using InterruptHandler = void (*)(uint64_t intcode, InterruptInfo* info);
+// Returns true if the fault is resolved.
+using PageFaultHandler = bool (*)(InterruptInfo* info);
 
 class IDT {
  public:
   void Init();
+  // Makes the processor use this IDT. Init calls this on the bootstrap
+  // processor.
+  void Load();
   void IntHandler(uint64_t intcode, InterruptInfo* info);
   void SetIntHandler(uint64_t intcode, InterruptHandler handler);
+  void SetPageFaultHandler(PageFaultHandler handler) {
+    page_fault_handler_ = handler;
+  }
 
  private:
   IDTGateDescriptor descriptors_[256];
   InterruptHandler handler_list_[256];
+  PageFaultHandler page_fault_handler_;
   void SetEntry(int index,
                 uint8_t segm_desc,
                 uint8_t ist,
@@ -4,27 +4,36 @@
 #include <functional>
 #include <vector>
 
+#include "clock.h"
+#include "copy_on_write.h"
 #include "corefunc.h"
 #include "liumos.h"
 #include "pci.h"
+#include "pmem.h"
+#include "smp.h"
+#include "timer.h"
 #include "xhci.h"
 
 LiumOS* liumos;
 
-GDT gdt_;
 IDT idt_;
 KeyboardController keyboard_ctrl_;
 LiumOS liumos_;
 Sheet virtual_vram_;
 Sheet virtual_screen_;
 Console virtual_console_;
-LocalAPIC bsp_local_apic_;
 CPUFeatureSet cpu_features_;
 SerialPort com1_;
 SerialPort com2_;
 HPET hpet_;
+Timer timer_;
+Checkpointer checkpointer_;
+StripedPersistentMemoryAllocator pmem_allocator_;
+PageFrameTable page_frame_table_;
 
 void InitPMEMManagement() {
+  pmem_allocator_.Init();
+  liumos->pmem_allocator = &pmem_allocator_;
   using namespace ACPI;
   if (!liumos->acpi.nfit) {
     PutString("NFIT not found. There are no PMEMs on this system.\n");
@@ -49,13 +58,63 @@ void InitPMEMManagement() {
                     spa_range->system_physical_address_range_length);
     available_pmem_size += spa_range->system_physical_address_range_length;
     assert(pmem_manager_used < LiumOS::kNumOfPMEMManagers);
-    liumos->pmem[pmem_manager_used++] =
-        reinterpret_cast<PersistentMemoryManager*>(
-            spa_range->system_physical_address_range_base);
+    PersistentMemoryManager* pmem = reinterpret_cast<PersistentMemoryManager*>(
+        spa_range->system_physical_address_range_base);
+    liumos->pmem[pmem_manager_used++] = pmem;
+    uint32_t proximity_domain =
+        StripedPersistentMemoryAllocator::kUnknownProximityDomain;
+    if (liumos->acpi.srat) {
+      proximity_domain = liumos->acpi.srat->GetProximityDomainForAddrRange(
+          spa_range->system_physical_address_range_base,
+          spa_range->system_physical_address_range_length);
+    }
+    PutStringAndHex("  proximity_domain", proximity_domain);
+    pmem_allocator_.AddRegion(*pmem, proximity_domain);
   }
   PutStringAndHex("Available PMEM (KiB)", available_pmem_size >> 10);
 }
 
+void InitPCID() {
+  liumos->is_pcid_enabled = false;
+  if (!liumos->cpu_features->pcid)
+    return;
+  // CR3[11:0] should be 0 when CR4.PCIDE is set.
+  assert((ReadCR3() & kCR3PCIDMask) == 0);
+  WriteCR4(ReadCR4() | kCR4BitPCIDE);
+  liumos->is_pcid_enabled = true;
+}
+
+static uint32_t GetProximityDomainOfCurrentCPU() {
+  return GetCurrentCPU().GetProximityDomain();
+}
+
+void InitDRAMProximityDomains() {
+  PhysicalPageAllocator& allocator = *liumos->dram_allocator;
+  if (liumos->acpi.slit) {
+    ACPI::SLIT& slit = *liumos->acpi.slit;
+    const uint64_t n = slit.num_of_system_localities;
+    for (int from = 0; from < allocator.GetNumOfProximityDomains(); from++) {
+      const uint32_t from_domain = allocator.GetProximityDomain(from);
+      for (int to = 0; to < allocator.GetNumOfProximityDomains(); to++) {
+        const uint32_t to_domain = allocator.GetProximityDomain(to);
+        if (from_domain >= n || to_domain >= n)
+          continue;
+        allocator.SetDistance(from_domain, to_domain,
+                              slit.entry[from_domain * n + to_domain]);
+      }
+    }
+  }
+  if (liumos->acpi.srat)
+    allocator.SetLocalProximityDomainGetter(GetProximityDomainOfCurrentCPU);
+}
+
+void InitPMEMProximityDomains() {
+  if (!liumos->acpi.srat)
+    return;
+  pmem_allocator_.SetLocalProximityDomainGetter(
+      GetProximityDomainOfCurrentCPU);
+}
+
 void InitializeVRAMForKernel() {
   constexpr uint64_t kernel_virtual_vram_base = 0xFFFFFFFF'80000000ULL;
   const int xsize = liumos->vram_sheet->GetXSize();
@@ -85,7 +144,9 @@ void InitializeVRAMForKernel() {
 
 void SubTask();  // @subtask.cc
 
-void LaunchSubTask(KernelVirtualHeapAllocator& kernel_heap_allocator) {
+static Process& LaunchKernelTask(
+    void (*entry)(),
+    KernelVirtualHeapAllocator& kernel_heap_allocator) {
   const int kNumOfStackPages = 3;
   void* sub_context_stack_base = kernel_heap_allocator.AllocPages<void*>(
       kNumOfStackPages, kPageAttrPresent | kPageAttrWritable);
@@ -93,47 +154,64 @@ void LaunchSubTask(KernelVirtualHeapAllocator& kernel_heap_allocator) {
       reinterpret_cast<uint64_t>(sub_context_stack_base) +
       (kNumOfStackPages << kPageSizeExponent));
 
-  ExecutionContext& sub_context =
-      *liumos->kernel_heap_allocator->Alloc<ExecutionContext>();
+  ExecutionContext& sub_context = liumos->proc_ctrl->AllocExecutionContext();
   sub_context.SetRegisters(
-      SubTask, GDT::kKernelCSSelector, sub_context_rsp, GDT::kKernelDSSelector,
+      entry, GDT::kKernelCSSelector, sub_context_rsp, GDT::kKernelDSSelector,
       reinterpret_cast<uint64_t>(&GetKernelPML4()), kRFlagsInterruptEnable, 0);
 
   Process& proc = liumos->proc_ctrl->Create();
   proc.InitAsEphemeralProcess(sub_context);
   liumos->scheduler->RegisterProcess(proc);
-  liumos->sub_process = &proc;
+  return proc;
+}
+
+void LaunchSubTask(KernelVirtualHeapAllocator& kernel_heap_allocator) {
+  liumos->sub_process = &LaunchKernelTask(SubTask, kernel_heap_allocator);
+}
+
+static void CheckpointerTask() {
+  liumos->checkpointer->Run();
+}
+
+// Runs when nothing else is ready on the bootstrap processor. Application
+// processors run the same loop in ApplicationProcessorEntry.
+static void IdleTask() {
+  for (;;) {
+    StoreIntFlagAndHalt();
+  }
 }
 
 void SwitchContext(InterruptInfo& int_info,
                    Process& from_proc,
                    Process& to_proc) {
-  static uint64_t proc_last_time_count = 0;
-  const uint64_t now_count = liumos->hpet->ReadMainCounterValue();
-  if ((proc_last_time_count - now_count) < liumos->time_slice_count)
-    return;
+  CPU& cpu = GetCurrentCPU();
+  liumos->timer->StartTimeSlice(to_proc);
 
   from_proc.AddProcTimeFemtoSec(
-      (liumos->hpet->ReadMainCounterValue() - proc_last_time_count) *
-      liumos->hpet->GetFemtosecondPerCount());
+      (Clock::NowNs() - cpu.GetLastSwitchTimeNs()) * kFemtosecondPerNs);
 
-  CPUContext& from = from_proc.GetExecutionContext().GetCPUContext();
-  const uint64_t t0 = liumos->hpet->ReadMainCounterValue();
-  from.cr3 = ReadCR3();
+  CPUContext& from = from_proc.GetCPUContext();
+  const uint64_t t0 = Clock::NowNs();
+  from.cr3 = ReadCR3() & ~kCR3PCIDMask;
   from.greg = int_info.greg;
   from.int_ctx = int_info.int_ctx;
-  from_proc.NotifyContextSaving();
-  const uint64_t t1 = liumos->hpet->ReadMainCounterValue();
-  from_proc.AddTimeConsumedInContextSavingFemtoSec(
-      (t1 - t0) * liumos->hpet->GetFemtosecondPerCount());
-
-  CPUContext& to = to_proc.GetExecutionContext().GetCPUContext();
+  from_proc.NotifyContextSaving(t0 / kNsPerMs);
+  const uint64_t t1 = Clock::NowNs();
+  const uint64_t saving_time_fs = (t1 - t0) * kFemtosecondPerNs;
+  from_proc.AddTimeConsumedInContextSavingFemtoSec(saving_time_fs);
+  if (from_proc.IsPersistent())
+    Persistence::AddElapsedTimeFemtoSec(saving_time_fs);
+
+  CPUContext& to = to_proc.GetCPUContext();
   int_info.greg = to.greg;
   int_info.int_ctx = to.int_ctx;
-  if (from.cr3 == to.cr3)
+  if (from.cr3 == to.cr3) {
+    from_proc.SetSwitchedOut();
     return;
-  WriteCR3(to.cr3);
-  proc_last_time_count = liumos->hpet->ReadMainCounterValue();
+  }
+  WriteCR3(to_proc.GetCR3ToSwitch());
+  cpu.SetLastSwitchTimeNs(Clock::NowNs());
+  from_proc.SetSwitchedOut();
 }
 
 __attribute__((ms_abi)) extern "C" void SleepHandler(uint64_t,
@@ -146,9 +224,63 @@ __attribute__((ms_abi)) extern "C" void SleepHandler(uint64_t,
   SwitchContext(*info, proc, *next_proc);
 }
 
+constexpr uint8_t kTimerIntVector = 0x20;
+
+// Raised by the LocalAPIC timer of each processor at the end of the time
+// slice or a sleep, and by other processors to wake up an idle one.
 void TimerHandler(uint64_t, InterruptInfo* info) {
-  liumos->bsp_local_apic->SendEndOfInterrupt();
+  CPU& cpu = GetCurrentCPU();
+  cpu.GetLocalAPIC().SendEndOfInterrupt();
+  Process& proc = liumos->scheduler->GetCurrentProcess();
+  if (!liumos->timer->HandleInterrupt(proc))
+    return;
   SleepHandler(0, info);
+  // The next slice starts even if no other process is ready to run.
+  if (&liumos->scheduler->GetCurrentProcess() == &proc)
+    liumos->timer->StartTimeSlice(proc);
+}
+
+// Raised by ShootDownKernelHeapTLB on another processor.
+void TLBShootdownHandler(uint64_t, InterruptInfo*) {
+  CPU& cpu = GetCurrentCPU();
+  cpu.GetLocalAPIC().SendEndOfInterrupt();
+  cpu.FlushTLBIfKernelHeapIsUnmapped();
+}
+
+constexpr uint64_t kPageFaultErrorCodePresent = 1 << 0;
+constexpr uint64_t kPageFaultErrorCodeWrite = 1 << 1;
+
+// Maps pages of demand paged segments on the first access and copies pages
+// shared by fork on the first write.
+// Pages of the snapshot of a persistent process written during a checkpoint
+// are moved to copies. If the process has too many of them, it is blocked
+// until the checkpointer task makes the snapshot durable and moves the process
+// to the new working context. The faulting instruction is retried there.
+static bool HandlePageFault(InterruptInfo* info) {
+  constexpr uint64_t kWriteToPresentPage =
+      kPageFaultErrorCodePresent | kPageFaultErrorCodeWrite;
+  if (!liumos->is_multi_task_enabled)
+    return false;
+  Process& proc = liumos->scheduler->GetCurrentProcess();
+  if (!(info->error_code & kPageFaultErrorCodePresent))
+    return proc.HandleDemandPageFault(ReadCR2());
+  if ((info->error_code & kWriteToPresentPage) != kWriteToPresentPage)
+    return false;
+  if (!proc.IsPersistent())
+    return proc.HandleCopyOnWriteFault(ReadCR2());
+  if (!proc.IsCheckpointInProgress())
+    return false;
+  if (proc.HandleSnapshotWriteFault(ReadCR2()))
+    return true;
+  proc.SetStatus(Process::Status::kWaiting);
+  Process* next_proc = liumos->scheduler->SwitchProcess();
+  if (!next_proc) {
+    // Retry until the checkpointer task gets its turn.
+    proc.SetStatus(Process::Status::kRunning);
+    return true;
+  }
+  SwitchContext(*info, proc, *next_proc);
+  return true;
 }
 
 void CoreFunc::PutChar(char c) {
@@ -171,20 +303,26 @@ extern "C" void KernelEntry(LiumOS* liumos_passed) {
   liumos->kernel_heap_allocator = &kernel_heap_allocator;
 
   Disable8259PIC();
-  bsp_local_apic_.Init();
+  InitBootstrapProcessor();
+  liumos->bsp_local_apic = &GetCurrentCPU().GetLocalAPIC();
+  liumos->bsp_local_apic->Init();
+  InitProximityDomain(GetCurrentCPU());
 
-  InitIOAPIC(bsp_local_apic_.GetID());
+  InitIOAPIC(liumos->bsp_local_apic->GetID());
+  InitDRAMProximityDomains();
+  InitPMEMProximityDomains();
+  InitPCID();
 
   hpet_.Init(static_cast<HPET::RegisterSpace*>(
       liumos->acpi.hpet->base_address.address));
   liumos->hpet = &hpet_;
-  hpet_.SetTimerNs(
-      0, 1000,
-      HPET::TimerConfig::kUsePeriodicMode | HPET::TimerConfig::kEnable);
-  liumos->time_slice_count = 1e12 * 100 / hpet_.GetFemtosecondPerCount();
+  // Only the main counter is used. Ticks come from LocalAPIC timers.
+  hpet_.SetTimerNs(0, 0, HPET::TimerConfig::kUsePeriodicMode);
 
   cpu_features_ = *liumos->cpu_features;
   liumos->cpu_features = &cpu_features_;
+  Persistence::Init(cpu_features_);
+  Clock::Init(hpet_, cpu_features_);
 
   InitializeVRAMForKernel();
 
@@ -199,13 +337,18 @@ extern "C" void KernelEntry(LiumOS* liumos_passed) {
 
   liumos->main_console->SetSerial(&com2_);
 
-  bsp_local_apic_.Init();
+  liumos->bsp_local_apic->Init();
+
+  KernelSlabAllocator slab_allocator_(kernel_heap_allocator);
+  liumos->slab_allocator = &slab_allocator_;
+
+  page_frame_table_.Init();
+  liumos->page_frame_table = &page_frame_table_;
 
-  ProcessController proc_ctrl_(kernel_heap_allocator);
+  ProcessController proc_ctrl_(slab_allocator_);
   liumos->proc_ctrl = &proc_ctrl_;
 
-  ExecutionContext& root_context =
-      *liumos->kernel_heap_allocator->Alloc<ExecutionContext>();
+  ExecutionContext& root_context = liumos->proc_ctrl->AllocExecutionContext();
   root_context.SetRegisters(nullptr, 0, nullptr, 0, ReadCR3(), 0, 0);
   ProcessMappingInfo& map_info = root_context.GetProcessMappingInfo();
   constexpr uint64_t kNumOfKernelHeapPages = 4;
@@ -219,6 +362,11 @@ extern "C" void KernelEntry(LiumOS* liumos_passed) {
   Scheduler scheduler_(*liumos->root_process);
   liumos->scheduler = &scheduler_;
   liumos->is_multi_task_enabled = true;
+  liumos->is_incremental_checkpoint_enabled = true;
+  liumos->is_async_checkpoint_enabled = false;
+  liumos->checkpoint_policy.trigger = CheckpointPolicy::Trigger::kSwitches;
+  liumos->checkpoint_policy.period = 1;
+  liumos->checkpointer = &checkpointer_;
 
   const Elf64_Shdr* sh_ctor =
       FindSectionHeader(*liumos->loader_info.files.liumos_elf, ".ctors");
@@ -254,21 +402,36 @@ extern "C" void KernelEntry(LiumOS* liumos_passed) {
   uint64_t ist1_virt_base = kernel_heap_allocator.AllocPages<uint64_t>(
       kNumOfKernelStackPages, kPageAttrPresent | kPageAttrWritable);
 
-  gdt_.Init(kernel_stack_pointer,
-            ist1_virt_base + (kNumOfKernelStackPages << kPageSizeExponent));
+  GetCurrentCPU().GetGDT().Init(
+      kernel_stack_pointer,
+      ist1_virt_base + (kNumOfKernelStackPages << kPageSizeExponent));
   idt_.Init();
   keyboard_ctrl_.Init();
 
-  idt_.SetIntHandler(0x20, TimerHandler);
+  idt_.SetIntHandler(kTimerIntVector, TimerHandler);
+  idt_.SetIntHandler(kTLBShootdownIntVector, TLBShootdownHandler);
+  idt_.SetPageFaultHandler(HandlePageFault);
+  timer_.Init(hpet_, kTimerIntVector);
+  liumos->timer = &timer_;
+  timer_.StartTimeSlice(*liumos->root_process);
 
   PCI& pci = PCI::GetInstance();
   pci.DetectDevices();
 
   StoreIntFlag();
 
+  liumos->scheduler->SetPriority(
+      LaunchKernelTask(IdleTask, kernel_heap_allocator),
+      Process::kIdlePriority);
   LaunchSubTask(kernel_heap_allocator);
+  LaunchKernelTask(CheckpointerTask, kernel_heap_allocator);
 
+  // Syscall handlers write to the user stack, where pages shared by fork have
+  // to be copied on writes in ring 0 as well. Application processors inherit
+  // CR0 from here.
+  WriteCR0(ReadCR0() | kCR0BitWriteProtect);
   EnableSyscall();
+  StartApplicationProcessors();
 
   XHCI::Controller::GetInstance().Init();
 
@@ -1,15 +1,28 @@
 #pragma once
 
+#include "address_range_allocator.h"
+#include "asm.h"
 #include "generic.h"
 #include "paging.h"
+#include "smp.h"
+#include "spin_lock.h"
 
 class KernelVirtualHeapAllocator {
  public:
   KernelVirtualHeapAllocator(IA_PML4& pml4,
                              PhysicalPageAllocator& dram_allocator)
-      : next_base_(kKernelHeapBaseAddr),
+      : num_of_unmaps_(0),
+        num_of_leaked_bytes_(0),
         pml4_(pml4),
-        dram_allocator_(dram_allocator){};
+        dram_allocator_(dram_allocator) {
+    // The free extents of the heap are kept in the first page of the heap.
+    CreatePageMapping(dram_allocator_, pml4_, kKernelHeapBaseAddr,
+                      dram_allocator_.AllocPages<uint64_t>(1), kPageSize,
+                      kPageAttrPresent | kPageAttrWritable);
+    va_range_ = reinterpret_cast<VARangeAllocator*>(kKernelHeapBaseAddr);
+    va_range_->Init(kKernelHeapBaseAddr + kPageSize,
+                    kKernelHeapSize - kPageSize);
+  }
   template <typename T>
   T AllocPages(uint64_t num_of_pages, uint64_t page_attr) {
     return MapPages<T>(dram_allocator_.AllocPages<uint64_t>(num_of_pages),
@@ -17,12 +30,14 @@ class KernelVirtualHeapAllocator {
   }
   template <typename T>
   T MapPages(uint64_t paddr, uint64_t num_of_pages, uint64_t page_attr) {
+    SpinLockGuard guard(lock_);
     uint64_t byte_size = (num_of_pages << kPageSizeExponent);
-    if (byte_size > kKernelHeapSize ||
-        next_base_ + byte_size > kKernelHeapBaseAddr + kKernelHeapSize)
+    if (byte_size > kKernelHeapSize)
+      Panic("Cannot allocate kernel virtual heap");
+    // One more page is reserved as a guard page.
+    uint64_t vaddr = va_range_->Alloc(byte_size + kPageSize);
+    if (!vaddr)
       Panic("Cannot allocate kernel virtual heap");
-    uint64_t vaddr = next_base_;
-    next_base_ += byte_size + (1 << kPageSizeExponent);
     CreatePageMapping(dram_allocator_, pml4_, vaddr, paddr, byte_size,
                       page_attr);
     return reinterpret_cast<T>(vaddr);
@@ -34,10 +49,73 @@ class KernelVirtualHeapAllocator {
                           kPageAttrPresent | kPageAttrWritable);
   }
 
+  // Unmaps pages allocated by AllocPages and returns them to DRAM.
+  void FreePages(void* vaddr, uint64_t num_of_pages) {
+    ReleasePages(vaddr, num_of_pages, true);
+  }
+  // Unmaps pages mapped by MapPages. Physical pages are left untouched.
+  void UnmapPages(void* vaddr, uint64_t num_of_pages) {
+    ReleasePages(vaddr, num_of_pages, false);
+  }
+  template <typename T>
+  void Free(T* obj) {
+    FreePages(obj, ByteSizeToPageSize(sizeof(T)));
+  }
+  uint64_t GetNumOfFreeBytes() const { return va_range_->GetNumOfFreeBytes(); }
+  // Addresses which could not be returned since there were too many holes.
+  uint64_t GetNumOfLeakedBytes() const { return num_of_leaked_bytes_; }
+  // Unmapping flushes the current PCID of each processor. Other PCIDs have to
+  // be flushed before their next use if this has changed since then.
+  uint64_t GetNumOfUnmaps() const { return num_of_unmaps_; }
+
  private:
   static constexpr uint64_t kKernelHeapBaseAddr = 0xFFFF'FFFF'9000'0000;
   static constexpr uint64_t kKernelHeapSize = 0x0000'0000'4000'0000;
-  uint64_t next_base_;
+  // Invalidating more pages than this one by one is slower than reloading CR3.
+  static constexpr uint64_t kMaxNumOfPagesToInvalidate = 32;
+  using VARangeAllocator = AddressRangeAllocator<(kPageSize - 16) / 16>;
+  static_assert(sizeof(VARangeAllocator) <= kPageSize);
+
+  // Pages are physically contiguous as they are allocated at once. They and
+  // their addresses are reused only after the other processors have flushed
+  // their TLB entries, which is waited for without lock_ held since the
+  // others may be spinning on it with interrupts disabled.
+  void ReleasePages(void* vaddr, uint64_t num_of_pages, bool should_free) {
+    const uint64_t addr = reinterpret_cast<uint64_t>(vaddr);
+    const uint64_t byte_size = num_of_pages << kPageSizeExponent;
+    assert(IsAlignedToPageSize(addr));
+    assert(kKernelHeapBaseAddr + kPageSize <= addr &&
+           addr + byte_size <= kKernelHeapBaseAddr + kKernelHeapSize);
+    lock_.Lock();
+    const uint64_t paddr = pml4_.v2p(addr);
+    DestroyPageMapping(dram_allocator_, pml4_, addr, byte_size, false);
+    if (num_of_pages > kMaxNumOfPagesToInvalidate) {
+      WriteCR3(ReadCR3());
+    } else {
+      for (uint64_t i = 0; i < num_of_pages; i++) {
+        InvalidateTLBEntry(
+            reinterpret_cast<void*>(addr + (i << kPageSizeExponent)));
+      }
+    }
+    num_of_unmaps_++;
+    lock_.Unlock();
+    ShootDownKernelHeapTLB();
+    SpinLockGuard guard(lock_);
+    if (should_free)
+      dram_allocator_.FreePages(reinterpret_cast<void*>(paddr), num_of_pages);
+    // Freeing the range may need one more extent. The heap is large enough to
+    // lose some addresses, so they are leaked instead of panicking here.
+    if (va_range_->IsFull()) {
+      num_of_leaked_bytes_ += byte_size + kPageSize;
+      return;
+    }
+    va_range_->Free(addr, byte_size + kPageSize);
+  }
+
+  VARangeAllocator* va_range_;
+  volatile uint64_t num_of_unmaps_;
+  uint64_t num_of_leaked_bytes_;
   IA_PML4& pml4_;
   PhysicalPageAllocator& dram_allocator_;
+  SpinLock lock_;
 };
@@ -3,6 +3,7 @@
 #include "acpi.h"
 #include "apic.h"
 #include "asm.h"
+#include "checkpointer.h"
 #include "console.h"
 #include "efi.h"
 #include "efi_file.h"
@@ -17,11 +18,13 @@
 #include "keyboard.h"
 #include "keyid.h"
 #include "paging.h"
+#include "persistence.h"
 #include "phys_page_allocator.h"
 #include "process.h"
 #include "serial.h"
 #include "sheet.h"
 #include "sheet_painter.h"
+#include "slab_allocator.h"
 #include "sys_constant.h"
 #include "text_box.h"
 
@@ -33,6 +36,10 @@ constexpr uint64_t kKernelBaseAddr = 0xFFFF'FFFF'0000'0000ULL;
 
 constexpr uint64_t kKernelStackPagesForEachProcess = 2;
 
+// Pages below 1MB reserved by the loader for the trampoline which starts
+// application processors in real mode.
+constexpr uint64_t kNumOfAPBootPages = 2;
+
 // @command.cc
 namespace ConsoleCommand {
 void ShowNFIT(void);
@@ -74,12 +81,16 @@ packed_struct LoaderInfo {
     EFIFile* logo_ppm;
     EFIFile* hello_bin;
     EFIFile* pi_bin;
+    EFIFile* forktest_bin;
     EFIFile* liumos_elf;
     EFIFile* liumos_ppm;
   } files;
   EFI* efi;
 };
 class PersistentMemoryManager;
+class StripedPersistentMemoryAllocator;
+class PageFrameTable;
+class Timer;
 packed_struct LiumOS {
   struct {
     ACPI::RSDT* rsdt;
@@ -93,6 +104,7 @@ packed_struct LiumOS {
   LoaderInfo loader_info;
   static constexpr int kNumOfPMEMManagers = 4;
   PersistentMemoryManager* pmem[kNumOfPMEMManagers];
+  StripedPersistentMemoryAllocator* pmem_allocator;
   Sheet* vram_sheet;
   Sheet* screen_sheet;
   Console* main_console;
@@ -100,17 +112,26 @@ packed_struct LiumOS {
   LocalAPIC* bsp_local_apic;
   CPUFeatureSet* cpu_features;
   PhysicalPageAllocator* dram_allocator;
+  PageFrameTable* page_frame_table;
   KernelVirtualHeapAllocator* kernel_heap_allocator;
+  KernelSlabAllocator* slab_allocator;
   HPET* hpet;
+  Timer* timer;
   EFI::MemoryMap* efi_memory_map;
   IA_PML4* kernel_pml4;
   Scheduler* scheduler;
   ProcessController* proc_ctrl;
+  Checkpointer* checkpointer;
   IDT* idt;
   Process* root_process;
   Process* sub_process;
-  uint64_t time_slice_count;
+  uint64_t ap_boot_pages_paddr;  // 0 if no pages are available.
   bool is_multi_task_enabled;
+  bool is_pcid_enabled;
+  bool is_incremental_checkpoint_enabled;
+  bool is_async_checkpoint_enabled;
+  // Applied to processes created after it is changed.
+  CheckpointPolicy checkpoint_policy;
 };
 extern LiumOS* liumos;
 
@@ -123,5 +144,9 @@ T GetKernelVirtAddrForPhysAddr(T paddr) {
 
 void MainForBootProcessor(void* image_handle, EFI::SystemTable* system_table);
 
+// @slab_allocator.cc
+void* kmalloc(size_t byte_size);
+void kfree(void* obj);
+
 // @syscall.cc
 void EnableSyscall();
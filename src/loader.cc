@@ -14,6 +14,7 @@ EFIFile logo_ppm;
 EFIFile liumos_ppm;
 EFIFile hello_bin_file;
 EFIFile pi_bin_file;
+EFIFile forktest_bin_file;
 EFIFile liumos_elf_file;
 
 LiumOS liumos_;
@@ -40,9 +41,21 @@ void InitDRAMManagement(EFI::MemoryMap& map) {
     const EFI::MemoryDescriptor* desc = map.GetDescriptor(i);
     if (desc->type != EFI::MemoryType::kConventionalMemory)
       continue;
-    available_pages += desc->number_of_pages;
-    FreePages(dram_allocator, reinterpret_cast<void*>(desc->physical_start),
-              desc->number_of_pages);
+    uint64_t paddr = desc->physical_start;
+    uint64_t num_of_pages = desc->number_of_pages;
+    // Application processors start in real mode, so their trampoline should
+    // be below 1MB. Page 0 is skipped since it holds the real mode IVT.
+    if (!liumos->ap_boot_pages_paddr && paddr &&
+        paddr + (num_of_pages << kPageSizeExponent) <= 0x10'0000 &&
+        kNumOfAPBootPages <= num_of_pages) {
+      liumos->ap_boot_pages_paddr = paddr;
+      paddr += kNumOfAPBootPages << kPageSizeExponent;
+      num_of_pages -= kNumOfAPBootPages;
+      if (!num_of_pages)
+        continue;
+    }
+    available_pages += num_of_pages;
+    FreePages(dram_allocator, reinterpret_cast<void*>(paddr), num_of_pages);
   }
   PutStringAndHex("Available DRAM (KiB)", available_pages * 4);
 }
@@ -75,11 +88,24 @@ void IdentifyCPU() {
   if (!(cpuid.edx & kCPUID01H_EDXBitMSR))
     Panic("MSR not supported");
   f.x2apic = cpuid.ecx & kCPUID01H_ECXBitx2APIC;
+  f.pcid = cpuid.ecx & kCPUID01H_ECXBitPCID;
+  f.tsc_deadline = cpuid.ecx & kCPUID01H_ECXBitTSCDeadline;
   f.clfsh = cpuid.edx & (1 << 19);
 
   if (7 <= f.max_cpuid) {
     ReadCPUID(&cpuid, 7, 0);
     f.clflushopt = cpuid.ebx & (1 << 23);
+    f.clwb = cpuid.ebx & (1 << 24);
+  }
+
+  if (0x80000001 <= f.max_extended_cpuid) {
+    ReadCPUID(&cpuid, 0x80000001, 0);
+    f.page1gb = cpuid.edx & kCPUID80000001H_EDXBitPage1GB;
+  }
+
+  if (0x80000007 <= f.max_extended_cpuid) {
+    ReadCPUID(&cpuid, 0x80000007, 0);
+    f.invariant_tsc = cpuid.edx & kCPUID80000007H_EDXBitInvariantTSC;
   }
 
   if (0x80000004 <= f.max_extended_cpuid) {
@@ -123,6 +149,14 @@ void Sleep() {
   // Fake
 }
 
+void WaitQueue::WakeUpAll() {
+  // Fake
+}
+
+void ShootDownKernelHeapTLB() {
+  // Fake
+}
+
 void MainForBootProcessor(EFI::Handle image_handle,
                           EFI::SystemTable* system_table) {
   liumos = &liumos_;
@@ -144,6 +178,8 @@ void MainForBootProcessor(EFI::Handle image_handle,
   liumos_.loader_info.files.liumos_elf = &liumos_elf_file;
   EFIFileManager::Load(hello_bin_file, L"hello.bin");
   liumos_.loader_info.files.hello_bin = &hello_bin_file;
+  EFIFileManager::Load(forktest_bin_file, L"forktest.bin");
+  liumos_.loader_info.files.forktest_bin = &forktest_bin_file;
   EFIFileManager::Load(liumos_ppm, L"liumos.ppm");
   liumos_.loader_info.files.liumos_ppm = &liumos_ppm;
 
@@ -116,6 +116,8 @@ void InitPaging() {
   // Even if 4-level paging is supported,
   // whether 1GB pages are supported or not is determined by
   // CPUID.80000001H:EDX.Page1GB [bit 26] = 1.
+  const bool use_1gb_pages = liumos->cpu_features->page1gb;
+  PutStringAndBool("1GB pages for direct map", use_1gb_pages);
   uint64_t direct_mapping_end = 0xffffffffULL;
   EFI::MemoryMap& map = *liumos->efi_memory_map;
   for (int i = 0; i < map.GetNumberOfEntries(); i++) {
@@ -161,10 +163,12 @@ void InitPaging() {
 
   // mapping pages for real memory & memory mapped IOs
   CreatePageMapping(*liumos->dram_allocator, *kernel_pml4, 0, 0,
-                    direct_mapping_end, kPageAttrPresent | kPageAttrWritable);
+                    direct_mapping_end, kPageAttrPresent | kPageAttrWritable,
+                    false, use_1gb_pages);
   CreatePageMapping(*liumos->dram_allocator, *kernel_pml4,
                     liumos->cpu_features->kernel_phys_page_map_begin, 0,
-                    direct_mapping_end, kPageAttrPresent | kPageAttrWritable);
+                    direct_mapping_end, kPageAttrPresent | kPageAttrWritable,
+                    false, use_1gb_pages);
 
   CreatePageMapping(*liumos->dram_allocator, *kernel_pml4,
                     kLAPICRegisterAreaVirtBase, kLAPICRegisterAreaPhysBase,
@@ -181,10 +185,12 @@ IA_PML4& GetKernelPML4(void) {
   return *liumos->kernel_pml4;
 }
 
-void FlushDirtyPages(IA_PML4& pml4_phys,
-                     uint64_t vaddr,
-                     uint64_t byte_size,
-                     uint64_t& num_of_clflush_issued) {
+// Calls func(pte, vaddr) for each 4KB page in [vaddr, vaddr + byte_size).
+template <class TFunc>
+static void ForEachPage(IA_PML4& pml4_phys,
+                        uint64_t vaddr,
+                        uint64_t byte_size,
+                        TFunc func) {
   assert((vaddr & kPageAddrMask) == 0);
   IA_PML4& pml4 = *GetKernelVirtAddrForPhysAddr(&pml4_phys);
   uint64_t num_of_4k_pages = ByteSizeToPageSize(byte_size);
@@ -215,13 +221,7 @@ void FlushDirtyPages(IA_PML4& pml4_phys,
         auto* pt = GetKernelVirtAddrForPhysAddr(pdte.GetTableAddr());
         for (int pt_idx = IA_PT::addr2index(vaddr);
              num_of_4k_pages && pt_idx < IA_PT::kNumOfEntries; pt_idx++) {
-          auto& pte = pt->GetEntryForAddr(vaddr);
-          if (pte.IsDirty()) {
-            CLFlush(reinterpret_cast<void*>(
-                        GetKernelVirtAddrForPhysAddr(pte.GetPageBaseAddr())),
-                    pte.kChunkSize, num_of_clflush_issued);
-            pte.ClearDirtyBit();
-          }
+          func(pt->GetEntryForAddr(vaddr), vaddr);
           vaddr += (1 << 12);
           num_of_4k_pages--;
         }
@@ -229,3 +229,76 @@ void FlushDirtyPages(IA_PML4& pml4_phys,
     }
   }
 }
+
+// Calls func(pte, vaddr) for each dirty 4KB page in [vaddr, vaddr + byte_size).
+template <class TFunc>
+static void ForEachDirtyPage(IA_PML4& pml4_phys,
+                             uint64_t vaddr,
+                             uint64_t byte_size,
+                             TFunc func) {
+  ForEachPage(pml4_phys, vaddr, byte_size, [&](IA_PTE& pte, uint64_t addr) {
+    if (pte.IsDirty())
+      func(pte, addr);
+  });
+}
+
+void FlushDirtyPages(IA_PML4& pml4_phys,
+                     uint64_t vaddr,
+                     uint64_t byte_size,
+                     uint64_t& num_of_clflush_issued,
+                     bool should_clear_dirty_bit) {
+  ForEachDirtyPage(pml4_phys, vaddr, byte_size, [&](IA_PTE& pte, uint64_t) {
+    Persistence::Flush(reinterpret_cast<void*>(
+                           GetKernelVirtAddrForPhysAddr(pte.GetPageBaseAddr())),
+                       pte.kChunkSize, num_of_clflush_issued);
+    if (should_clear_dirty_bit)
+      pte.ClearDirtyBit();
+  });
+}
+
+void CopyDirtyPages(IA_PML4& pml4_phys,
+                    uint64_t vaddr,
+                    uint64_t byte_size,
+                    uint64_t dst_paddr,
+                    uint64_t& stat_copied_bytes) {
+  const uint64_t vaddr_base = vaddr;
+  ForEachDirtyPage(
+      pml4_phys, vaddr, byte_size, [&](IA_PTE& pte, uint64_t page_vaddr) {
+        Persistence::CopyAndFlush(
+            reinterpret_cast<void*>(GetKernelVirtAddrForPhysAddr(
+                dst_paddr + (page_vaddr - vaddr_base))),
+            reinterpret_cast<void*>(
+                GetKernelVirtAddrForPhysAddr(pte.GetPageBaseAddr())),
+            pte.kChunkSize);
+        pte.ClearDirtyBit();
+        stat_copied_bytes += pte.kChunkSize;
+      });
+}
+
+void SetPagesWritable(IA_PML4& pml4_phys,
+                      uint64_t vaddr,
+                      uint64_t byte_size,
+                      bool writable) {
+  ForEachPage(pml4_phys, vaddr, byte_size,
+              [&](IA_PTE& pte, uint64_t) { pte.SetWritable(writable); });
+}
+
+void RemapPages(IA_PML4& pml4_phys,
+                uint64_t vaddr,
+                uint64_t byte_size,
+                uint64_t paddr) {
+  const uint64_t vaddr_base = vaddr;
+  ForEachPage(pml4_phys, vaddr, byte_size,
+              [&](IA_PTE& pte, uint64_t page_vaddr) {
+                pte.SetPageBaseAddr(paddr + (page_vaddr - vaddr_base),
+                                    pte.data & kPageAttrMask);
+              });
+}
+
+IA_PTE& GetPTEForAddr(IA_PML4& pml4_phys, uint64_t vaddr) {
+  IA_PTE* found = nullptr;
+  ForEachPage(pml4_phys, vaddr, kPageSize,
+              [&](IA_PTE& pte, uint64_t) { found = &pte; });
+  assert(found);
+  return *found;
+}
@@ -24,6 +24,15 @@ constexpr uint64_t kPageAttrUser = 0b00100;
 constexpr uint64_t kPageAttrWriteThrough = 0b01000;
 constexpr uint64_t kPageAttrCacheDisable = 0b10000;
 
+// CR3[11:0] holds a PCID when CR4.PCIDE = 1.
+constexpr uint64_t kCR3PCIDMask = 0xFFF;
+constexpr uint64_t kCR3BitNoFlush = (1ULL << 63);
+// Ignored by the CPU. Pages mapped with this are shared with other page
+// tables and not freed by DestroyUserPageTables.
+constexpr uint64_t kPageAttrShared = 1ULL << 9;
+// Ignored by the CPU. Set on read-only mappings of pages shared by fork.
+// A write to them makes a private copy of the page. See copy_on_write.h.
+constexpr uint64_t kPageAttrCopyOnWrite = 1ULL << 10;
 constexpr uint64_t kPageAttrMemMappedIO =
     kPageAttrCacheDisable | kPageAttrPresent | kPageAttrWritable;
 
@@ -189,6 +198,25 @@ packed_struct PageTableEntryStruct {
   auto ClearDirtyBit()->std::enable_if_t<is_page_allowed_v<S>, void> {
     data &= ~(1ULL << 6);
   }
+  template <typename S = Strategy>
+  auto SetDirtyBit()->std::enable_if_t<is_page_allowed_v<S>, void> {
+    data |= 1ULL << 6;
+  }
+  bool IsWritable() { return data & kPageAttrWritable; }
+  bool IsShared() { return data & kPageAttrShared; }
+  bool IsCopyOnWrite() { return data & kPageAttrCopyOnWrite; }
+  void SetCopyOnWrite(bool copy_on_write) {
+    if (copy_on_write)
+      data |= kPageAttrCopyOnWrite;
+    else
+      data &= ~kPageAttrCopyOnWrite;
+  }
+  void SetWritable(bool writable) {
+    if (writable)
+      data |= kPageAttrWritable;
+    else
+      data &= ~kPageAttrWritable;
+  }
 };
 
 struct PTEStrategy {
@@ -229,12 +257,12 @@ static_assert(sizeof(IA_PML4) == kPageSize);
 static_assert(!is_page_allowed_v<PML4EStrategy>);
 static_assert(is_table_allowed_v<PML4EStrategy>);
 
-template <class TAllocator>
-IA_PML4& AllocPageTable(TAllocator& allocator) {
-  IA_PML4* pml4 = allocator.template AllocPages<IA_PML4*>(1);
-  assert(pml4);
-  pml4->ClearMapping();
-  return *pml4;
+template <class TAllocator, class TTable = IA_PML4>
+TTable& AllocPageTable(TAllocator& allocator) {
+  TTable* table = allocator.template AllocPages<TTable*>(1);
+  assert(table);
+  table->ClearMapping();
+  return *table;
 }
 
 void SetKernelPageEntries(IA_PML4& pml4);
@@ -243,7 +271,29 @@ IA_PML4& GetKernelPML4(void);
 void FlushDirtyPages(IA_PML4& pml4,
                      uint64_t vaddr,
                      uint64_t byte_size,
-                     uint64_t& num_of_clflush_issued);
+                     uint64_t& num_of_clflush_issued,
+                     bool should_clear_dirty_bit = true);
+// Copies dirty pages in [vaddr, vaddr + byte_size) to the pages starting at
+// dst_paddr and clears their dirty bits.
+void CopyDirtyPages(IA_PML4& pml4,
+                    uint64_t vaddr,
+                    uint64_t byte_size,
+                    uint64_t dst_paddr,
+                    uint64_t& stat_copied_bytes);
+// Changes the writable bit of 4KB pages in [vaddr, vaddr + byte_size).
+// TLB entries are not invalidated.
+void SetPagesWritable(IA_PML4& pml4,
+                      uint64_t vaddr,
+                      uint64_t byte_size,
+                      bool writable);
+// Maps 4KB pages in [vaddr, vaddr + byte_size) to the pages starting at paddr
+// again, keeping their attributes. TLB entries are not invalidated.
+void RemapPages(IA_PML4& pml4,
+                uint64_t vaddr,
+                uint64_t byte_size,
+                uint64_t paddr);
+// Returns the entry of the 4KB page mapped at vaddr.
+IA_PTE& GetPTEForAddr(IA_PML4& pml4, uint64_t vaddr);
 
 template <class TAllocator>
 void inline CreatePageMapping(TAllocator& allocator,
@@ -252,12 +302,13 @@ void inline CreatePageMapping(TAllocator& allocator,
                               uint64_t paddr,
                               uint64_t byte_size,
                               uint64_t attr,
-                              bool should_clflush = false) {
+                              bool should_clflush = false,
+                              bool use_1gb_pages = false) {
   assert((vaddr & kPageAddrMask) == 0);
   assert((paddr & kPageAddrMask) == 0);
   uint64_t num_of_4k_pages = ByteSizeToPageSize(byte_size);
   for (int pml4_idx = IA_PML4::addr2index(vaddr);
-       pml4_idx < IA_PML4::kNumOfEntries; pml4_idx++) {
+       num_of_4k_pages && pml4_idx < IA_PML4::kNumOfEntries; pml4_idx++) {
     auto& pml4e = pml4.GetEntryForAddr(vaddr);
     if (!pml4e.IsPresent()) {
       IA_PDPT* new_pdpt = allocator.template AllocPages<IA_PDPT*>(1);
@@ -272,6 +323,19 @@ void inline CreatePageMapping(TAllocator& allocator,
          num_of_4k_pages && pdpt_idx < IA_PDPT::kNumOfEntries; pdpt_idx++) {
       auto& pdpte = pdpt->GetEntryForAddr(vaddr);
       if (!pdpte.IsPresent()) {
+        if (use_1gb_pages &&
+            num_of_4k_pages >= IA_PDT::kNumOfEntries * IA_PT::kNumOfEntries &&
+            (vaddr & IA_PDPTE::kOffsetMask) == 0 &&
+            (paddr & IA_PDPTE::kOffsetMask) == 0) {
+          // 1GB mapping
+          pdpte.SetPageBaseAddr(paddr, attr);
+          vaddr += (1 << 30);
+          paddr += (1 << 30);
+          num_of_4k_pages -= IA_PDT::kNumOfEntries * IA_PT::kNumOfEntries;
+          if (should_clflush)
+            _mm_clflush(&pdpte);
+          continue;
+        }
         IA_PDT* new_pdt = allocator.template AllocPages<IA_PDT*>(1);
         new_pdt->ClearMapping();
         pdpte.SetTableAddr(new_pdt, attr);
@@ -323,6 +387,118 @@ void inline CreatePageMapping(TAllocator& allocator,
   }
 }
 
+template <class TAllocator, class TEntry>
+void inline DestroyLeafMapping(TAllocator& allocator,
+                               TEntry& e,
+                               uint64_t& vaddr,
+                               uint64_t vaddr_end,
+                               bool should_free_pages) {
+  if ((vaddr & TEntry::kOffsetMask) || vaddr_end - vaddr < TEntry::kChunkSize)
+    Panic("Partial unmapping of a large page");
+  if (should_free_pages)
+    allocator.FreePages(reinterpret_cast<void*>(e.GetPageBaseAddr()),
+                        TEntry::kChunkSize >> kPageSizeExponent);
+  e.data = 0;
+  vaddr += TEntry::kChunkSize;
+}
+
+// Clears the mapping of [vaddr, vaddr + byte_size). Mapped pages are returned
+// to the allocator if should_free_pages is true. Page tables are kept as they
+// may be shared with other address spaces. The caller flushes the TLB.
+template <class TAllocator>
+void inline DestroyPageMapping(TAllocator& allocator,
+                               IA_PML4& pml4,
+                               uint64_t vaddr,
+                               uint64_t byte_size,
+                               bool should_free_pages) {
+  assert((vaddr & kPageAddrMask) == 0);
+  const uint64_t vaddr_end = vaddr + CeilToPageAlignment(byte_size);
+  while (vaddr < vaddr_end) {
+    uint64_t skip_mask;
+    auto& pml4e = pml4.GetEntryForAddr(vaddr);
+    if (!pml4e.IsPresent()) {
+      skip_mask = IA_PML4E::kOffsetMask;
+    } else {
+      auto& pdpte = pml4e.GetTableAddr()->GetEntryForAddr(vaddr);
+      if (!pdpte.IsPresent()) {
+        skip_mask = IA_PDPTE::kOffsetMask;
+      } else if (pdpte.IsPage()) {
+        DestroyLeafMapping(allocator, pdpte, vaddr, vaddr_end,
+                           should_free_pages);
+        continue;
+      } else {
+        auto& pdte = pdpte.GetTableAddr()->GetEntryForAddr(vaddr);
+        if (!pdte.IsPresent()) {
+          skip_mask = IA_PDE::kOffsetMask;
+        } else if (pdte.IsPage()) {
+          DestroyLeafMapping(allocator, pdte, vaddr, vaddr_end,
+                             should_free_pages);
+          continue;
+        } else {
+          auto& pte = pdte.GetTableAddr()->GetEntryForAddr(vaddr);
+          if (!pte.IsPresent()) {
+            skip_mask = IA_PTE::kOffsetMask;
+          } else {
+            DestroyLeafMapping(allocator, pte, vaddr, vaddr_end,
+                               should_free_pages);
+            continue;
+          }
+        }
+      }
+    }
+    const uint64_t next = (vaddr | skip_mask) + 1;
+    if (next < vaddr)
+      break;  // Reached the end of the address space.
+    vaddr = next;
+  }
+}
+
+// Frees every page mapped in the lower (user) half of pml4 and the page
+// tables that map them. The upper half is shared with the kernel and kept.
+// Pages mapped with kPageAttrShared are kept as well.
+template <class TAllocator>
+void inline DestroyUserPageTables(TAllocator& allocator, IA_PML4& pml4) {
+  for (int pml4_idx = 0; pml4_idx < IA_PML4::kNumOfEntries / 2; pml4_idx++) {
+    auto& pml4e = pml4.entries[pml4_idx];
+    if (!pml4e.IsPresent())
+      continue;
+    IA_PDPT* pdpt = pml4e.GetTableAddr();
+    for (auto& pdpte : pdpt->entries) {
+      if (!pdpte.IsPresent())
+        continue;
+      if (pdpte.IsPage()) {
+        if (!pdpte.IsShared())
+          allocator.FreePages(reinterpret_cast<void*>(pdpte.GetPageBaseAddr()),
+                              IA_PDPTE::kChunkSize >> kPageSizeExponent);
+        continue;
+      }
+      IA_PDT* pdt = pdpte.GetTableAddr();
+      for (auto& pdte : pdt->entries) {
+        if (!pdte.IsPresent())
+          continue;
+        if (pdte.IsPage()) {
+          if (!pdte.IsShared())
+            allocator.FreePages(
+                reinterpret_cast<void*>(pdte.GetPageBaseAddr()),
+                IA_PDE::kChunkSize >> kPageSizeExponent);
+          continue;
+        }
+        IA_PT* pt = pdte.GetTableAddr();
+        for (auto& pte : pt->entries) {
+          if (!pte.IsPresent() || pte.IsShared())
+            continue;
+          allocator.FreePages(reinterpret_cast<void*>(pte.GetPageBaseAddr()),
+                              1);
+        }
+        allocator.FreePages(pt, 1);
+      }
+      allocator.FreePages(pdt, 1);
+    }
+    allocator.FreePages(pdpt, 1);
+    pml4e.data = 0;
+  }
+}
+
 static inline void AssertAddressIsInLowerHalf(uint64_t addr) {
   assert(static_cast<int64_t>(addr) >= 0);
 }
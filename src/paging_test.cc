@@ -7,6 +7,7 @@
   puts(s);
   exit(EXIT_FAILURE);
 }
+#include "copy_on_write.h"
 #include "paging.h"
 
 uint64_t GetPhysAddrMask() {
@@ -93,6 +94,260 @@ void TestRangeMapping(IA_PML4& pml4,
   assert(v2p(pml4, vaddr + size) == kAddrCannotTranslate);
 }
 
+// Returns the number of page table pages allocated for the mapping.
+uint64_t MapRangeAndCountTables(uint64_t vaddr,
+                                uint64_t paddr,
+                                uint64_t size,
+                                bool use_1gb_pages) {
+  constexpr uint64_t kNumOfTablePages = 64;
+  void* buf = aligned_alloc(kPageSize, kNumOfTablePages << kPageSizeExponent);
+  if (!buf) {
+    perror("aligned_alloc failed.\n");
+    exit(EXIT_FAILURE);
+  }
+  PhysicalPageAllocator table_allocator;
+  table_allocator.FreePagesWithProximityDomain(buf, kNumOfTablePages, 0);
+  const uint64_t initial_free_pages = table_allocator.GetNumOfFreePages();
+  pml4.ClearMapping();
+  CreatePageMapping(table_allocator, pml4, vaddr, paddr, size,
+                    kPageAttrPresent, false, use_1gb_pages);
+  for (uint64_t offset = 0; offset < size; offset += (1ULL << 21)) {
+    assert(v2p(pml4, vaddr + offset) == paddr + offset);
+  }
+  assert(v2p(pml4, vaddr - 1) == kAddrCannotTranslate);
+  assert(v2p(pml4, vaddr + size - 1) == paddr + size - 1);
+  assert(v2p(pml4, vaddr + size) == kAddrCannotTranslate);
+  // The tables are kept alive since pml4 still points to them.
+  return initial_free_pages - table_allocator.GetNumOfFreePages();
+}
+
+void Test1GBPageRangeMapping() {
+  constexpr uint64_t k1GB = 1ULL << 30;
+  constexpr uint64_t k2MB = 1ULL << 21;
+  // 1 PDPT only.
+  assert(MapRangeAndCountTables(k1GB, 0, 4 * k1GB, true) == 1);
+  assert(pml4.GetTableBaseForAddr(k1GB)->GetEntryForAddr(k1GB).IsPage());
+  // 1 PDPT + 4 PDTs without 1GB pages.
+  assert(MapRangeAndCountTables(k1GB, 0, 4 * k1GB, false) == 5);
+  // Unaligned head and tail are mapped with 2MB pages: 1 PDPT + 2 PDTs.
+  assert(MapRangeAndCountTables(k1GB - k2MB, k1GB - k2MB, 2 * k1GB + 2 * k2MB,
+                                true) == 3);
+  // 1GB pages need paddr aligned as well: 1 PDPT + 2 PDTs.
+  assert(MapRangeAndCountTables(k1GB, k1GB + k2MB, 2 * k1GB, true) == 3);
+  // Spans two PML4 entries: 2 PDPTs.
+  assert(MapRangeAndCountTables(0x0000'007F'C000'0000ULL, 0, 2 * k1GB,
+                                true) == 2);
+}
+
+void TestRangeUnmapping(uint64_t vaddr) {
+  // Pages to be mapped are managed by another allocator so that we can check
+  // that all of them are returned on unmapping.
+  constexpr uint64_t kNumOfDataPages = 2048;
+  void* data_buf = aligned_alloc(1 << 21, kNumOfDataPages << kPageSizeExponent);
+  if (!data_buf) {
+    perror("aligned_alloc failed.\n");
+    exit(EXIT_FAILURE);
+  }
+  PhysicalPageAllocator data_allocator;
+  data_allocator.FreePagesWithProximityDomain(data_buf, kNumOfDataPages, 0);
+  const uint64_t initial_free_pages = data_allocator.GetNumOfFreePages();
+
+  // Large enough to be mapped with 2MB pages and 4KB pages.
+  constexpr uint64_t kNumOfPages = 700;
+  const uint64_t paddr = data_allocator.AllocPages<uint64_t>(kNumOfPages);
+  const uint64_t size = kNumOfPages << kPageSizeExponent;
+  CreatePageMapping(dummy_allocator, pml4, vaddr, paddr, size,
+                    kPageAttrPresent);
+  assert(v2p(pml4, vaddr) == paddr);
+  assert(v2p(pml4, vaddr + size - 1) == paddr + size - 1);
+
+  DestroyPageMapping(data_allocator, pml4, vaddr, size, true);
+  assert(v2p(pml4, vaddr) == kAddrCannotTranslate);
+  assert(v2p(pml4, vaddr + (1 << 21)) == kAddrCannotTranslate);
+  assert(v2p(pml4, vaddr + size - 1) == kAddrCannotTranslate);
+  assert(data_allocator.GetNumOfFreePages() == initial_free_pages);
+  free(data_buf);
+}
+
+void TestDestroyUserPageTables() {
+  constexpr uint64_t kNumOfPages = 4096;
+  void* buf = aligned_alloc(1 << 21, kNumOfPages << kPageSizeExponent);
+  if (!buf) {
+    perror("aligned_alloc failed.\n");
+    exit(EXIT_FAILURE);
+  }
+  PhysicalPageAllocator allocator;
+  allocator.FreePagesWithProximityDomain(buf, kNumOfPages, 0);
+  IA_PML4& user_pml4 = AllocPageTable(allocator);
+  const uint64_t initial_free_pages = allocator.GetNumOfFreePages();
+
+  // Segments like an ELF process. Page tables come from the same allocator.
+  const uint64_t segments[][2] = {
+      {0x0000'0000'0040'0000ULL, 3},
+      {0x0000'0000'0060'0000ULL, 600},
+      {0x0000'0000'BEEF'0000ULL, 32},
+      {0x0000'7FFF'0000'0000ULL, 1},
+  };
+  for (auto& seg : segments) {
+    CreatePageMapping(allocator, user_pml4, seg[0],
+                      allocator.AllocPages<uint64_t>(seg[1]),
+                      seg[1] << kPageSizeExponent, kPageAttrPresent);
+  }
+  // Shared code pages are owned by someone else.
+  constexpr uint64_t kSharedVAddr = 0x0000'0000'0020'0000ULL;
+  constexpr uint64_t kNumOfSharedPages = 4;
+  void* shared_pages = allocator.AllocPages<void*>(kNumOfSharedPages);
+  CreatePageMapping(allocator, user_pml4, kSharedVAddr,
+                    reinterpret_cast<uint64_t>(shared_pages),
+                    kNumOfSharedPages << kPageSizeExponent,
+                    kPageAttrPresent | kPageAttrShared);
+  // A kernel entry that should be kept.
+  user_pml4.entries[IA_PML4::kNumOfEntries - 1].data = 0xDEAD'0000ULL | 1;
+  assert(allocator.GetNumOfFreePages() < initial_free_pages);
+
+  DestroyUserPageTables(allocator, user_pml4);
+  for (auto& seg : segments) {
+    assert(v2p(user_pml4, seg[0]) == kAddrCannotTranslate);
+  }
+  assert(v2p(user_pml4, kSharedVAddr) == kAddrCannotTranslate);
+  assert(user_pml4.entries[IA_PML4::kNumOfEntries - 1].data ==
+         (0xDEAD'0000ULL | 1));
+  assert(allocator.GetNumOfFreePages() ==
+         initial_free_pages - kNumOfSharedPages);
+  allocator.FreePages(shared_pages, kNumOfSharedPages);
+  free(buf);
+}
+
+PageFrameTable frame_table;
+
+void TestPageFrameTable() {
+  constexpr uint64_t kNumOfFrames = PageFrameTable::kMaxNumOfSharedFrames;
+  constexpr uint64_t kFrameBase = 0x1'0000'0000ULL;
+  frame_table.Init();
+  for (uint64_t i = 0; i < kNumOfFrames; i++) {
+    assert(frame_table.AddRef(kFrameBase + (i << kPageSizeExponent)));
+  }
+  assert(!frame_table.AddRef(kFrameBase - kPageSize));
+  for (uint64_t i = 0; i < kNumOfFrames; i += 2) {
+    assert(frame_table.AddRef(kFrameBase + (i << kPageSizeExponent)));
+  }
+  // Removing frames should not hide frames probed after them.
+  for (uint64_t i = 0; i < kNumOfFrames; i += 3) {
+    assert(!frame_table.Release(kFrameBase + (i << kPageSizeExponent)));
+  }
+  for (uint64_t i = 0; i < kNumOfFrames; i++) {
+    const uint64_t expected = 2 + (i % 2 == 0) - (i % 3 == 0);
+    assert(frame_table.GetRefCount(kFrameBase + (i << kPageSizeExponent)) ==
+           expected);
+  }
+  for (uint64_t i = 0; i < kNumOfFrames; i++) {
+    const uint64_t paddr = kFrameBase + (i << kPageSizeExponent);
+    while (frame_table.GetRefCount(paddr) > 1) {
+      assert(!frame_table.Release(paddr));
+    }
+    assert(frame_table.Release(paddr));
+  }
+  assert(frame_table.GetNumOfSharedFrames() == 0);
+}
+
+IA_PTE& GetPTE(IA_PML4& pml4, uint64_t vaddr) {
+  return pml4.GetTableBaseForAddr(vaddr)
+      ->GetTableBaseForAddr(vaddr)
+      ->GetTableBaseForAddr(vaddr)
+      ->GetEntryForAddr(vaddr);
+}
+
+void TestCopyOnWrite() {
+  constexpr uint64_t kNumOfPages = 4096;
+  void* buf = aligned_alloc(1 << 21, kNumOfPages << kPageSizeExponent);
+  if (!buf) {
+    perror("aligned_alloc failed.\n");
+    exit(EXIT_FAILURE);
+  }
+  PhysicalPageAllocator allocator;
+  allocator.FreePagesWithProximityDomain(buf, kNumOfPages, 0);
+  frame_table.Init();
+  const uint64_t initial_free_pages = allocator.GetNumOfFreePages();
+
+  constexpr uint64_t kDataVAddr = 0x0000'0000'0040'0000ULL;
+  constexpr uint64_t kCodeVAddr = 0x0000'0000'0050'0000ULL;
+  constexpr uint64_t kSharedVAddr = 0x0000'0000'0060'0000ULL;
+  constexpr uint64_t kLargeVAddr = 0x0000'0000'0080'0000ULL;
+  constexpr uint64_t kNumOfDataPages = 3;
+  constexpr uint64_t kNumOfLargePages = 512;
+  IA_PML4& parent = AllocPageTable(allocator);
+  uint64_t* data = allocator.AllocPages<uint64_t*>(kNumOfDataPages);
+  for (uint64_t i = 0; i < kNumOfDataPages; i++) {
+    data[i * kPageSize / 8] = i;
+  }
+  CreatePageMapping(allocator, parent, kDataVAddr,
+                    reinterpret_cast<uint64_t>(data),
+                    kNumOfDataPages << kPageSizeExponent,
+                    kPageAttrPresent | kPageAttrWritable);
+  const uint64_t code = allocator.AllocPages<uint64_t>(1);
+  CreatePageMapping(allocator, parent, kCodeVAddr, code, kPageSize,
+                    kPageAttrPresent);
+  void* shared_page = allocator.AllocPages<void*>(1);
+  CreatePageMapping(allocator, parent, kSharedVAddr,
+                    reinterpret_cast<uint64_t>(shared_page), kPageSize,
+                    kPageAttrPresent | kPageAttrShared);
+  uint64_t* large = allocator.AllocPages<uint64_t*>(kNumOfLargePages);
+  large[0] = 0x1234;
+  CreatePageMapping(allocator, parent, kLargeVAddr,
+                    reinterpret_cast<uint64_t>(large),
+                    kNumOfLargePages << kPageSizeExponent,
+                    kPageAttrPresent | kPageAttrWritable);
+
+  IA_PML4& child = AllocPageTable(allocator);
+  CloneUserPageTables(allocator, frame_table, parent, child);
+  for (uint64_t i = 0; i < kNumOfDataPages; i++) {
+    const uint64_t vaddr = kDataVAddr + (i << kPageSizeExponent);
+    assert(v2p(child, vaddr) == v2p(parent, vaddr));
+    assert(!GetPTE(parent, vaddr).IsWritable());
+    assert(GetPTE(parent, vaddr).IsCopyOnWrite());
+    assert(!GetPTE(child, vaddr).IsWritable());
+    assert(GetPTE(child, vaddr).IsCopyOnWrite());
+  }
+  assert(v2p(child, kCodeVAddr) == code);
+  assert(!GetPTE(child, kCodeVAddr).IsCopyOnWrite());
+  assert(frame_table.GetRefCount(code) == 2);
+  assert(v2p(child, kSharedVAddr) == v2p(parent, kSharedVAddr));
+  assert(frame_table.GetRefCount(v2p(child, kSharedVAddr)) == 1);
+  // Writable large pages are copied.
+  uint64_t* large_copy = reinterpret_cast<uint64_t*>(v2p(child, kLargeVAddr));
+  assert(large_copy != large);
+  assert(large_copy[0] == 0x1234);
+
+  // The first writer gets a copy and the other one keeps the frame.
+  const uint64_t vaddr = kDataVAddr + kPageSize;
+  const uint64_t paddr = v2p(parent, vaddr);
+  assert(ResolveCopyOnWrite(allocator, frame_table, child, vaddr));
+  assert(v2p(child, vaddr) != paddr);
+  assert(*reinterpret_cast<uint64_t*>(v2p(child, vaddr)) == 1);
+  assert(GetPTE(child, vaddr).IsWritable());
+  assert(frame_table.GetRefCount(paddr) == 1);
+  assert(ResolveCopyOnWrite(allocator, frame_table, parent, vaddr));
+  assert(v2p(parent, vaddr) == paddr);
+  assert(GetPTE(parent, vaddr).IsWritable());
+  assert(!GetPTE(parent, vaddr).IsCopyOnWrite());
+  // Pages which are not copy-on-write are left as they are.
+  assert(!ResolveCopyOnWrite(allocator, frame_table, child, vaddr));
+  assert(!ResolveCopyOnWrite(allocator, frame_table, child, kCodeVAddr));
+  assert(!ResolveCopyOnWrite(allocator, frame_table, child, 0x1000));
+
+  // Frames are freed when the last page table mapping them is destroyed.
+  SharedFrameAwareAllocator<PhysicalPageAllocator> destroyer(allocator,
+                                                             frame_table);
+  DestroyUserPageTables(destroyer, parent);
+  assert(frame_table.GetNumOfSharedFrames() == 0);
+  DestroyUserPageTables(destroyer, child);
+  allocator.FreePages(&parent, 1);
+  allocator.FreePages(&child, 1);
+  assert(allocator.GetNumOfFreePages() == initial_free_pages - 1);
+  allocator.FreePages(shared_page, 1);
+  free(buf);
+}
+
 int main() {
   Test1GBPageMapping(0, 1ULL << 30);
   Test1GBPageMapping(1ULL << 30, 1ULL << 31);
@@ -102,6 +357,12 @@ int main() {
                    4ULL * 1024 * 1024 * 1024);
   TestRangeMapping(pml4, 0xFFFFFFFF'FFE00000ULL, 0x00000000'FFE00000ULL,
                    0x00000000'00200000ULL);
+  Test1GBPageRangeMapping();
+  TestRangeUnmapping(0xFFFFFFFF'90000000ULL);
+  TestRangeUnmapping(0x00000000'00400000ULL);
+  TestDestroyUserPageTables();
+  TestPageFrameTable();
+  TestCopyOnWrite();
   puts("PASS");
   return 0;
 }
@@ -0,0 +1,147 @@
+#include "persistence.h"
+
+#include "liumos.h"
+
+namespace Persistence {
+
+struct Statistics {
+  uint64_t num_of_lines_flushed;
+  uint64_t num_of_fences;
+  uint64_t num_of_bytes_copied_non_temporal;
+  uint64_t elapsed_time_femto_sec;
+};
+
+static Strategy strategy_;
+static bool is_available_[static_cast<int>(Strategy::kNumOfStrategies)];
+static bool is_non_temporal_copy_enabled_;
+static Statistics stats_[static_cast<int>(Strategy::kNumOfStrategies)];
+
+static Statistics& GetStatistics() {
+  return stats_[static_cast<int>(strategy_)];
+}
+
+void Init(const CPUFeatureSet& f) {
+  is_available_[static_cast<int>(Strategy::kCLFlush)] = f.clfsh;
+  is_available_[static_cast<int>(Strategy::kCLFlushOpt)] = f.clflushopt;
+  is_available_[static_cast<int>(Strategy::kCLWB)] = f.clwb;
+  // Prefer the one which does not evict lines, then the one which does not
+  // serialize.
+  strategy_ = Strategy::kCLFlush;
+  if (f.clflushopt)
+    strategy_ = Strategy::kCLFlushOpt;
+  if (f.clwb)
+    strategy_ = Strategy::kCLWB;
+  // MOVNTI is a part of SSE2 and is always available on x86-64.
+  is_non_temporal_copy_enabled_ = true;
+}
+
+bool IsAvailable(Strategy strategy) {
+  return is_available_[static_cast<int>(strategy)];
+}
+
+void SetStrategy(Strategy strategy) {
+  assert(IsAvailable(strategy));
+  strategy_ = strategy;
+}
+
+Strategy GetStrategy() {
+  return strategy_;
+}
+
+const char* GetStrategyName(Strategy strategy) {
+  switch (strategy) {
+    case Strategy::kCLFlush:
+      return "clflush";
+    case Strategy::kCLFlushOpt:
+      return "clflushopt";
+    case Strategy::kCLWB:
+      return "clwb";
+    default:
+      return "unknown";
+  }
+}
+
+void SetNonTemporalCopyEnabled(bool enabled) {
+  is_non_temporal_copy_enabled_ = enabled;
+}
+
+bool IsNonTemporalCopyEnabled() {
+  return is_non_temporal_copy_enabled_;
+}
+
+void Flush(const void* buf, size_t size, uint64_t& num_of_lines_flushed) {
+  if (!size)
+    return;
+  const uint64_t begin =
+      reinterpret_cast<uint64_t>(buf) & ~(kCacheLineSize - 1);
+  const uint64_t end = reinterpret_cast<uint64_t>(buf) + size;
+  const uint64_t num_of_lines =
+      (end - begin + kCacheLineSize - 1) / kCacheLineSize;
+  Statistics& stat = GetStatistics();
+  switch (strategy_) {
+    case Strategy::kCLFlush:
+      CLFlushLines(begin, num_of_lines);
+      break;
+    case Strategy::kCLFlushOpt:
+      CLFlushOptLines(begin, num_of_lines);
+      StoreFence();
+      stat.num_of_fences++;
+      break;
+    case Strategy::kCLWB:
+      CLWBLines(begin, num_of_lines);
+      StoreFence();
+      stat.num_of_fences++;
+      break;
+    default:
+      Panic("Unknown persistence strategy");
+  }
+  stat.num_of_lines_flushed += num_of_lines;
+  num_of_lines_flushed += num_of_lines;
+}
+
+void CopyAndFlush(void* dst,
+                  const void* src,
+                  size_t size,
+                  uint64_t& num_of_lines_flushed) {
+  constexpr uint64_t kAlignMask = 8 - 1;
+  if (is_non_temporal_copy_enabled_ &&
+      ((reinterpret_cast<uint64_t>(dst) | size) & kAlignMask) == 0) {
+    // Non-temporal stores bypass caches and are made durable by SFENCE.
+    NonTemporalCopy8BytesAndFence(size / 8, dst, src);
+    Statistics& stat = GetStatistics();
+    stat.num_of_fences++;
+    stat.num_of_bytes_copied_non_temporal += size;
+    return;
+  }
+  memcpy(dst, src, size);
+  Flush(dst, size, num_of_lines_flushed);
+}
+
+void AddElapsedTimeFemtoSec(uint64_t fs) {
+  GetStatistics().elapsed_time_femto_sec += fs;
+}
+
+void PrintStatistics() {
+  PutString("Persistence strategy: ");
+  PutString(GetStrategyName(strategy_));
+  PutString(is_non_temporal_copy_enabled_ ? " + movnti copy\n"
+                                          : " + memcpy copy\n");
+  PutString(
+      "strategy, available, lines flushed, fences, movnti copy [MB], time "
+      "[s]\n");
+  for (int i = 0; i < static_cast<int>(Strategy::kNumOfStrategies); i++) {
+    Statistics& stat = stats_[i];
+    PutString(GetStrategyName(static_cast<Strategy>(i)));
+    PutString(is_available_[i] ? ", yes, " : ", no, ");
+    PutDecimal64(stat.num_of_lines_flushed);
+    PutString(", ");
+    PutDecimal64(stat.num_of_fences);
+    PutString(", ");
+    PutDecimal64WithPointPos(stat.num_of_bytes_copied_non_temporal, 6);
+    PutString(", ");
+    PutDecimal64WithPointPos(stat.elapsed_time_femto_sec, 15);
+    PutString("\n");
+  }
+}
+
+}  // namespace Persistence
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "asm.h"
+#include "generic.h"
+
+// Primitives to make stores to persistent memory durable.
+// The fastest available flush instruction is chosen at boot and can be
+// switched at runtime. Every Flush returns after its lines are written back,
+// so stores issued after it are ordered as with CLFLUSH.
+namespace Persistence {
+
+enum class Strategy {
+  kCLFlush,     // CLFLUSH for each line.
+  kCLFlushOpt,  // CLFLUSHOPT for each line and one SFENCE.
+  kCLWB,        // CLWB for each line and one SFENCE. Lines stay cached.
+  kNumOfStrategies,
+};
+constexpr uint64_t kCacheLineSize = 64;
+
+void Init(const CPUFeatureSet& f);
+bool IsAvailable(Strategy strategy);
+void SetStrategy(Strategy strategy);
+Strategy GetStrategy();
+const char* GetStrategyName(Strategy strategy);
+// Copies into persistent memory use MOVNTI stores instead of memcpy + Flush
+// if enabled.
+void SetNonTemporalCopyEnabled(bool enabled);
+bool IsNonTemporalCopyEnabled();
+
+void Flush(const void* buf, size_t size, uint64_t& num_of_lines_flushed);
+inline void Flush(const void* buf, size_t size) {
+  uint64_t num_of_lines_flushed = 0;
+  Flush(buf, size, num_of_lines_flushed);
+}
+template <typename T>
+void Flush(const T* obj) {
+  Flush(obj, sizeof(*obj));
+}
+// Copies size bytes from src to dst in persistent memory and makes them
+// durable.
+void CopyAndFlush(void* dst,
+                  const void* src,
+                  size_t size,
+                  uint64_t& num_of_lines_flushed);
+inline void CopyAndFlush(void* dst, const void* src, size_t size) {
+  uint64_t num_of_lines_flushed = 0;
+  CopyAndFlush(dst, src, size, num_of_lines_flushed);
+}
+
+// Attributes time spent in persisting data to the current strategy.
+void AddElapsedTimeFemtoSec(uint64_t fs);
+void PrintStatistics();
+
+}  // namespace Persistence
@@ -1,21 +1,48 @@
 #include "liumos.h"
 
 void PhysicalPageAllocator::Print() {
-  FreeInfo* info = head_;
-  while (info) {
-    info->Print();
-    info = info->GetNext();
+  const int local_pool_idx = GetLocalPoolIndex();
+  for (Zone* zone = zone_head_; zone; zone = zone->GetNext()) {
+    zone->Print();
   }
+  for (int i = 0; i < num_of_pools_; i++) {
+    Pool& pool = pools_[i];
+    pool.Print();
+    PutString("  Fallback (domain:distance):");
+    for (int k = 0; k < num_of_pools_; k++) {
+      const int idx = pool.fallback_order[k];
+      PutString(" 0x");
+      PutHex64(pools_[idx].proximity_domain);
+      PutString(":");
+      PutDecimal64(pool.distance[idx]);
+    }
+    PutString(i == local_pool_idx ? " (local)\n" : "\n");
+  }
+  PutStringAndHex("Free pages", GetNumOfFreePages());
+  PutStringAndHex("Largest free block pages", GetLargestFreeBlockNumOfPages());
+}
+
+void PhysicalPageAllocator::Pool::Print() {
+  PutStringAndHex("ProxDomain", proximity_domain);
+  PutStringAndHex("  Free pages", GetNumOfFreePages());
+  PutString("  Free blocks (order:count):");
+  for (int i = 0; i < kNumOfOrders; i++) {
+    PutString(" ");
+    PutDecimal64(i);
+    PutString(":");
+    PutDecimal64(num_of_free_blocks[i]);
+  }
+  PutString("\n");
 }
 
-void PhysicalPageAllocator::FreeInfo::Print() {
-  uint64_t physical_start = reinterpret_cast<uint64_t>(this);
+void PhysicalPageAllocator::Zone::Print() {
+  uint64_t physical_start = first_page_idx_ << kPageSizeExponent;
   PutString("[ 0x");
   PutHex64ZeroFilled(physical_start);
   PutString(" - 0x");
-  PutHex64ZeroFilled(physical_start + (num_of_pages_ << 12));
+  PutHex64ZeroFilled(physical_start + (num_of_pages_ << kPageSizeExponent));
   PutString(" )@ProxDomain:0x");
-  PutHex64(proximity_domain_);
+  PutHex64(pool_.proximity_domain);
   PutString(" = 0x");
   PutHex64(num_of_pages_);
   PutString(" pages\n");
@@ -1,78 +1,382 @@
 #pragma once
 #include "generic.h"
+#include "spin_lock.h"
 
+// Binary buddy allocator for physical pages.
+// Each range passed to FreePagesWithProximityDomain for the first time is
+// registered as a Zone. The head pages of a zone hold its header and a byte
+// map that records the order of each free block head, so buddies can be
+// coalesced on free without touching pages that are in use.
+// Allocations and frees are serialized by a lock since they can happen on
+// every processor.
+// Free blocks are kept in one Pool per proximity domain. When a pool runs
+// out of pages, other pools are tried in order of their distance.
+// The local proximity domain is looked up on each allocation since
+// processors in different domains share the allocator.
 class PhysicalPageAllocator {
  public:
-  PhysicalPageAllocator() : head_(nullptr) {}
+  static constexpr int kNumOfOrders = 19;  // up to 2^18 pages (1GiB)
+  static constexpr int kMaxNumOfPools = 8;
+  static constexpr uint8_t kLocalDistance = 10;
+  static constexpr uint8_t kRemoteDistance = 20;
+
+  using ProximityDomainGetter = uint32_t (*)();
+
+  PhysicalPageAllocator()
+      : zone_head_(nullptr),
+        num_of_pools_(0),
+        get_local_proximity_domain_(nullptr) {}
   void FreePagesWithProximityDomain(void* phys_addr,
                                     uint64_t num_of_pages,
                                     uint32_t prox_domain) {
-    // TODO: Impl merge
+    SpinLockGuard guard(lock_);
     assert(num_of_pages > 0);
     const uint64_t phys_addr_uint64 = reinterpret_cast<uint64_t>(phys_addr);
-    assert((phys_addr_uint64 & 0xfff) == 0);
-    FreeInfo* info = reinterpret_cast<FreeInfo*>(phys_addr);
-    head_ = new (info) FreeInfo(num_of_pages, head_, prox_domain);
+    assert((phys_addr_uint64 & kPageAddrMask) == 0);
+    const uint64_t page_idx = phys_addr_uint64 >> kPageSizeExponent;
+    Zone* zone = FindZone(page_idx, num_of_pages);
+    if (!zone) {
+      RegisterZone(page_idx, num_of_pages, GetOrCreatePool(prox_domain));
+      return;
+    }
+    assert(zone->GetPool().proximity_domain == prox_domain);
+    FreeRange(*zone, page_idx, num_of_pages);
+  }
+  void FreePages(void* phys_addr, uint64_t num_of_pages) {
+    SpinLockGuard guard(lock_);
+    assert(num_of_pages > 0);
+    const uint64_t phys_addr_uint64 = reinterpret_cast<uint64_t>(phys_addr);
+    assert((phys_addr_uint64 & kPageAddrMask) == 0);
+    const uint64_t page_idx = phys_addr_uint64 >> kPageSizeExponent;
+    Zone* zone = FindZone(page_idx, num_of_pages);
+    if (!zone)
+      Panic("Freeing pages not managed by this allocator");
+    FreeRange(*zone, page_idx, num_of_pages);
   }
 
+  // Allocates pages from the local proximity domain,
+  // or from the nearest one which has enough free pages.
   template <typename T>
   T AllocPages(uint64_t num_of_pages) {
-    FreeInfo* info = head_;
-    void* addr = nullptr;
-    while (info) {
-      addr = info->ProvidePages(num_of_pages);
-      if (addr)
-        return reinterpret_cast<T>(addr);
-      info = info->GetNext();
-    }
+    SpinLockGuard guard(lock_);
+    void* addr = ProvidePagesNear(num_of_pages, GetLocalPoolIndex());
+    if (addr)
+      return reinterpret_cast<T>(addr);
     Panic("Cannot allocate pages");
   }
+  // Same as AllocPages but prefers the given proximity domain.
   template <typename T>
   T AllocPagesInProximityDomain(uint64_t num_of_pages,
                                 uint32_t proximity_domain) {
-    FreeInfo* info = head_;
-    void* addr = nullptr;
-    while (info) {
-      if (info->GetProximityDomain() == proximity_domain) {
-        addr = info->ProvidePages(num_of_pages);
-        if (addr)
-          return reinterpret_cast<T>(addr);
-      }
-      info = info->GetNext();
-    }
+    SpinLockGuard guard(lock_);
+    const int pool_idx = FindPool(proximity_domain);
+    void* addr = ProvidePagesNear(
+        num_of_pages, pool_idx < 0 ? GetLocalPoolIndex() : pool_idx);
+    if (addr)
+      return reinterpret_cast<T>(addr);
     Panic("Cannot allocate pages");
   }
+  // Returns nullptr if the given proximity domain does not have enough pages.
+  template <typename T>
+  T TryAllocPagesStrictlyInProximityDomain(uint64_t num_of_pages,
+                                           uint32_t proximity_domain) {
+    SpinLockGuard guard(lock_);
+    const int pool_idx = FindPool(proximity_domain);
+    if (pool_idx < 0)
+      return nullptr;
+    return reinterpret_cast<T>(ProvidePages(num_of_pages, pools_[pool_idx]));
+  }
+
+  // Distance between proximity domains, as described in ACPI SLIT.
+  // Domains without any distance specified are treated as kRemoteDistance.
+  void SetDistance(uint32_t from_domain, uint32_t to_domain, uint8_t distance) {
+    const int from_idx = FindPool(from_domain);
+    const int to_idx = FindPool(to_domain);
+    if (from_idx < 0 || to_idx < 0)
+      return;
+    pools_[from_idx].distance[to_idx] = distance;
+    UpdateFallbackOrder(pools_[from_idx]);
+  }
+  // getter returns the proximity domain of the running processor. The first
+  // pool is used as the local one until this is called.
+  void SetLocalProximityDomainGetter(ProximityDomainGetter getter) {
+    get_local_proximity_domain_ = getter;
+  }
+  int GetNumOfProximityDomains() const { return num_of_pools_; }
+  uint32_t GetProximityDomain(int pool_idx) const {
+    assert(0 <= pool_idx && pool_idx < num_of_pools_);
+    return pools_[pool_idx].proximity_domain;
+  }
+  uint64_t GetNumOfFreePagesInProximityDomain(uint32_t proximity_domain) const {
+    const int pool_idx = FindPool(proximity_domain);
+    return pool_idx < 0 ? 0 : pools_[pool_idx].GetNumOfFreePages();
+  }
+
+  uint64_t GetNumOfFreePages() const {
+    uint64_t num_of_pages = 0;
+    for (int i = 0; i < num_of_pools_; i++) {
+      num_of_pages += pools_[i].GetNumOfFreePages();
+    }
+    return num_of_pages;
+  }
+  uint64_t GetNumOfFreeBlocks(int order) const {
+    assert(0 <= order && order < kNumOfOrders);
+    uint64_t num_of_blocks = 0;
+    for (int i = 0; i < num_of_pools_; i++) {
+      num_of_blocks += pools_[i].num_of_free_blocks[order];
+    }
+    return num_of_blocks;
+  }
+  uint64_t GetLargestFreeBlockNumOfPages() const {
+    for (int i = kNumOfOrders - 1; i >= 0; i--) {
+      if (GetNumOfFreeBlocks(i))
+        return 1ULL << i;
+    }
+    return 0;
+  }
   void Print();
 
  private:
-  class FreeInfo {
+  class Zone;
+  struct FreeBlock;
+  struct Pool {
+    uint32_t proximity_domain;
+    FreeBlock* free_list_head[kNumOfOrders];
+    uint64_t num_of_free_blocks[kNumOfOrders];
+    uint8_t distance[kMaxNumOfPools];
+    int fallback_order[kMaxNumOfPools];  // pool indices, nearest first
+    uint64_t GetNumOfFreePages() const {
+      uint64_t num_of_pages = 0;
+      for (int i = 0; i < kNumOfOrders; i++) {
+        num_of_pages += num_of_free_blocks[i] << i;
+      }
+      return num_of_pages;
+    }
+    void Print();
+  };
+  struct FreeBlock {
+    FreeBlock* next;
+    FreeBlock* prev;
+    Zone* zone;
+  };
+  static_assert(sizeof(FreeBlock) <= kPageSize);
+
+  class Zone {
    public:
-    FreeInfo(uint64_t num_of_pages, FreeInfo* next, uint32_t proximity_domain)
-        : num_of_pages_(num_of_pages),
+    static constexpr uint8_t kNotAFreeBlockHead = 0xFF;
+    static uint64_t GetNumOfMetadataPages(uint64_t num_of_pages) {
+      return ByteSizeToPageSize(sizeof(Zone) + num_of_pages);
+    }
+    Zone(uint64_t first_page_idx, uint64_t num_of_pages, Pool& pool, Zone* next)
+        : first_page_idx_(first_page_idx),
+          num_of_pages_(num_of_pages),
           next_(next),
-          proximity_domain_(proximity_domain) {}
-    FreeInfo* GetNext() const { return next_; }
-    void* ProvidePages(uint64_t num_of_req_pages) {
-      if (!CanProvidePages(num_of_req_pages))
-        return nullptr;
-      num_of_pages_ -= num_of_req_pages;
-      return reinterpret_cast<void*>(reinterpret_cast<uint64_t>(this) +
-                                     (num_of_pages_ << 12));
+          pool_(pool) {
+      uint8_t* order_map = GetOrderMap();
+      for (uint64_t i = 0; i < num_of_pages_; i++) {
+        order_map[i] = kNotAFreeBlockHead;
+      }
     }
-
+    bool Contains(uint64_t page_idx, uint64_t num_of_pages) const {
+      return first_page_idx_ <= page_idx &&
+             page_idx + num_of_pages <= first_page_idx_ + num_of_pages_;
+    }
+    uint8_t GetOrderOfFreeBlockAt(uint64_t page_idx) {
+      assert(Contains(page_idx, 1));
+      return GetOrderMap()[page_idx - first_page_idx_];
+    }
+    void SetOrderOfFreeBlockAt(uint64_t page_idx, uint8_t order) {
+      assert(Contains(page_idx, 1));
+      GetOrderMap()[page_idx - first_page_idx_] = order;
+    }
+    uint64_t GetFirstPageIndex() const { return first_page_idx_; }
+    uint64_t GetNumOfPages() const { return num_of_pages_; }
+    Zone* GetNext() const { return next_; }
+    Pool& GetPool() { return pool_; }
     void Print();
-    uint32_t GetProximityDomain() { return proximity_domain_; };
 
    private:
-    bool CanProvidePages(uint64_t num_of_req_pages) const {
-      return num_of_req_pages < num_of_pages_;
-    }
+    uint8_t* GetOrderMap() { return reinterpret_cast<uint8_t*>(this + 1); }
 
+    uint64_t first_page_idx_;
     uint64_t num_of_pages_;
-    FreeInfo* next_;
-    uint32_t proximity_domain_;
+    Zone* next_;
+    Pool& pool_;
   };
-  static_assert(sizeof(FreeInfo) <= kPageSize);
 
-  FreeInfo* head_;
+  static FreeBlock* GetFreeBlockAt(uint64_t page_idx) {
+    return reinterpret_cast<FreeBlock*>(page_idx << kPageSizeExponent);
+  }
+  static uint64_t GetPageIndexOf(FreeBlock* block) {
+    return reinterpret_cast<uint64_t>(block) >> kPageSizeExponent;
+  }
+  static int GetOrderForNumOfPages(uint64_t num_of_pages) {
+    int order = 0;
+    while ((1ULL << order) < num_of_pages)
+      order++;
+    return order;
+  }
+
+  Zone* FindZone(uint64_t page_idx, uint64_t num_of_pages) {
+    for (Zone* zone = zone_head_; zone; zone = zone->GetNext()) {
+      if (zone->Contains(page_idx, num_of_pages))
+        return zone;
+      assert(!zone->Contains(page_idx, 1) &&
+             !zone->Contains(page_idx + num_of_pages - 1, 1));
+    }
+    return nullptr;
+  }
+  int FindPool(uint32_t proximity_domain) const {
+    for (int i = 0; i < num_of_pools_; i++) {
+      if (pools_[i].proximity_domain == proximity_domain)
+        return i;
+    }
+    return -1;
+  }
+  int GetLocalPoolIndex() const {
+    if (!get_local_proximity_domain_)
+      return 0;
+    const int pool_idx = FindPool(get_local_proximity_domain_());
+    return pool_idx < 0 ? 0 : pool_idx;
+  }
+  Pool& GetOrCreatePool(uint32_t proximity_domain) {
+    const int found_idx = FindPool(proximity_domain);
+    if (found_idx >= 0)
+      return pools_[found_idx];
+    if (num_of_pools_ >= kMaxNumOfPools)
+      Panic("Too many proximity domains");
+    const int idx = num_of_pools_++;
+    Pool& pool = pools_[idx];
+    pool.proximity_domain = proximity_domain;
+    for (int i = 0; i < kNumOfOrders; i++) {
+      pool.free_list_head[i] = nullptr;
+      pool.num_of_free_blocks[i] = 0;
+    }
+    for (int i = 0; i < kMaxNumOfPools; i++) {
+      pool.distance[i] = kRemoteDistance;
+      pools_[i].distance[idx] = kRemoteDistance;
+    }
+    pool.distance[idx] = kLocalDistance;
+    for (int i = 0; i < num_of_pools_; i++) {
+      UpdateFallbackOrder(pools_[i]);
+    }
+    return pool;
+  }
+  void UpdateFallbackOrder(Pool& pool) {
+    // Insertion sort by distance. Ties are broken by pool index.
+    for (int i = 0; i < num_of_pools_; i++) {
+      int j = i;
+      for (; j > 0 && pool.distance[pool.fallback_order[j - 1]] >
+                          pool.distance[i];
+           j--) {
+        pool.fallback_order[j] = pool.fallback_order[j - 1];
+      }
+      pool.fallback_order[j] = i;
+    }
+  }
+
+  void RegisterZone(uint64_t page_idx, uint64_t num_of_pages, Pool& pool) {
+    const uint64_t num_of_metadata_pages =
+        Zone::GetNumOfMetadataPages(num_of_pages);
+    if (num_of_pages <= num_of_metadata_pages)
+      return;  // Too small to be managed.
+    Zone* zone = reinterpret_cast<Zone*>(page_idx << kPageSizeExponent);
+    zone_head_ = new (zone)
+        Zone(page_idx + num_of_metadata_pages,
+             num_of_pages - num_of_metadata_pages, pool, zone_head_);
+    FreeRange(*zone, zone->GetFirstPageIndex(), zone->GetNumOfPages());
+  }
+
+  void PushFreeBlock(Zone& zone, uint64_t page_idx, int order) {
+    Pool& pool = zone.GetPool();
+    FreeBlock* block = GetFreeBlockAt(page_idx);
+    block->next = pool.free_list_head[order];
+    block->prev = nullptr;
+    block->zone = &zone;
+    if (block->next)
+      block->next->prev = block;
+    pool.free_list_head[order] = block;
+    pool.num_of_free_blocks[order]++;
+    zone.SetOrderOfFreeBlockAt(page_idx, static_cast<uint8_t>(order));
+  }
+  void RemoveFreeBlock(FreeBlock* block, int order) {
+    Pool& pool = block->zone->GetPool();
+    if (block->prev)
+      block->prev->next = block->next;
+    else
+      pool.free_list_head[order] = block->next;
+    if (block->next)
+      block->next->prev = block->prev;
+    pool.num_of_free_blocks[order]--;
+    block->zone->SetOrderOfFreeBlockAt(GetPageIndexOf(block),
+                                       Zone::kNotAFreeBlockHead);
+  }
+
+  void FreeBlockAndMerge(Zone& zone, uint64_t page_idx, int order) {
+    while (order < kNumOfOrders - 1) {
+      const uint64_t buddy_idx = page_idx ^ (1ULL << order);
+      if (!zone.Contains(buddy_idx, 1ULL << order) ||
+          zone.GetOrderOfFreeBlockAt(buddy_idx) != order)
+        break;
+      RemoveFreeBlock(GetFreeBlockAt(buddy_idx), order);
+      page_idx &= ~(1ULL << order);
+      order++;
+    }
+    PushFreeBlock(zone, page_idx, order);
+  }
+  void FreeRange(Zone& zone, uint64_t page_idx, uint64_t num_of_pages) {
+    assert(zone.Contains(page_idx, num_of_pages));
+    while (num_of_pages) {
+      // Split the range into naturally aligned power-of-two blocks.
+      int order = 0;
+      while (order < kNumOfOrders - 1 &&
+             (page_idx & (1ULL << order)) == 0 &&
+             (2ULL << order) <= num_of_pages)
+        order++;
+      FreeBlockAndMerge(zone, page_idx, order);
+      page_idx += 1ULL << order;
+      num_of_pages -= 1ULL << order;
+    }
+  }
+
+  void* ProvidePages(uint64_t num_of_pages, Pool& pool) {
+    assert(num_of_pages > 0);
+    const int order = GetOrderForNumOfPages(num_of_pages);
+    for (int o = order; o < kNumOfOrders; o++) {
+      FreeBlock* block = pool.free_list_head[o];
+      if (!block)
+        continue;
+      Zone& zone = *block->zone;
+      const uint64_t page_idx = GetPageIndexOf(block);
+      RemoveFreeBlock(block, o);
+      // Split the block until it fits, then return the unused tail.
+      while (o > order) {
+        o--;
+        PushFreeBlock(zone, page_idx + (1ULL << o), o);
+      }
+      if (num_of_pages < (1ULL << order))
+        FreeRange(zone, page_idx + num_of_pages,
+                  (1ULL << order) - num_of_pages);
+      return reinterpret_cast<void*>(page_idx << kPageSizeExponent);
+    }
+    return nullptr;
+  }
+  void* ProvidePagesNear(uint64_t num_of_pages, int pool_idx) {
+    if (num_of_pools_ == 0)
+      return nullptr;
+    assert(0 <= pool_idx && pool_idx < num_of_pools_);
+    const Pool& pool = pools_[pool_idx];
+    for (int i = 0; i < num_of_pools_; i++) {
+      void* addr = ProvidePages(num_of_pages, pools_[pool.fallback_order[i]]);
+      if (addr)
+        return addr;
+    }
+    return nullptr;
+  }
+
+  Zone* zone_head_;
+  Pool pools_[kMaxNumOfPools];
+  int num_of_pools_;
+  ProximityDomainGetter get_local_proximity_domain_;
+  SpinLock lock_;
 };
@@ -0,0 +1,205 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <cassert>
+#include <chrono>
+#include <random>
+#include <vector>
+
+[[noreturn]] void Panic(const char* s) {
+  puts(s);
+  exit(EXIT_FAILURE);
+}
+
+#include "phys_page_allocator.h"
+
+static void* AllocAlignedBuffer(uint64_t num_of_pages, uint64_t align) {
+  void* buf = aligned_alloc(align, num_of_pages << kPageSizeExponent);
+  if (!buf) {
+    perror("aligned_alloc failed.\n");
+    exit(EXIT_FAILURE);
+  }
+  return buf;
+}
+
+static bool IsInRange(void* p, void* base, uint64_t num_of_pages) {
+  uint64_t v = reinterpret_cast<uint64_t>(p);
+  uint64_t b = reinterpret_cast<uint64_t>(base);
+  return b <= v && v < b + (num_of_pages << kPageSizeExponent);
+}
+
+void TestAllocAndCoalesce() {
+  puts("TestAllocAndCoalesce");
+  constexpr uint64_t kNumOfPages = 4096;
+  void* buf = AllocAlignedBuffer(kNumOfPages, 1 << 24);
+  PhysicalPageAllocator allocator;
+  allocator.FreePagesWithProximityDomain(buf, kNumOfPages, 0);
+  const uint64_t initial_free_pages = allocator.GetNumOfFreePages();
+  const uint64_t initial_largest = allocator.GetLargestFreeBlockNumOfPages();
+  // Some pages are used to hold the metadata of the range.
+  assert(0 < initial_free_pages && initial_free_pages < kNumOfPages);
+
+  std::vector<std::pair<uint8_t*, uint64_t>> allocated;
+  for (uint64_t n : {1, 2, 3, 5, 8, 13, 1, 1, 64, 100}) {
+    uint8_t* p = allocator.AllocPages<uint8_t*>(n);
+    assert(IsInRange(p, buf, kNumOfPages));
+    assert((reinterpret_cast<uint64_t>(p) & kPageAddrMask) == 0);
+    for (auto& it : allocated) {
+      assert(p + (n << kPageSizeExponent) <= it.first ||
+             it.first + (it.second << kPageSizeExponent) <= p);
+    }
+    allocated.push_back({p, n});
+  }
+  uint64_t num_of_allocated_pages = 0;
+  for (auto& it : allocated)
+    num_of_allocated_pages += it.second;
+  // Only the requested number of pages are consumed.
+  assert(allocator.GetNumOfFreePages() ==
+         initial_free_pages - num_of_allocated_pages);
+
+  // Free in a scrambled order. All blocks should be merged again.
+  for (size_t i = 0; i < allocated.size(); i += 2)
+    allocator.FreePages(allocated[i].first, allocated[i].second);
+  for (size_t i = 1; i < allocated.size(); i += 2)
+    allocator.FreePages(allocated[i].first, allocated[i].second);
+  assert(allocator.GetNumOfFreePages() == initial_free_pages);
+  assert(allocator.GetLargestFreeBlockNumOfPages() == initial_largest);
+
+  // Partial frees of a single allocation are allowed.
+  uint8_t* p = allocator.AllocPages<uint8_t*>(16);
+  allocator.FreePages(p + (4 << kPageSizeExponent), 12);
+  allocator.FreePages(p, 4);
+  assert(allocator.GetNumOfFreePages() == initial_free_pages);
+  assert(allocator.GetLargestFreeBlockNumOfPages() == initial_largest);
+  free(buf);
+}
+
+void TestProximityDomain() {
+  puts("TestProximityDomain");
+  constexpr uint64_t kNumOfPages = 1024;
+  void* buf0 = AllocAlignedBuffer(kNumOfPages, kPageSize);
+  void* buf1 = AllocAlignedBuffer(kNumOfPages, kPageSize);
+  PhysicalPageAllocator allocator;
+  allocator.FreePagesWithProximityDomain(buf0, kNumOfPages, 0);
+  allocator.FreePagesWithProximityDomain(buf1, kNumOfPages, 1);
+  for (int i = 0; i < 16; i++) {
+    assert(IsInRange(allocator.AllocPagesInProximityDomain<void*>(7, 0), buf0,
+                     kNumOfPages));
+    assert(IsInRange(allocator.AllocPagesInProximityDomain<void*>(7, 1), buf1,
+                     kNumOfPages));
+  }
+  free(buf0);
+  free(buf1);
+}
+
+void TestFallbackInDistanceOrder() {
+  puts("TestFallbackInDistanceOrder");
+  constexpr uint64_t kNumOfPages = 64;
+  void* buf[3];
+  PhysicalPageAllocator allocator;
+  for (uint32_t i = 0; i < 3; i++) {
+    buf[i] = AllocAlignedBuffer(kNumOfPages, kPageSize);
+    allocator.FreePagesWithProximityDomain(buf[i], kNumOfPages, i);
+  }
+  allocator.SetDistance(0, 1, 30);
+  allocator.SetDistance(0, 2, 15);
+  allocator.SetLocalProximityDomainGetter([]() -> uint32_t { return 0; });
+  const uint64_t pages_per_domain =
+      allocator.GetNumOfFreePagesInProximityDomain(0);
+  for (int d = 0; d < 3; d++) {
+    assert(allocator.GetNumOfFreePagesInProximityDomain(d) ==
+           pages_per_domain);
+  }
+  // Local domain first, then domain 2, then domain 1.
+  for (int expected : {0, 2, 1}) {
+    for (uint64_t i = 0; i < pages_per_domain; i++) {
+      void* p = allocator.AllocPages<void*>(1);
+      assert(IsInRange(p, buf[expected], kNumOfPages));
+    }
+  }
+  assert(allocator.GetNumOfFreePages() == 0);
+  assert(!allocator.TryAllocPagesStrictlyInProximityDomain<void*>(1, 0));
+  for (int i = 0; i < 3; i++)
+    free(buf[i]);
+}
+
+static uint32_t current_proximity_domain;
+
+void TestLocalDomainOfRunningProcessor() {
+  puts("TestLocalDomainOfRunningProcessor");
+  constexpr uint64_t kNumOfPages = 64;
+  void* buf[2];
+  PhysicalPageAllocator allocator;
+  for (uint32_t i = 0; i < 2; i++) {
+    buf[i] = AllocAlignedBuffer(kNumOfPages, kPageSize);
+    allocator.FreePagesWithProximityDomain(buf[i], kNumOfPages, i);
+  }
+  allocator.SetLocalProximityDomainGetter(
+      []() { return current_proximity_domain; });
+  for (uint32_t domain : {1, 0, 1}) {
+    current_proximity_domain = domain;
+    void* p = allocator.AllocPages<void*>(1);
+    assert(IsInRange(p, buf[domain], kNumOfPages));
+  }
+  for (int i = 0; i < 2; i++)
+    free(buf[i]);
+}
+
+static double GetFragmentation(PhysicalPageAllocator& allocator) {
+  const uint64_t free_pages = allocator.GetNumOfFreePages();
+  if (!free_pages)
+    return 0;
+  return 1.0 - static_cast<double>(allocator.GetLargestFreeBlockNumOfPages()) /
+                   free_pages;
+}
+
+void BenchmarkRandomAllocAndFree() {
+  puts("BenchmarkRandomAllocAndFree");
+  constexpr uint64_t kNumOfPages = 1 << 16;
+  constexpr int kNumOfLiveAllocs = 1024;
+  constexpr int kNumOfOps = 1000000;
+  void* buf = AllocAlignedBuffer(kNumOfPages, kPageSize);
+  PhysicalPageAllocator allocator;
+  allocator.FreePagesWithProximityDomain(buf, kNumOfPages, 0);
+  const uint64_t initial_free_pages = allocator.GetNumOfFreePages();
+  const uint64_t initial_largest = allocator.GetLargestFreeBlockNumOfPages();
+  printf("  fragmentation at start: %.3f\n", GetFragmentation(allocator));
+
+  std::mt19937_64 rand(1);
+  std::vector<std::pair<void*, uint64_t>> live(kNumOfLiveAllocs,
+                                               {nullptr, 0});
+  auto t0 = std::chrono::steady_clock::now();
+  for (int i = 0; i < kNumOfOps; i++) {
+    auto& slot = live[rand() % kNumOfLiveAllocs];
+    if (slot.first)
+      allocator.FreePages(slot.first, slot.second);
+    slot.second = 1 + (rand() % 16);
+    slot.first = allocator.AllocPages<void*>(slot.second);
+  }
+  auto t1 = std::chrono::steady_clock::now();
+  const double sec = std::chrono::duration<double>(t1 - t0).count();
+  printf("  %d alloc+free pairs in %.3f sec (%.0f allocs/sec)\n", kNumOfOps,
+         sec, kNumOfOps / sec);
+  printf("  fragmentation under load: %.3f (free pages: %lu)\n",
+         GetFragmentation(allocator),
+         static_cast<unsigned long>(allocator.GetNumOfFreePages()));
+
+  for (auto& slot : live) {
+    if (slot.first)
+      allocator.FreePages(slot.first, slot.second);
+  }
+  printf("  fragmentation after free: %.3f\n", GetFragmentation(allocator));
+  assert(allocator.GetNumOfFreePages() == initial_free_pages);
+  assert(allocator.GetLargestFreeBlockNumOfPages() == initial_largest);
+  free(buf);
+}
+
+int main() {
+  TestAllocAndCoalesce();
+  TestProximityDomain();
+  TestFallbackInDistanceOrder();
+  TestLocalDomainOfRunningProcessor();
+  BenchmarkRandomAllocAndFree();
+  puts("PASS");
+  return 0;
+}
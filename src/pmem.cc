@@ -2,20 +2,55 @@
 
 #include "liumos.h"
 
-void PersistentObjectHeader::Init(uint64_t id, uint64_t num_of_pages) {
+void PersistentObjectHeader::Init(uint64_t id,
+                                  uint64_t num_of_pages,
+                                  PersistentObjectHeader* owner,
+                                  const char* name,
+                                  bool is_released) {
   signature_ = ~kSignature;
-  CLFlush(&signature_);
+  Persistence::Flush(&signature_);
   id_ = id;
   num_of_pages_ = num_of_pages;
+  owner_ = owner;
   next_ = nullptr;
+  is_released_ = is_released;
+  int i = 0;
+  for (; name && name[i] && i < kMaxNameSize - 1; i++) {
+    name_[i] = name[i];
+  }
+  name_[i] = 0;
+  // The header may span two cache lines, so the signature is written after
+  // the others are durable.
+  Persistence::Flush(this);
   signature_ = kSignature;
-  CLFlush(this);
+  Persistence::Flush(&signature_);
+}
+
+bool PersistentObjectHeader::HasName(const char* name) {
+  for (int i = 0; i < kMaxNameSize; i++) {
+    if (name_[i] != name[i])
+      return false;
+    if (!name[i])
+      return true;
+  }
+  return false;
+}
+
+void PersistentObjectHeader::Invalidate() {
+  signature_ = ~kSignature;
+  Persistence::Flush(&signature_);
+}
+
+void PersistentObjectHeader::SetReleased(bool is_released) {
+  assert(IsValid());
+  is_released_ = is_released;
+  Persistence::Flush(&is_released_);
 }
 
 void PersistentObjectHeader::SetNext(PersistentObjectHeader* next) {
   assert(IsValid());
   next_ = next;
-  CLFlush(&next_);
+  Persistence::Flush(&next_);
 }
 
 void PersistentObjectHeader::Print() {
@@ -23,6 +58,111 @@ void PersistentObjectHeader::Print() {
   assert(IsValid());
   PutStringAndHex("  base", GetObjectBase<void*>());
   PutStringAndHex("  num_of_pages", num_of_pages_);
+  if (name_[0]) {
+    PutString("  name: ");
+    PutString(name_);
+    PutString("\n");
+  }
+  if (owner_)
+    PutStringAndHex("  owner", owner_->GetID());
+  if (is_released_)
+    PutString("  released\n");
+}
+
+void PersistentObjectDirectory::Init() {
+  for (int i = 0; i < kNumOfSlots; i++) {
+    by_id_[i] = kSlotEmpty;
+    by_name_[i] = kSlotEmpty;
+  }
+  Persistence::Flush(this);
+}
+
+int PersistentObjectDirectory::HashID(uint64_t id) {
+  return (id * 0x9E3779B97F4A7C15ULL) % kNumOfSlots;
+}
+
+int PersistentObjectDirectory::HashName(const char* name) {
+  // FNV-1a
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (int i = 0; name[i]; i++) {
+    hash ^= static_cast<uint8_t>(name[i]);
+    hash *= 0x100000001b3ULL;
+  }
+  return hash % kNumOfSlots;
+}
+
+bool PersistentObjectDirectory::Register(PersistentObjectHeader* h) {
+  assert(h->IsValid());
+  uint64_t* free_slot = nullptr;
+  for (int i = 0, idx = HashID(h->GetID()); i < kNumOfSlots;
+       i++, idx = (idx + 1) % kNumOfSlots) {
+    if (by_id_[idx] == kSlotEmpty || by_id_[idx] == kSlotDeleted) {
+      free_slot = &by_id_[idx];
+      break;
+    }
+  }
+  if (!free_slot)
+    return false;
+  SetSlot(*free_slot, reinterpret_cast<uint64_t>(h));
+  if (!h->GetName()[0])
+    return true;
+  free_slot = nullptr;
+  for (int i = 0, idx = HashName(h->GetName()); i < kNumOfSlots;
+       i++, idx = (idx + 1) % kNumOfSlots) {
+    if (by_name_[idx] == kSlotEmpty || by_name_[idx] == kSlotDeleted) {
+      free_slot = &by_name_[idx];
+      break;
+    }
+  }
+  if (!free_slot)
+    return false;
+  SetSlot(*free_slot, reinterpret_cast<uint64_t>(h));
+  return true;
+}
+
+void PersistentObjectDirectory::Unregister(PersistentObjectHeader* h) {
+  for (int i = 0, idx = HashID(h->GetID());
+       i < kNumOfSlots && by_id_[idx] != kSlotEmpty;
+       i++, idx = (idx + 1) % kNumOfSlots) {
+    if (GetObjectInSlot(by_id_[idx]) == h) {
+      SetSlot(by_id_[idx], kSlotDeleted);
+      break;
+    }
+  }
+  if (!h->GetName()[0])
+    return;
+  for (int i = 0, idx = HashName(h->GetName());
+       i < kNumOfSlots && by_name_[idx] != kSlotEmpty;
+       i++, idx = (idx + 1) % kNumOfSlots) {
+    if (GetObjectInSlot(by_name_[idx]) == h) {
+      SetSlot(by_name_[idx], kSlotDeleted);
+      break;
+    }
+  }
+}
+
+PersistentObjectHeader* PersistentObjectDirectory::FindByID(uint64_t id) {
+  for (int i = 0, idx = HashID(id);
+       i < kNumOfSlots && by_id_[idx] != kSlotEmpty;
+       i++, idx = (idx + 1) % kNumOfSlots) {
+    PersistentObjectHeader* h = GetObjectInSlot(by_id_[idx]);
+    if (h && h->GetID() == id)
+      return h;
+  }
+  return nullptr;
+}
+
+PersistentObjectHeader* PersistentObjectDirectory::FindByName(
+    const char* name) {
+  PersistentObjectHeader* newest = nullptr;
+  for (int i = 0, idx = HashName(name);
+       i < kNumOfSlots && by_name_[idx] != kSlotEmpty;
+       i++, idx = (idx + 1) % kNumOfSlots) {
+    PersistentObjectHeader* h = GetObjectInSlot(by_name_[idx]);
+    if (h && h->HasName(name) && (!newest || newest->GetID() < h->GetID()))
+      newest = h;
+  }
+  return newest;
 }
 
 void PersistentMemoryManager::Init() {
@@ -49,12 +189,18 @@ void PersistentMemoryManager::Init() {
     page_idx_ = reinterpret_cast<uint64_t>(this) >> kPageSizeExponent;
     num_of_pages_ =
         spa_range->system_physical_address_range_length >> kPageSizeExponent;
+    last_object_id_ = 0;
     head_ = nullptr;
+    owner_of_new_objects_ = nullptr;
     last_persistent_process_info_ = nullptr;
+    InitFreeTable(free_tables_[0]);
+    valid_free_table_idx_ = 0;
+    directory_.Init();
+    is_directory_valid_ = true;
     signature_ = kSignature;
-    CLFlush(this, sizeof(*this));
+    Persistence::Flush(this);
 
-    sentinel_.Init(0, 0);
+    sentinel_.Init(0, 0, nullptr, nullptr, false);
     SetHead(&sentinel_);
 
     return;
@@ -62,11 +208,177 @@ void PersistentMemoryManager::Init() {
   assert(false);
 }
 
-PersistentProcessInfo* PersistentMemoryManager::AllocPersistentProcessInfo() {
-  PersistentProcessInfo* info = AllocPages<PersistentProcessInfo*>(
-      ByteSizeToPageSize(sizeof(PersistentProcessInfo)));
+void PersistentMemoryManager::InitFreeTable(FreeExtentTable& table) {
+  const uint64_t begin =
+      reinterpret_cast<uint64_t>(this) +
+      (ByteSizeToPageSize(sizeof(*this)) << kPageSizeExponent);
+  const uint64_t end = (page_idx_ + num_of_pages_) << kPageSizeExponent;
+  table.Init(begin, end - begin);
+}
+
+void PersistentMemoryManager::CommitShadowFreeTable() {
+  const int shadow_idx = 1 - valid_free_table_idx_;
+  Persistence::Flush(&free_tables_[shadow_idx]);
+  valid_free_table_idx_ = shadow_idx;
+  Persistence::Flush(&valid_free_table_idx_);
+}
+
+PersistentObjectHeader* PersistentMemoryManager::AllocObject(
+    uint64_t num_of_pages,
+    PersistentObjectHeader* owner,
+    const char* name,
+    bool is_released) {
+  assert(IsValid());
+  // An object is placed just after the page which holds its header at its
+  // end.
+  FreeExtentTable& table = PrepareShadowFreeTable();
+  const uint64_t addr = table.Alloc((num_of_pages + 1) << kPageSizeExponent);
+  if (!addr)
+    Panic("No more persistent memory");
+  // Pages are removed from the free table before being linked, so a crash
+  // in between only leaks them until the next GC.
+  CommitShadowFreeTable();
+  last_object_id_++;
+  Persistence::Flush(&last_object_id_);
+  PersistentObjectHeader* h = reinterpret_cast<PersistentObjectHeader*>(
+      addr + kPageSize - sizeof(PersistentObjectHeader));
+  h->Init(last_object_id_, num_of_pages, owner, name, is_released);
+  h->SetNext(head_);
+  SetHead(h);
+  // Objects linked but not registered are found again by RebuildDirectory.
+  if (is_directory_valid_ && !directory_.Register(h))
+    PutString("PMEM directory is full. Run GC to rebuild it.\n");
+  return h;
+}
+
+void PersistentMemoryManager::FreeObject(PersistentObjectHeader* h) {
+  assert(IsValid());
+  assert(h->IsValid());
+  assert(h != &sentinel_);
+  if (last_persistent_process_info_ ==
+      h->GetObjectBase<PersistentProcessInfo*>()) {
+    last_persistent_process_info_ = nullptr;
+    Persistence::Flush(&last_persistent_process_info_);
+  }
+  if (is_directory_valid_)
+    directory_.Unregister(h);
+  // Pages are unlinked before being returned to the free table, so a crash
+  // in between only leaks them until the next GC.
+  if (head_ == h) {
+    SetHead(h->GetNext());
+  } else {
+    PersistentObjectHeader* prev = head_;
+    while (prev && prev->GetNext() != h) {
+      prev = prev->GetNext();
+    }
+    if (!prev)
+      Panic("Freeing an object not allocated from this PMEM");
+    prev->SetNext(h->GetNext());
+  }
+  h->Invalidate();
+  FreeExtentTable& table = PrepareShadowFreeTable();
+  if (table.IsFull()) {
+    PutString("Too many free extents in PMEM. Run GC to reclaim pages.\n");
+    return;
+  }
+  table.Free(h->GetObjectBase<uint64_t>() - kPageSize,
+             (h->GetNumOfPages() + 1) << kPageSizeExponent);
+  CommitShadowFreeTable();
+}
+
+void PersistentMemoryManager::FreeObjectsOfReleasedOwners() {
+  assert(IsValid());
+  // An owner may have been freed before a crash.
+  for (PersistentObjectHeader* h = head_; h;) {
+    PersistentObjectHeader* next = h->GetNext();
+    PersistentObjectHeader* owner = h->GetOwner();
+    if (owner && (!owner->IsValid() || owner->IsReleased()))
+      FreeObject(h);
+    h = next;
+  }
+}
+
+void PersistentMemoryManager::FreeReleasedObjects() {
+  assert(IsValid());
+  for (PersistentObjectHeader* h = head_; h;) {
+    PersistentObjectHeader* next = h->GetNext();
+    if (h->IsReleased())
+      FreeObject(h);
+    h = next;
+  }
+}
+
+void PersistentMemoryManager::RebuildFreeTable() {
+  assert(IsValid());
+  // Pages not covered by any live object are free.
+  FreeExtentTable& table = free_tables_[1 - valid_free_table_idx_];
+  InitFreeTable(table);
+  for (PersistentObjectHeader* h = head_; h; h = h->GetNext()) {
+    if (h == &sentinel_)
+      continue;
+    if (!table.Reserve(h->GetObjectBase<uint64_t>() - kPageSize,
+                       (h->GetNumOfPages() + 1) << kPageSizeExponent)) {
+      PutString("PMEM is too fragmented to rebuild free extents.\n");
+      return;
+    }
+  }
+  CommitShadowFreeTable();
+}
+
+void PersistentMemoryManager::RebuildDirectory() {
+  assert(IsValid());
+  is_directory_valid_ = false;
+  Persistence::Flush(&is_directory_valid_);
+  directory_.Init();
+  for (PersistentObjectHeader* h = head_; h; h = h->GetNext()) {
+    if (h == &sentinel_)
+      continue;
+    if (!directory_.Register(h)) {
+      PutString("Too many objects for PMEM directory.\n");
+      return;
+    }
+  }
+  is_directory_valid_ = true;
+  Persistence::Flush(&is_directory_valid_);
+}
+
+PersistentProcessInfo* PersistentMemoryManager::GetPersistentProcessInfoOf(
+    PersistentObjectHeader* h) {
+  if (!h || !h->IsValid() || h->IsReleased())
+    return nullptr;
+  PersistentProcessInfo* info = h->GetObjectBase<PersistentProcessInfo*>();
+  return info->IsValid() && info->HasValidContext() ? info : nullptr;
+}
+
+PersistentObjectHeader* PersistentMemoryManager::FindObjectByName(
+    const char* name) {
+  assert(IsValid());
+  if (!is_directory_valid_)
+    RebuildDirectory();
+  return directory_.FindByName(name);
+}
+
+PersistentProcessInfo* PersistentMemoryManager::FindPersistentProcessInfoByID(
+    uint64_t id) {
+  assert(IsValid());
+  if (!is_directory_valid_)
+    RebuildDirectory();
+  return GetPersistentProcessInfoOf(directory_.FindByID(id));
+}
+
+PersistentProcessInfo*
+PersistentMemoryManager::FindPersistentProcessInfoByName(const char* name) {
+  return GetPersistentProcessInfoOf(FindObjectByName(name));
+}
+
+PersistentProcessInfo* PersistentMemoryManager::AllocPersistentProcessInfo(
+    const char* name) {
+  PersistentProcessInfo* info =
+      AllocObject(ByteSizeToPageSize(sizeof(PersistentProcessInfo)), nullptr,
+                  name, false)
+          ->GetObjectBase<PersistentProcessInfo*>();
   last_persistent_process_info_ = info;
-  CLFlush(&last_persistent_process_info_);
+  Persistence::Flush(&last_persistent_process_info_);
   return last_persistent_process_info_;
 }
 
@@ -78,12 +390,77 @@ void PersistentMemoryManager::Print() {
   }
   PutString("  signature valid.\n");
   PutStringAndHex("  Size in byte", num_of_pages_ << kPageSizeExponent);
+  PutStringAndHex("  Free in byte", GetNumOfFreeBytes());
+  PutStringAndDecimal("  Free extents",
+                      GetValidFreeTable().GetNumOfFreeExtents());
   for (PersistentObjectHeader* h = head_; h; h = h->GetNext()) {
     h->Print();
   }
 }
 
+void PersistentMemoryManager::PrintNamedObjects() {
+  if (!IsValid())
+    return;
+  for (PersistentObjectHeader* h = head_; h; h = h->GetNext()) {
+    if (!h->GetName()[0])
+      continue;
+    PutString(h->GetName());
+    PutStringAndDecimal(" #", h->GetID());
+  }
+}
+
 void PersistentMemoryManager::SetHead(PersistentObjectHeader* head) {
   head_ = head;
-  CLFlush(&head_);
+  Persistence::Flush(&head_);
+}
+
+PersistentMemoryManager& StripedPersistentMemoryAllocator::SelectRegion(
+    uint64_t num_of_pages) {
+  const uint32_t local_proximity_domain = GetLocalProximityDomain();
+  for (int pass = 0; pass < 2; pass++) {
+    const bool use_local = pass == 0;
+    for (int i = 0; i < num_of_regions_; i++) {
+      const int idx = (next_region_idx_ + i) % num_of_regions_;
+      Region& region = regions_[idx];
+      if ((region.proximity_domain == local_proximity_domain) != use_local)
+        continue;
+      if (!region.pmem->CanAlloc(num_of_pages))
+        continue;
+      next_region_idx_ = (idx + 1) % num_of_regions_;
+      return *region.pmem;
+    }
+  }
+  Panic("No more persistent memory");
+}
+
+void StripedPersistentMemoryAllocator::CollectGarbage() {
+  for (int i = 0; i < num_of_regions_; i++) {
+    if (regions_[i].pmem->IsValid())
+      regions_[i].pmem->FreeObjectsOfReleasedOwners();
+  }
+  for (int i = 0; i < num_of_regions_; i++) {
+    if (regions_[i].pmem->IsValid())
+      regions_[i].pmem->FreeReleasedObjects();
+  }
+  for (int i = 0; i < num_of_regions_; i++) {
+    if (!regions_[i].pmem->IsValid())
+      continue;
+    regions_[i].pmem->RebuildFreeTable();
+    regions_[i].pmem->RebuildDirectory();
+  }
+}
+
+void StripedPersistentMemoryAllocator::Print() {
+  PutStringAndDecimal("PMEM regions", num_of_regions_);
+  PutStringAndHex("  local proximity_domain", GetLocalProximityDomain());
+  for (int i = 0; i < num_of_regions_; i++) {
+    Region& region = regions_[i];
+    PutStringAndHex("Region at", region.pmem);
+    PutStringAndHex("  proximity_domain", region.proximity_domain);
+    if (!region.pmem->IsValid()) {
+      PutString("  INVALID\n");
+      continue;
+    }
+    PutStringAndHex("  Free in byte", region.pmem->GetNumOfFreeBytes());
+  }
 }
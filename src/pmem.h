@@ -1,20 +1,40 @@
 #pragma once
+#include "address_range_allocator.h"
 #include "execution_context.h"
 #include "generic.h"
+#include "persistence.h"
 
 class PersistentObjectHeader {
  public:
   bool IsValid() { return signature_ == kSignature; }
-  void Init(uint64_t id, uint64_t num_of_pages_);
+  static constexpr int kMaxNameSize = 32;
+  // name can be nullptr. It is truncated to fit in kMaxNameSize.
+  void Init(uint64_t id,
+            uint64_t num_of_pages_,
+            PersistentObjectHeader* owner,
+            const char* name,
+            bool is_released);
+  void Invalidate();
   PersistentObjectHeader* GetNext() { return next_; };
   void SetNext(PersistentObjectHeader* next);
+  // Objects owned by a released object are reclaimed with it by GC.
+  PersistentObjectHeader* GetOwner() { return owner_; }
+  bool IsReleased() { return is_released_; }
+  void SetReleased(bool is_released);
   void Print();
   template <typename T>
+  static PersistentObjectHeader* FromObjectBase(T obj) {
+    return reinterpret_cast<PersistentObjectHeader*>(
+        reinterpret_cast<uint64_t>(obj) - sizeof(PersistentObjectHeader));
+  }
+  template <typename T>
   T GetObjectBase() {
     return reinterpret_cast<T>(reinterpret_cast<uint64_t>(this) +
                                sizeof(*this));
   }
   uint64_t GetID() { return id_; }
+  const char* GetName() { return name_; }
+  bool HasName(const char* name);
   uint64_t GetNumOfPages() { return num_of_pages_; }
   uint64_t GetByteSize() { return num_of_pages_ << kPageSizeExponent; }
 
@@ -23,7 +43,44 @@ class PersistentObjectHeader {
   uint64_t signature_;
   uint64_t id_;
   uint64_t num_of_pages_;
+  PersistentObjectHeader* owner_;
   PersistentObjectHeader* next_;
+  uint64_t is_released_;
+  char name_[kMaxNameSize];
+};
+
+// Hash tables of objects keyed by ID and by name. A slot is published with
+// a single 8-byte store after the object is durable, so a crash leaves each
+// table either with or without the object. Each object has its own slot in
+// both tables, and the one with the largest ID is found for a name used by
+// multiple objects.
+class PersistentObjectDirectory {
+ public:
+  void Init();
+  // Returns false if there is no room for the object.
+  bool Register(PersistentObjectHeader* h);
+  void Unregister(PersistentObjectHeader* h);
+  PersistentObjectHeader* FindByID(uint64_t id);
+  PersistentObjectHeader* FindByName(const char* name);
+
+ private:
+  // Load factor is kept below 0.5 for thousands of objects.
+  static constexpr int kNumOfSlots = 8192;
+  static constexpr uint64_t kSlotEmpty = 0;
+  static constexpr uint64_t kSlotDeleted = 1;
+  static int HashID(uint64_t id);
+  static int HashName(const char* name);
+  static PersistentObjectHeader* GetObjectInSlot(uint64_t slot) {
+    if (slot == kSlotDeleted)
+      return nullptr;
+    return reinterpret_cast<PersistentObjectHeader*>(slot);
+  }
+  static void SetSlot(uint64_t& slot, uint64_t value) {
+    slot = value;
+    Persistence::Flush(&slot);
+  }
+  uint64_t by_id_[kNumOfSlots];
+  uint64_t by_name_[kNumOfSlots];
 };
 
 class PersistentProcessInfo;
@@ -32,34 +89,185 @@ class PersistentMemoryManager {
   bool IsValid() { return signature_ == kSignature && head_; }
   template <typename T>
   T AllocPages(uint64_t num_of_pages_requested) {
-    assert(IsValid());
-    const uint64_t next_page_idx =
-        (head_->GetObjectBase<uint64_t>() >> kPageSizeExponent) +
-        head_->GetNumOfPages();
-    assert(num_of_pages_requested + 1 + next_page_idx <=
-           page_idx_ + num_of_pages_);
-    PersistentObjectHeader* h = reinterpret_cast<PersistentObjectHeader*>(
-        ((next_page_idx + 1) << kPageSizeExponent) - sizeof(*h));
-    h->Init(head_->GetID() + 1, num_of_pages_requested);
-    h->SetNext(head_);
-    SetHead(h);
-    return head_->GetObjectBase<T>();
-  }
-  PersistentProcessInfo* AllocPersistentProcessInfo();
+    return AllocObject(num_of_pages_requested, owner_of_new_objects_, nullptr,
+                       false)
+        ->GetObjectBase<T>();
+  }
+  // Named objects have no owner. They are allocated as released, so that GC
+  // reclaims them if they are not completed by SetReleased(false) before a
+  // crash.
+  template <typename T>
+  T AllocNamedPages(uint64_t num_of_pages_requested, const char* name) {
+    return AllocObject(num_of_pages_requested, nullptr, name, true)
+        ->GetObjectBase<T>();
+  }
+  PersistentObjectHeader* FindObjectByName(const char* name);
+  // Objects allocated after this call are owned by the object at owner_base
+  // until this is called with nullptr.
+  template <typename T>
+  void SetOwnerOfNewObjects(T owner_base) {
+    owner_of_new_objects_ =
+        owner_base ? PersistentObjectHeader::FromObjectBase(owner_base)
+                   : nullptr;
+    Persistence::Flush(&owner_of_new_objects_);
+  }
+  template <typename T>
+  void Free(T object_base) {
+    FreeObject(PersistentObjectHeader::FromObjectBase(object_base));
+  }
+  PersistentProcessInfo* AllocPersistentProcessInfo(const char* name);
+  // Returns nullptr if there is no valid PersistentProcessInfo for the key.
+  PersistentProcessInfo* FindPersistentProcessInfoByID(uint64_t id);
+  PersistentProcessInfo* FindPersistentProcessInfoByName(const char* name);
   PersistentProcessInfo* GetLastPersistentProcessInfo() {
     return last_persistent_process_info_;
   };
+  bool CanAlloc(uint64_t num_of_pages) {
+    return IsValid() &&
+           GetValidFreeTable().GetLargestFreeExtentByteSize() >=
+               (num_of_pages + 1) << kPageSizeExponent;
+  }
+  uint64_t GetNumOfFreeBytes() {
+    return GetValidFreeTable().GetNumOfFreeBytes();
+  }
+  // Frees released objects and the objects owned by them, then rebuilds the
+  // free extents and the directory from live objects to recover from
+  // crashes.
+  void CollectGarbage() {
+    FreeObjectsOfReleasedOwners();
+    FreeReleasedObjects();
+    RebuildFreeTable();
+    RebuildDirectory();
+  }
+  // Steps of CollectGarbage. Owners may live in other PMEMs, so each step
+  // should be done on all PMEMs before the next one.
+  void FreeObjectsOfReleasedOwners();
+  void FreeReleasedObjects();
+  void RebuildFreeTable();
+  void RebuildDirectory();
 
   void Init();
   void Print();
+  // Prints named objects.
+  void PrintNamedObjects();
 
  private:
+  // Free extents are kept in two tables. Updates are made on the one not in
+  // use and committed by flipping valid_free_table_idx_.
+  static constexpr int kNumOfFreeExtents = 64;
+  using FreeExtentTable = AddressRangeAllocator<kNumOfFreeExtents>;
+  FreeExtentTable& GetValidFreeTable() {
+    return free_tables_[valid_free_table_idx_];
+  }
+  // Returns the other table after copying the valid one into it.
+  FreeExtentTable& PrepareShadowFreeTable() {
+    free_tables_[1 - valid_free_table_idx_] = GetValidFreeTable();
+    return free_tables_[1 - valid_free_table_idx_];
+  }
+  void CommitShadowFreeTable();
+  void InitFreeTable(FreeExtentTable& table);
+  PersistentObjectHeader* AllocObject(uint64_t num_of_pages,
+                                      PersistentObjectHeader* owner,
+                                      const char* name,
+                                      bool is_released);
+  PersistentProcessInfo* GetPersistentProcessInfoOf(PersistentObjectHeader* h);
+  void FreeObject(PersistentObjectHeader* h);
   void SetHead(PersistentObjectHeader* head);
-  static constexpr uint64_t kSignature = 0x4D50534F6D75696CULL;
+  static constexpr uint64_t kSignature = 0x3350534F6D75696CULL;
   uint64_t page_idx_;
   uint64_t num_of_pages_;
+  uint64_t last_object_id_;
   PersistentObjectHeader* head_;
+  PersistentObjectHeader* owner_of_new_objects_;
   PersistentProcessInfo* last_persistent_process_info_;
   PersistentObjectHeader sentinel_;
+  FreeExtentTable free_tables_[2];
+  int valid_free_table_idx_;
+  // Cleared while the directory is rebuilt, which is redone if interrupted.
+  uint64_t is_directory_valid_;
+  PersistentObjectDirectory directory_;
   uint64_t signature_;
 };
+
+// Spreads allocations over all PMEM regions so that flushes of a process go
+// to multiple NVDIMMs. Regions in the proximity domain of the running
+// processor are used in round-robin, and the others are used only when they
+// are full.
+class StripedPersistentMemoryAllocator {
+ public:
+  static constexpr uint32_t kUnknownProximityDomain = 0xffffffff;
+  using ProximityDomainGetter = uint32_t (*)();
+  void Init() {
+    num_of_regions_ = 0;
+    next_region_idx_ = 0;
+    get_local_proximity_domain_ = nullptr;
+  }
+  void AddRegion(PersistentMemoryManager& pmem, uint32_t proximity_domain) {
+    assert(num_of_regions_ < kMaxNumOfRegions);
+    regions_[num_of_regions_].pmem = &pmem;
+    regions_[num_of_regions_].proximity_domain = proximity_domain;
+    num_of_regions_++;
+  }
+  // getter returns the proximity domain of the running processor. Until this
+  // is called, the local domain is kUnknownProximityDomain.
+  void SetLocalProximityDomainGetter(ProximityDomainGetter getter) {
+    get_local_proximity_domain_ = getter;
+  }
+  int GetNumOfRegions() { return num_of_regions_; }
+  template <typename T>
+  T AllocPages(uint64_t num_of_pages) {
+    return SelectRegion(num_of_pages).AllocPages<T>(num_of_pages);
+  }
+  template <typename T>
+  T AllocNamedPages(uint64_t num_of_pages, const char* name) {
+    return SelectRegion(num_of_pages).AllocNamedPages<T>(num_of_pages, name);
+  }
+  // Returns the newest object with the name in the region found first.
+  PersistentObjectHeader* FindObjectByName(const char* name) {
+    for (int i = 0; i < num_of_regions_; i++) {
+      if (!regions_[i].pmem->IsValid())
+        continue;
+      if (PersistentObjectHeader* h = regions_[i].pmem->FindObjectByName(name))
+        return h;
+    }
+    return nullptr;
+  }
+  template <typename T>
+  void SetOwnerOfNewObjects(T owner_base) {
+    for (int i = 0; i < num_of_regions_; i++) {
+      if (regions_[i].pmem->IsValid())
+        regions_[i].pmem->SetOwnerOfNewObjects(owner_base);
+    }
+  }
+  // Kept in the first region so that "pmem restore" can find it.
+  PersistentProcessInfo* AllocPersistentProcessInfo(const char* name) {
+    assert(num_of_regions_);
+    return regions_[0].pmem->AllocPersistentProcessInfo(name);
+  }
+  PersistentProcessInfo* FindPersistentProcessInfoByID(uint64_t id) {
+    assert(num_of_regions_);
+    return regions_[0].pmem->FindPersistentProcessInfoByID(id);
+  }
+  PersistentProcessInfo* FindPersistentProcessInfoByName(const char* name) {
+    assert(num_of_regions_);
+    return regions_[0].pmem->FindPersistentProcessInfoByName(name);
+  }
+  void CollectGarbage();
+  void Print();
+
+ private:
+  static constexpr int kMaxNumOfRegions = 4;
+  uint32_t GetLocalProximityDomain() {
+    return get_local_proximity_domain_ ? get_local_proximity_domain_()
+                                       : kUnknownProximityDomain;
+  }
+  PersistentMemoryManager& SelectRegion(uint64_t num_of_pages);
+
+  struct Region {
+    PersistentMemoryManager* pmem;
+    uint32_t proximity_domain;
+  } regions_[kMaxNumOfRegions];
+  int num_of_regions_;
+  int next_region_idx_;
+  ProximityDomainGetter get_local_proximity_domain_;
+};
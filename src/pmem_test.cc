@@ -0,0 +1,396 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+
+#include <cassert>
+#include <map>
+#include <vector>
+
+#include "acpi.h"
+#include "console.h"
+#include "pmem.h"
+
+// pmem.cc refers liumos only in PersistentMemoryManager::Init.
+struct LiumOS* liumos;
+
+[[noreturn]] void Panic(const char* s) {
+  puts(s);
+  exit(EXIT_FAILURE);
+}
+
+void PutString(const char* s) {
+  fputs(s, stdout);
+}
+
+void PutStringAndHex(const char* s, uint64_t value) {
+  printf("%s: 0x%llX\n", s, static_cast<unsigned long long>(value));
+}
+
+void PutStringAndHex(const char* s, const void* value) {
+  PutStringAndHex(s, reinterpret_cast<uint64_t>(value));
+}
+
+void PutStringAndDecimal(const char* s, uint64_t value) {
+  printf("%s: %llu\n", s, static_cast<unsigned long long>(value));
+}
+
+bool IsEqualGUID(const GUID*, const GUID*) {
+  return false;
+}
+
+const GUID ACPI::NFIT::SPARange::kByteAdressablePersistentMemory = {};
+
+// Emulates persistent memory on the host. Every store to the region is
+// trapped by write-protecting it and single-stepping the store, so that the
+// contents of each cache line are recorded at every store boundary.
+// Persistence::Flush records which lines are written back. Since the CPU may
+// evict a line at any time, a line can be in any state recorded since its
+// last flush when the power is lost. At every store boundary, each
+// combination of them is restored into the region and checked.
+class EmulatedPersistentRegion {
+ public:
+  static constexpr uint64_t kLineSize = Persistence::kCacheLineSize;
+  void Init(uint64_t byte_size) {
+    byte_size_ = byte_size;
+    void* buf = mmap(nullptr, byte_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(buf != MAP_FAILED);
+    buf_ = static_cast<uint8_t*>(buf);
+    durable_ = static_cast<uint8_t*>(malloc(byte_size));
+    cache_ = static_cast<uint8_t*>(malloc(byte_size));
+    final_ = static_cast<uint8_t*>(malloc(byte_size));
+    is_recording_ = false;
+  }
+  uint8_t* GetBuf() { return buf_; }
+  bool Contains(const void* p) {
+    const uint8_t* addr = static_cast<const uint8_t*>(p);
+    return buf_ <= addr && addr < buf_ + byte_size_;
+  }
+  // Contents of the region at this point are treated as durable.
+  void BeginRecording() {
+    memcpy(durable_, buf_, byte_size_);
+    memcpy(cache_, buf_, byte_size_);
+    num_of_events_ = 0;
+    is_recording_ = true;
+    Protect();
+  }
+  void EndRecording() {
+    is_recording_ = false;
+    Unprotect();
+  }
+  void Protect() { mprotect(buf_, byte_size_, PROT_READ); }
+  void Unprotect() { mprotect(buf_, byte_size_, PROT_READ | PROT_WRITE); }
+  // Called after each store to the region.
+  void RecordStore() {
+    for (uint64_t ofs = 0; ofs < byte_size_; ofs += kLineSize) {
+      if (memcmp(&cache_[ofs], &buf_[ofs], kLineSize) == 0)
+        continue;
+      memcpy(&cache_[ofs], &buf_[ofs], kLineSize);
+      AddEvent(EventType::kStore, ofs);
+    }
+    AddEvent(EventType::kStoreBoundary, 0);
+  }
+  void RecordFlush(const void* p, size_t size) {
+    if (!is_recording_)
+      return;
+    const uint64_t begin = reinterpret_cast<uint64_t>(p) & ~(kLineSize - 1);
+    const uint64_t end = reinterpret_cast<uint64_t>(p) + size;
+    for (uint64_t addr = begin; addr < end; addr += kLineSize) {
+      if (Contains(reinterpret_cast<void*>(addr)))
+        AddEvent(EventType::kFlush, addr - reinterpret_cast<uint64_t>(buf_));
+    }
+  }
+  // Returns the number of crash states checked. check returns true if the
+  // state in the region is consistent.
+  template <class TChecker>
+  int CheckAllCrashStates(TChecker check) {
+    assert(!is_recording_);
+    memcpy(final_, buf_, byte_size_);
+    LineStates states;
+    int num_of_states = CheckCrashStatesAt(states, check);
+    for (int i = 0; i < num_of_events_; i++) {
+      Event& e = events_[i];
+      if (e.type == EventType::kStore) {
+        std::vector<Line>& line_states = states[e.offset];
+        if (line_states.empty())
+          line_states.push_back(Line(&durable_[e.offset]));
+        line_states.push_back(Line(e.line));
+      } else if (e.type == EventType::kFlush) {
+        auto it = states.find(e.offset);
+        if (it != states.end())
+          it->second.erase(it->second.begin(), it->second.end() - 1);
+      } else {
+        num_of_states += CheckCrashStatesAt(states, check);
+      }
+    }
+    memcpy(buf_, final_, byte_size_);
+    return num_of_states;
+  }
+
+ private:
+  enum class EventType {
+    kStore,
+    kFlush,
+    kStoreBoundary,
+  };
+  struct Event {
+    EventType type;
+    uint64_t offset;
+    uint8_t line[kLineSize];
+  };
+  struct Line {
+    explicit Line(const uint8_t* src) { memcpy(bytes, src, kLineSize); }
+    uint8_t bytes[kLineSize];
+  };
+  // States of each line since its last flush, keyed by offset.
+  using LineStates = std::map<uint64_t, std::vector<Line>>;
+  static constexpr int kMaxNumOfEvents = 1 << 16;
+  static constexpr uint64_t kMaxNumOfCrashStates = 1 << 20;
+
+  void AddEvent(EventType type, uint64_t offset) {
+    if (num_of_events_ >= kMaxNumOfEvents)
+      Panic("Too many events");
+    Event& e = events_[num_of_events_++];
+    e.type = type;
+    e.offset = offset;
+    if (type == EventType::kStore)
+      memcpy(e.line, &buf_[offset], kLineSize);
+  }
+  template <class TChecker>
+  int CheckCrashStatesAt(LineStates& states, TChecker check) {
+    uint64_t num_of_combinations = 1;
+    for (auto& it : states) {
+      num_of_combinations *= it.second.size();
+      if (num_of_combinations > kMaxNumOfCrashStates)
+        Panic("Too many crash states");
+    }
+    for (uint64_t c = 0; c < num_of_combinations; c++) {
+      memcpy(buf_, durable_, byte_size_);
+      uint64_t rest = c;
+      for (auto& it : states) {
+        memcpy(&buf_[it.first], it.second[rest % it.second.size()].bytes,
+               kLineSize);
+        rest /= it.second.size();
+      }
+      if (!check())
+        Panic("Inconsistent state found after a crash");
+    }
+    return static_cast<int>(num_of_combinations);
+  }
+
+  uint8_t* buf_;
+  uint64_t byte_size_;
+  // Contents of the region at BeginRecording.
+  uint8_t* durable_;
+  // Contents of the region after the last store.
+  uint8_t* cache_;
+  uint8_t* final_;
+  bool is_recording_;
+  int num_of_events_;
+  Event events_[kMaxNumOfEvents];
+};
+
+EmulatedPersistentRegion region;
+
+void Persistence::Flush(const void* buf,
+                        size_t size,
+                        uint64_t& num_of_lines_flushed) {
+  num_of_lines_flushed = (size + kCacheLineSize - 1) / kCacheLineSize;
+  region.RecordFlush(buf, size);
+}
+
+constexpr greg_t kRFlagsTrap = 1 << 8;
+
+void HandleSegmentationFault(int, siginfo_t* info, void* ctx) {
+  if (!region.Contains(info->si_addr)) {
+    // Faults again with the default handler.
+    signal(SIGSEGV, SIG_DFL);
+    return;
+  }
+  // Lets the store run once and traps just after it.
+  region.Unprotect();
+  static_cast<ucontext_t*>(ctx)->uc_mcontext.gregs[REG_EFL] |= kRFlagsTrap;
+}
+
+void HandleTrap(int, siginfo_t*, void* ctx) {
+  static_cast<ucontext_t*>(ctx)->uc_mcontext.gregs[REG_EFL] &= ~kRFlagsTrap;
+  region.RecordStore();
+  region.Protect();
+}
+
+void InstallSignalHandlers() {
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_flags = SA_SIGINFO;
+  sa.sa_sigaction = HandleSegmentationFault;
+  sigaction(SIGSEGV, &sa, nullptr);
+  sa.sa_sigaction = HandleTrap;
+  sigaction(SIGTRAP, &sa, nullptr);
+}
+
+// Runs f with every store to the region recorded, then checks that check
+// holds for every state the region can be in after a crash during f.
+template <class TFunc, class TChecker>
+void RunAndCheckAllCrashStates(TFunc f, TChecker check) {
+  region.BeginRecording();
+  f();
+  region.EndRecording();
+  printf("  %d crash states checked\n", region.CheckAllCrashStates(check));
+}
+
+template <typename T>
+T* PlaceAt(uint64_t offset) {
+  return reinterpret_cast<T*>(region.GetBuf() + offset);
+}
+
+// Headers are placed at the end of a page as PersistentMemoryManager does.
+PersistentObjectHeader* PlaceHeader(uint64_t page_idx) {
+  return PlaceAt<PersistentObjectHeader>(((page_idx + 1) << kPageSizeExponent) -
+                                         sizeof(PersistentObjectHeader));
+}
+
+bool IsHeaderEqual(PersistentObjectHeader* h,
+                   uint64_t id,
+                   uint64_t num_of_pages,
+                   PersistentObjectHeader* owner,
+                   const char* name) {
+  return h->IsValid() && h->GetID() == id &&
+         h->GetNumOfPages() == num_of_pages && h->GetOwner() == owner &&
+         !h->GetNext() && !h->IsReleased() && h->HasName(name);
+}
+
+void TestObjectHeaderInit() {
+  puts("TestObjectHeaderInit");
+  PersistentObjectHeader* owner = PlaceHeader(1);
+  PersistentObjectHeader* h = PlaceHeader(0);
+  h->Init(1, 1, nullptr, "old", false);
+  // The header is either invalid or entirely old or new.
+  RunAndCheckAllCrashStates(
+      [&] { h->Init(2, 3, owner, "hello.bin", false); },
+      [&] {
+        return !h->IsValid() || IsHeaderEqual(h, 1, 1, nullptr, "old") ||
+               IsHeaderEqual(h, 2, 3, owner, "hello.bin");
+      });
+  assert(IsHeaderEqual(h, 2, 3, owner, "hello.bin"));
+}
+
+void TestDirectory() {
+  puts("TestDirectory");
+  PersistentObjectHeader* h1 = PlaceHeader(0);
+  PersistentObjectHeader* h2 = PlaceHeader(1);
+  h1->Init(5, 1, nullptr, "pi.bin", false);
+  h2->Init(6, 1, nullptr, "pi.bin", false);
+  PersistentObjectDirectory& dir =
+      *PlaceAt<PersistentObjectDirectory>(2 << kPageSizeExponent);
+  dir.Init();
+  // Lookups find either nothing or the right object at any point.
+  auto check = [&] {
+    PersistentObjectHeader* by_name = dir.FindByName("pi.bin");
+    PersistentObjectHeader* by_id1 = dir.FindByID(5);
+    PersistentObjectHeader* by_id2 = dir.FindByID(6);
+    return (!by_name || by_name == h1 || by_name == h2) &&
+           (!by_id1 || by_id1 == h1) && (!by_id2 || by_id2 == h2);
+  };
+  RunAndCheckAllCrashStates(
+      [&] {
+        assert(dir.Register(h1));
+        assert(dir.Register(h2));
+      },
+      check);
+  assert(dir.FindByID(5) == h1);
+  assert(dir.FindByName("pi.bin") == h2);
+  // Older objects are found again after newer ones are removed.
+  RunAndCheckAllCrashStates([&] { dir.Unregister(h2); }, check);
+  assert(dir.FindByName("pi.bin") == h1);
+  RunAndCheckAllCrashStates([&] { dir.Unregister(h1); }, check);
+  assert(!dir.FindByID(5) && !dir.FindByID(6) && !dir.FindByName("pi.bin"));
+}
+
+// Registers of a context are represented by RIP and RSP. A context is
+// consistent if both came from the same store of SetCPUContextExceptCR3.
+CPUContext MakeCPUContext(uint64_t value) {
+  CPUContext cpu_ctx;
+  memset(&cpu_ctx, 0, sizeof(cpu_ctx));
+  cpu_ctx.int_ctx.rip = value;
+  cpu_ctx.int_ctx.rsp = value;
+  return cpu_ctx;
+}
+
+bool IsSegmentMappingEqual(SegmentMapping& seg, uint64_t vaddr) {
+  return seg.GetVirtAddr() == vaddr && seg.GetPhysAddr() == vaddr * 2 &&
+         seg.GetMapSize() == 0x1000;
+}
+
+// Same order as LoadELFAndCreatePersistentProcess.
+void TestPersistentProcessInfoCreation() {
+  puts("TestPersistentProcessInfoCreation");
+  PersistentProcessInfo& info = *PlaceAt<PersistentProcessInfo>(0);
+  memset(&info, 0, sizeof(info));
+  RunAndCheckAllCrashStates(
+      [&] {
+        info.Init();
+        ExecutionContext& ctx = info.GetContext(0);
+        ProcessMappingInfo& map_info = ctx.GetProcessMappingInfo();
+        map_info.code.Set(0x1000, 0x2000, 0x1000);
+        map_info.data.Set(0x3000, 0x6000, 0x1000);
+        map_info.stack.Set(0x5000, 0xA000, 0x1000);
+        ctx.SetCPUContextExceptCR3(MakeCPUContext(0x1234));
+        Persistence::Flush(&ctx);
+        info.SetValidContextIndex(0);
+      },
+      [&] {
+        // Restoring is refused until the context is complete.
+        if (!info.IsValid() || !info.HasValidContext())
+          return true;
+        ExecutionContext& ctx = info.GetValidContext();
+        ProcessMappingInfo& map_info = ctx.GetProcessMappingInfo();
+        return IsSegmentMappingEqual(map_info.code, 0x1000) &&
+               IsSegmentMappingEqual(map_info.data, 0x3000) &&
+               IsSegmentMappingEqual(map_info.stack, 0x5000) &&
+               ctx.GetCPUContext().int_ctx.rip == 0x1234;
+      });
+  assert(info.HasValidContext());
+}
+
+// Same order as PersistentProcessInfo::SwitchContext.
+void TestPersistentProcessInfoCommit() {
+  puts("TestPersistentProcessInfoCommit");
+  PersistentProcessInfo& info = *PlaceAt<PersistentProcessInfo>(0);
+  memset(&info, 0, sizeof(info));
+  info.Init();
+  info.GetContext(0).SetCPUContextExceptCR3(MakeCPUContext(1));
+  info.GetContext(1).SetCPUContextExceptCR3(MakeCPUContext(1));
+  info.SetValidContextIndex(0);
+  for (uint64_t value = 2; value < 5; value++) {
+    RunAndCheckAllCrashStates(
+        [&] {
+          ExecutionContext& working = info.GetWorkingContext();
+          working.SetCPUContextExceptCR3(MakeCPUContext(value));
+          Persistence::Flush(&working);
+          info.CommitWorkingContext();
+          info.GetWorkingContext().SetCPUContextExceptCR3(
+              info.GetValidContext().GetCPUContext());
+        },
+        [&] {
+          // The valid context is the last snapshot or the new one.
+          InterruptContext& int_ctx =
+              info.GetValidContext().GetCPUContext().int_ctx;
+          return int_ctx.rip == int_ctx.rsp &&
+                 (int_ctx.rip == value - 1 || int_ctx.rip == value);
+        });
+  }
+}
+
+int main() {
+  region.Init(64 * 4096);
+  InstallSignalHandlers();
+  TestObjectHeaderInit();
+  TestDirectory();
+  TestPersistentProcessInfoCreation();
+  TestPersistentProcessInfoCommit();
+  puts("PASS");
+  return 0;
+}
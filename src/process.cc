@@ -1,24 +1,87 @@
+#include "copy_on_write.h"
 #include "liumos.h"
+#include "pmem.h"
 
-void Process::WaitUntilExit() {
-  while (status_ != Status::kKilled) {
-    Sleep();
+void CheckpointPolicy::Print() {
+  switch (trigger) {
+    case Trigger::kSwitches:
+      PutString("every ");
+      PutDecimal64(period);
+      PutString(" context switches\n");
+      return;
+    case Trigger::kInterval:
+      PutString("every ");
+      PutDecimal64(period);
+      PutString(" ms\n");
+      return;
+    case Trigger::kSyscall:
+      PutString("on syscall\n");
+      return;
   }
 }
 
-void Process::NotifyContextSaving() {
+void Process::NotifyContextSaving(uint64_t now_ms) {
   number_of_ctx_switch_++;
   if (!IsPersistent())
     return;
+  if (number_of_ctx_switch_ == 1) {
+    first_ctx_sw_time_ms_ = now_ms;
+    last_checkpoint_time_ms_ = now_ms;
+  }
+  last_ctx_sw_time_ms_ = now_ms;
+  num_of_ctx_sw_since_checkpoint_++;
+  if (checkpoint_ctx_)
+    return;  // The previous snapshot has not been made durable yet.
+  if (!ShouldCheckpoint(now_ms))
+    return;
+  num_of_checkpoints_++;
+  num_of_ctx_sw_since_checkpoint_ = 0;
+  last_checkpoint_time_ms_ = now_ms;
+  is_checkpoint_requested_ = false;
+  full_copy_bytes_in_ctx_sw_ +=
+      pp_info_->GetWorkingContext().GetCopyContextByteSize();
+  if (liumos->is_async_checkpoint_enabled && BeginCheckpoint())
+    return;
   pp_info_->SwitchContext(copied_bytes_in_ctx_sw_,
-                          num_of_clflush_issued_in_ctx_sw_);
+                          num_of_clflush_issued_in_ctx_sw_,
+                          liumos->is_incremental_checkpoint_enabled);
+}
+
+bool Process::ShouldCheckpoint(uint64_t now_ms) {
+  using Trigger = CheckpointPolicy::Trigger;
+  if (is_checkpoint_requested_)
+    return true;
+  switch (checkpoint_policy_.trigger) {
+    case Trigger::kSwitches:
+      return num_of_ctx_sw_since_checkpoint_ >= checkpoint_policy_.period;
+    case Trigger::kInterval:
+      return now_ms - last_checkpoint_time_ms_ >= checkpoint_policy_.period;
+    case Trigger::kSyscall:
+      return false;
+  }
+  return true;
+}
+
+bool Process::BeginCheckpoint() {
+  if (!liumos->checkpointer->Enqueue(*this))
+    return false;
+  assert(!num_of_snapshot_page_copies_);
+  ExecutionContext& ctx = pp_info_->GetWorkingContext();
+  ctx.SetCopiedSegmentsWritable(false);
+  cpu_context_in_checkpoint_ = ctx.GetCPUContext();
+  is_checkpoint_incremental_ = liumos->is_incremental_checkpoint_enabled;
+  checkpoint_ctx_ = &ctx;
+  // TLB entries tagged with pcid_ may still allow writes to the snapshot.
+  pml4_tagged_with_pcid_ = 0;
+  return true;
 }
 
 void Process::PrintStatistics() {
   PutStringAndDecimal("Process id", id_);
   PutString(
-      "num of ctx sw, proc time[s], sys time [s], time for ctx save [s], copy "
-      "in ctx save [MB], clflush in ctx sw [M]\n");
+      "num of ctx sw, proc time[s], sys time [s], time for ctx save [s], "
+      "time for bg checkpoint [s], copy in ctx save [MB], full copy in ctx "
+      "save [MB], clflush in ctx sw [M]\n");
   PutDecimal64(number_of_ctx_switch_);
   PutString(", ");
   PutDecimal64WithPointPos(proc_time_femto_sec_, 15);
@@ -27,26 +90,332 @@ void Process::PrintStatistics() {
   PutString(", ");
   PutDecimal64WithPointPos(time_consumed_in_ctx_save_femto_sec_, 15);
   PutString(", ");
+  PutDecimal64WithPointPos(time_consumed_in_bg_checkpoint_femto_sec_, 15);
+  PutString(", ");
   PutDecimal64WithPointPos(copied_bytes_in_ctx_sw_, 6);
   PutString(", ");
+  PutDecimal64WithPointPos(full_copy_bytes_in_ctx_sw_, 6);
+  PutString(", ");
   PutDecimal64WithPointPos(num_of_clflush_issued_in_ctx_sw_, 6);
   PutString("\n");
+  if (!IsPersistent()) {
+    PutStringAndDecimal("demand paged pages", num_of_demand_paged_pages_);
+    PutStringAndDecimal("copy-on-write pages", num_of_copy_on_write_pages_);
+    return;
+  }
+  PutString("checkpoint policy: ");
+  checkpoint_policy_.Print();
+  PutString(
+      "checkpoints, checkpoint freq [Hz], pages written during checkpoints\n");
+  PutDecimal64(num_of_checkpoints_);
+  PutString(", ");
+  const uint64_t elapsed_ms = last_ctx_sw_time_ms_ - first_ctx_sw_time_ms_;
+  PutDecimal64WithPointPos(
+      elapsed_ms ? num_of_checkpoints_ * 1000'000 / elapsed_ms : 0, 3);
+  PutString(", ");
+  PutDecimal64(num_of_snapshot_pages_copied_);
+  PutString("\n");
+}
+
+// Page tables, pages and files are accessed with their physical addresses,
+// which are not mapped in page tables of user processes.
+static uint64_t SwitchToKernelPageTables() {
+  const uint64_t cr3 = ReadCR3();
+  WriteCR3(reinterpret_cast<uint64_t>(&GetKernelPML4()));
+  return cr3;
+}
+
+// Entries for the faulting address have been removed from TLB by the page
+// fault, so other TLB entries tagged with the PCID can be kept.
+static void RestorePageTablesAfterPageFault(uint64_t cr3) {
+  if (cr3 & kCR3PCIDMask)
+    cr3 |= kCR3BitNoFlush;
+  WriteCR3(cr3);
+}
+
+bool Process::IsInAnonymousMapping(uint64_t vaddr) {
+  if (vaddr < kAnonymousAreaBase ||
+      vaddr >= kAnonymousAreaBase + kAnonymousAreaByteSize)
+    return false;
+  return anonymous_area_.IsAllocated(FloorToPageAlignment(vaddr), kPageSize);
+}
+
+bool Process::HandleDemandPageFault(uint64_t vaddr) {
+  if (IsPersistent())
+    return false;
+  const uint64_t page_vaddr = FloorToPageAlignment(vaddr);
+  // Pages of the heap and anonymous mappings are zero-filled.
+  DemandPagedSegment anonymous_page = {page_vaddr, kPageSize, nullptr, 0};
+  const uint64_t heap_begin =
+      ctx_->GetProcessMappingInfo().heap.GetVirtAddr();
+  const uint64_t heap_end = CeilToPageAlignment(ctx_->GetHeapEndVirtAddr());
+  DemandPagedSegment* seg = nullptr;
+  if (demand_paged_data_.Contains(vaddr))
+    seg = &demand_paged_data_;
+  else if (demand_paged_stack_.Contains(vaddr))
+    seg = &demand_paged_stack_;
+  else if ((heap_begin <= vaddr && vaddr < heap_end) ||
+           IsInAnonymousMapping(vaddr))
+    seg = &anonymous_page;
+  if (!seg)
+    return false;
+  const uint64_t offset = page_vaddr - seg->vaddr;
+  const uint64_t cr3 = SwitchToKernelPageTables();
+  uint8_t* page = liumos->dram_allocator->AllocPages<uint8_t*>(1);
+  uint64_t copy_size = 0;
+  if (offset < seg->file_size) {
+    copy_size = seg->file_size - offset;
+    if (copy_size > kPageSize)
+      copy_size = kPageSize;
+    memcpy(page, seg->file_data + offset, copy_size);
+  }
+  bzero(page + copy_size, kPageSize - copy_size);
+  CreatePageMapping(*liumos->dram_allocator, ctx_->GetCR3(), page_vaddr,
+                    reinterpret_cast<uint64_t>(page), kPageSize,
+                    kPageAttrPresent | kPageAttrUser | kPageAttrWritable);
+  RestorePageTablesAfterPageFault(cr3);
+  num_of_demand_paged_pages_++;
+  return true;
+}
+
+// Pages shared by fork are freed by the last process mapping them.
+static void UnmapUserPages(IA_PML4& pml4,
+                           uint64_t vaddr,
+                           uint64_t byte_size) {
+  SharedFrameAwareAllocator<PhysicalPageAllocator> allocator(
+      *liumos->dram_allocator, *liumos->page_frame_table);
+  DestroyPageMapping(allocator, pml4, vaddr, byte_size, true);
+}
+
+uint64_t Process::SetProgramBreak(uint64_t brk) {
+  assert(!IsPersistent());
+  const uint64_t old_end = CeilToPageAlignment(ctx_->GetHeapEndVirtAddr());
+  if (!ctx_->SetHeapEndVirtAddr(brk))
+    return ctx_->GetHeapEndVirtAddr();
+  const uint64_t new_end = CeilToPageAlignment(brk);
+  if (new_end < old_end)
+    UnmapUserPages(ctx_->GetCR3(), new_end, old_end - new_end);
+  return brk;
+}
+
+uint64_t Process::MapAnonymousPages(uint64_t byte_size) {
+  assert(!IsPersistent());
+  return anonymous_area_.Alloc(CeilToPageAlignment(byte_size));
+}
+
+bool Process::UnmapAnonymousPages(uint64_t vaddr, uint64_t byte_size) {
+  assert(!IsPersistent());
+  byte_size = CeilToPageAlignment(byte_size);
+  if (!byte_size || !IsAlignedToPageSize(vaddr) ||
+      !IsInAnonymousMapping(vaddr) ||
+      !IsInAnonymousMapping(vaddr + byte_size - 1) ||
+      !anonymous_area_.IsAllocated(vaddr, byte_size))
+    return false;
+  // Freeing a range in the middle of a mapping needs one more extent.
+  if (anonymous_area_.IsFull())
+    return false;
+  anonymous_area_.Free(vaddr, byte_size);
+  UnmapUserPages(ctx_->GetCR3(), vaddr, byte_size);
+  return true;
+}
+
+bool Process::HandleCopyOnWriteFault(uint64_t vaddr) {
+  const uint64_t cr3 = SwitchToKernelPageTables();
+  const bool resolved =
+      ResolveCopyOnWrite(*liumos->dram_allocator, *liumos->page_frame_table,
+                         GetExecutionContext().GetCR3(), vaddr);
+  RestorePageTablesAfterPageFault(cr3);
+  if (resolved)
+    num_of_copy_on_write_pages_++;
+  return resolved;
+}
+
+// The checkpointer task may be preempted while it flushes or copies the
+// snapshot, so the original page is flushed here in case it has not been yet.
+// The copy inherits the dirty bit, and is written back by
+// WriteBackSnapshotPageCopies after the snapshot is committed.
+bool Process::HandleSnapshotWriteFault(uint64_t vaddr) {
+  assert(checkpoint_ctx_);
+  if (num_of_snapshot_page_copies_ >= kMaxNumOfSnapshotPageCopies)
+    return false;
+  const uint64_t page_vaddr = FloorToPageAlignment(vaddr);
+  ProcessMappingInfo& map_info = checkpoint_ctx_->GetProcessMappingInfo();
+  if (!map_info.data.Contains(page_vaddr) &&
+      !map_info.stack.Contains(page_vaddr))
+    return false;
+  const uint64_t cr3 = SwitchToKernelPageTables();
+  IA_PTE& pte = GetPTEForAddr(checkpoint_ctx_->GetCR3(), page_vaddr);
+  void* snapshot_page = reinterpret_cast<void*>(pte.GetPageBaseAddr());
+  if (pte.IsDirty()) {
+    Persistence::Flush(snapshot_page, kPageSize,
+                       num_of_clflush_issued_in_ctx_sw_);
+  }
+  uint8_t* copy = liumos->dram_allocator->AllocPages<uint8_t*>(1);
+  memcpy(copy, snapshot_page, kPageSize);
+  pte.SetPageBaseAddr(reinterpret_cast<uint64_t>(copy),
+                      pte.data & kPageAttrMask);
+  pte.SetWritable(true);
+  snapshot_page_copies_[num_of_snapshot_page_copies_++] = {
+      page_vaddr, reinterpret_cast<uint64_t>(copy)};
+  RestorePageTablesAfterPageFault(cr3);
+  num_of_snapshot_pages_copied_++;
+  return true;
+}
+
+// The copies have the latest contents of the pages, so they overwrite the
+// pages of the new working context, which are marked dirty to be copied to
+// the other context on the next incremental checkpoint. The snapshot is
+// mapped to its own pages again.
+void Process::WriteBackSnapshotPageCopies() {
+  assert(checkpoint_ctx_);
+  IA_PML4& working_pml4 = pp_info_->GetWorkingContext().GetCR3();
+  ProcessMappingInfo& map_info = checkpoint_ctx_->GetProcessMappingInfo();
+  for (int i = 0; i < num_of_snapshot_page_copies_; i++) {
+    SnapshotPageCopy& c = snapshot_page_copies_[i];
+    SegmentMapping& seg =
+        map_info.data.Contains(c.vaddr) ? map_info.data : map_info.stack;
+    IA_PTE& working_pte = GetPTEForAddr(working_pml4, c.vaddr);
+    Persistence::CopyAndFlush(
+        reinterpret_cast<void*>(
+            GetKernelVirtAddrForPhysAddr(working_pte.GetPageBaseAddr())),
+        reinterpret_cast<void*>(GetKernelVirtAddrForPhysAddr(c.copy_paddr)),
+        kPageSize, num_of_clflush_issued_in_ctx_sw_);
+    working_pte.SetDirtyBit();
+    copied_bytes_in_ctx_sw_ += kPageSize;
+    IA_PTE& pte = GetPTEForAddr(checkpoint_ctx_->GetCR3(), c.vaddr);
+    pte.SetPageBaseAddr(seg.GetPhysAddr() + (c.vaddr - seg.GetVirtAddr()),
+                        pte.data & kPageAttrMask);
+    pte.ClearDirtyBit();
+    liumos->dram_allocator->FreePages(reinterpret_cast<void*>(c.copy_paddr),
+                                      1);
+  }
+  num_of_snapshot_page_copies_ = 0;
 }
 
 Process& ProcessController::Create() {
-  Process* proc = kernel_heap_allocator_.AllocPages<Process*>(
-      ByteSizeToPageSize(sizeof(Process)),
-      kPageAttrPresent | kPageAttrWritable);
+  Process* proc = process_cache_.Alloc();
+  lock_.Lock();
   new (proc) Process(++last_id_);
+  proc->pcid_ = AllocPCID();
+  lock_.Unlock();
+  proc->checkpoint_policy_ = liumos->checkpoint_policy;
   return *proc;
 }
 
+uint16_t ProcessController::AllocPCID() {
+  if (!liumos->is_pcid_enabled)
+    return 0;
+  for (int pcid = 1; pcid < kNumOfPCIDs; pcid++) {
+    uint64_t& bits = pcid_bitmap_[pcid / 64];
+    const uint64_t mask = 1ULL << (pcid % 64);
+    if (bits & mask)
+      continue;
+    bits |= mask;
+    return pcid;
+  }
+  return 0;
+}
+
+void ProcessController::FreePCID(uint16_t pcid) {
+  if (!pcid)
+    return;
+  SpinLockGuard guard(lock_);
+  pcid_bitmap_[pcid / 64] &= ~(1ULL << (pcid % 64));
+}
+
+uint64_t Process::GetCR3ToSwitch() {
+  const uint64_t pml4 =
+      reinterpret_cast<uint64_t>(&GetExecutionContext().GetCR3());
+  if (!pcid_)
+    return pml4;
+  // TLB entries tagged with pcid_ can be reused only if they were made with
+  // the same page tables and no kernel heap pages were unmapped since then.
+  const uint64_t num_of_unmaps =
+      liumos->kernel_heap_allocator->GetNumOfUnmaps();
+  if (pml4_tagged_with_pcid_ == pml4 &&
+      num_of_kernel_heap_unmaps_at_load_ == num_of_unmaps)
+    return pml4 | pcid_ | kCR3BitNoFlush;
+  pml4_tagged_with_pcid_ = pml4;
+  num_of_kernel_heap_unmaps_at_load_ = num_of_unmaps;
+  return pml4 | pcid_;
+}
+
+static void FreeKernelStack(ExecutionContext& ctx) {
+  if (!ctx.GetKernelRSP())
+    return;
+  const uint64_t stack_size =
+      kKernelStackPagesForEachProcess << kPageSizeExponent;
+  const uint64_t stack_base = ctx.GetKernelRSP() - stack_size;
+  liumos->kernel_heap_allocator->FreePages(reinterpret_cast<void*>(stack_base),
+                                           kKernelStackPagesForEachProcess);
+  ctx.SetKernelRSP(0);
+}
+
+void ProcessController::Destroy(Process& proc) {
+  assert(proc.GetStatus() == Process::Status::kKilled);
+  // The checkpointer task may still be working on the last snapshot.
+  while (proc.IsCheckpointInProgress()) {
+    Sleep();
+  }
+  // Page tables of the process are accessed with their physical addresses.
+  assert((ReadCR3() & ~kCR3PCIDMask) ==
+         reinterpret_cast<uint64_t>(&GetKernelPML4()));
+  if (proc.IsPersistent()) {
+    // Pages and page tables of a persistent process live in PMEM.
+    FreeKernelStack(proc.pp_info_->GetContext(0));
+    FreeKernelStack(proc.pp_info_->GetContext(1));
+    // PMEM pages of the process are reclaimed by "pmem gc".
+    PersistentObjectHeader::FromObjectBase(proc.pp_info_)->SetReleased(true);
+  } else {
+    ExecutionContext& ctx = *proc.ctx_;
+    IA_PML4& pml4 = ctx.GetCR3();
+    if (&pml4 != &GetKernelPML4()) {
+      // Pages shared by fork are freed by the last process mapping them.
+      SharedFrameAwareAllocator<PhysicalPageAllocator> allocator(
+          *liumos->dram_allocator, *liumos->page_frame_table);
+      DestroyUserPageTables(allocator, pml4);
+      liumos->dram_allocator->FreePages(&pml4, 1);
+    }
+    FreeKernelStack(ctx);
+    FreeExecutionContext(ctx);
+  }
+  FreePCID(proc.pcid_);
+  process_cache_.Free(&proc);
+}
+
+static uint64_t AllocKernelStack() {
+  return liumos->kernel_heap_allocator->AllocPages<uint64_t>(
+             kKernelStackPagesForEachProcess,
+             kPageAttrPresent | kPageAttrWritable) +
+         (kKernelStackPagesForEachProcess << kPageSizeExponent);
+}
+
 static void PrepareContextForRestoringPersistentProcess(ExecutionContext& ctx) {
   SetKernelPageEntries(ctx.GetCR3());
-  ctx.SetKernelRSP(liumos->kernel_heap_allocator->AllocPages<uint64_t>(
-                       kKernelStackPagesForEachProcess,
-                       kPageAttrPresent | kPageAttrWritable) +
-                   (kKernelStackPagesForEachProcess << kPageSizeExponent));
+  ctx.SetKernelRSP(AllocKernelStack());
+}
+
+Process& ProcessController::Fork(Process& parent,
+                                 const CPUContext& cpu_context) {
+  assert(!parent.IsPersistent());
+  ExecutionContext& parent_ctx = *parent.ctx_;
+  ExecutionContext& ctx = AllocExecutionContext();
+  ctx = parent_ctx;
+  IA_PML4& pml4 = AllocPageTable(*liumos->dram_allocator);
+  SetKernelPageEntries(pml4);
+  CloneUserPageTables(*liumos->dram_allocator, *liumos->page_frame_table,
+                      parent_ctx.GetCR3(), pml4);
+  ctx.SetCR3(pml4);
+  ctx.SetCPUContextExceptCR3(cpu_context);
+  ctx.SetKernelRSP(AllocKernelStack());
+  Process& proc = Create();
+  proc.InitAsEphemeralProcess(ctx);
+  proc.priority_ = parent.priority_;
+  // Pages not touched by the parent yet are still the same as the file.
+  proc.demand_paged_data_ = parent.demand_paged_data_;
+  proc.demand_paged_stack_ = parent.demand_paged_stack_;
+  proc.anonymous_area_ = parent.anonymous_area_;
+  return proc;
 }
 
 Process& ProcessController::RestoreFromPersistentProcessInfo(
@@ -59,6 +428,12 @@ Process& ProcessController::RestoreFromPersistentProcessInfo(
 
   uint64_t dummy_stat;
   working_ctx.CopyContextFrom(valid_ctx, dummy_stat);
+  // Pages may be left write-protected or mapped to copies in DRAM by an
+  // interrupted async checkpoint.
+  valid_ctx.RemapCopiedSegments();
+  working_ctx.RemapCopiedSegments();
+  valid_ctx.SetCopiedSegmentsWritable(true);
+  working_ctx.SetCopiedSegmentsWritable(true);
 
   PrepareContextForRestoringPersistentProcess(valid_ctx);
   PrepareContextForRestoringPersistentProcess(working_ctx);
@@ -1,8 +1,37 @@
 #pragma once
 
+#include "address_range_allocator.h"
 #include "execution_context.h"
 #include "generic.h"
 #include "kernel_virtual_heap_allocator.h"
+#include "run_queue.h"
+#include "slab_allocator.h"
+#include "spin_lock.h"
+
+// When a persistent process takes checkpoints on context switches.
+struct CheckpointPolicy {
+  enum class Trigger {
+    kSwitches,  // Every `period` context switches.
+    kInterval,  // On the first context switch after `period` ms.
+    kSyscall,   // Only when the process requests it by a syscall.
+  };
+  Trigger trigger;
+  uint64_t period;
+  void Print();
+};
+
+// A segment of an ephemeral process whose pages are allocated on the first
+// access. The first file_size bytes are read from file_data and the rest is
+// zero-filled.
+struct DemandPagedSegment {
+  uint64_t vaddr;
+  uint64_t map_size;
+  const uint8_t* file_data;
+  uint64_t file_size;
+  bool Contains(uint64_t addr) const {
+    return vaddr <= addr && addr < vaddr + map_size;
+  }
+};
 
 class Process {
  public:
@@ -11,6 +40,7 @@ class Process {
     kNotScheduled,
     kSleeping,
     kRunning,
+    kWaiting,
     kKilled,
   };
   bool IsPersistent() {
@@ -22,13 +52,24 @@ class Process {
     return true;
   }
   uint64_t GetID() { return id_; }
-  int GetSchedulerIndex() const { return scheduler_index_; }
-  void SetSchedulerIndex(int scheduler_index) {
-    scheduler_index_ = scheduler_index;
-  };
+  // Lower values are scheduled first. Changed by Scheduler::SetPriority.
+  static constexpr int kNumOfPriorities = 8;
+  static constexpr int kDefaultPriority = kNumOfPriorities / 2;
+  // Processors run processes at this priority only if nothing else is ready.
+  static constexpr int kIdlePriority = kNumOfPriorities - 1;
+  int GetPriority() const { return priority_; }
+  // Index of the processor which runs this process. Set by Scheduler.
+  int GetCPUIndex() const { return cpu_index_; }
+  RunQueueLink<Process>& GetRunQueueLink() { return run_queue_link_; }
   Status GetStatus() const { return status_; };
+  // True from when a processor picks the process to run until SwitchContext
+  // has saved its registers and stopped using its stack and page tables.
+  bool IsOnCPU() const { return is_on_cpu_; }
+  // Called by SwitchContext as its last access to the process.
+  void SetSwitchedOut() {
+    __atomic_store_n(&is_on_cpu_, false, __ATOMIC_RELEASE);
+  }
   void SetStatus(Status status) { status_ = status; }
-  void WaitUntilExit();
   void InitAsEphemeralProcess(ExecutionContext& ctx) {
     assert(status_ == Status::kNotInitialized);
     assert(!ctx_);
@@ -43,10 +84,57 @@ class Process {
     pp_info_ = &pp_info;
     status_ = Status::kNotScheduled;
   }
+  void SetDemandPagedSegments(const DemandPagedSegment& data,
+                              const DemandPagedSegment& stack) {
+    assert(!IsPersistent());
+    demand_paged_data_ = data;
+    demand_paged_stack_ = stack;
+  }
+  // Maps a page for vaddr if it is in a demand paged segment of this process.
+  // Returns false otherwise.
+  bool HandleDemandPageFault(uint64_t vaddr);
+  // Moves the program break of an ephemeral process within its heap segment.
+  // Returns the new break, or the current one if brk is out of the segment.
+  // Pages freed by shrinking are unmapped, so this should be called with the
+  // kernel page tables.
+  uint64_t SetProgramBreak(uint64_t brk);
+  // Reserves byte_size bytes of the address space of an ephemeral process.
+  // Returns 0 if there is no room.
+  uint64_t MapAnonymousPages(uint64_t byte_size);
+  // Releases pages reserved by MapAnonymousPages. Returns false if any of
+  // them is not reserved. Should be called with the kernel page tables.
+  bool UnmapAnonymousPages(uint64_t vaddr, uint64_t byte_size);
+  // Gives the process its own copy of a page shared by fork on a write to
+  // it. Returns false if vaddr is not mapped copy-on-write.
+  bool HandleCopyOnWriteFault(uint64_t vaddr);
+  // Moves a page of the snapshot written during a checkpoint to a copy in
+  // DRAM. Returns false if vaddr is not in the snapshot or no more pages can
+  // be copied.
+  bool HandleSnapshotWriteFault(uint64_t vaddr);
   ExecutionContext& GetExecutionContext() {
+    if (checkpoint_ctx_)
+      return *checkpoint_ctx_;
     return IsPersistent() ? pp_info_->GetWorkingContext() : *ctx_;
   }
-  void NotifyContextSaving();
+  // Registers are saved to and restored from here on context switches.
+  CPUContext& GetCPUContext() {
+    if (checkpoint_ctx_)
+      return cpu_context_in_checkpoint_;
+    return GetExecutionContext().GetCPUContext();
+  }
+  void NotifyContextSaving(uint64_t now_ms);
+  bool IsCheckpointInProgress() const { return checkpoint_ctx_; }
+  void SetCheckpointPolicy(const CheckpointPolicy& policy) {
+    checkpoint_policy_ = policy;
+  }
+  // A checkpoint is taken on the next context switch regardless of policy.
+  void RequestCheckpoint() { is_checkpoint_requested_ = true; }
+  uint16_t GetPCID() const { return pcid_; }
+  // Returns the value to be written to CR3 when switching to this process.
+  uint64_t GetCR3ToSwitch();
+  // Called when the process moves to another processor, whose TLB may hold
+  // stale entries tagged with its PCID.
+  void ForgetTLBEntries() { pml4_tagged_with_pcid_ = 0; }
   uint64_t GetNumberOfContextSwitch() { return number_of_ctx_switch_; }
   uint64_t GetProcTimeFemtoSec() { return proc_time_femto_sec_; }
   void ResetProcTimeFemtoSec() { proc_time_femto_sec_ = 0; }
@@ -59,40 +147,146 @@ class Process {
   }
   void PrintStatistics();
   friend class ProcessController;
+  friend class Checkpointer;
+  friend class Scheduler;
+  friend class Timer;
+  friend class WaitQueue;
 
  private:
   Process(uint64_t id)
       : id_(id),
         status_(Status::kNotInitialized),
+        priority_(kDefaultPriority),
+        cpu_index_(0),
+        is_migratable_(false),
+        is_on_cpu_(false),
+        run_queue_link_(),
+        next_waiter_(nullptr),
+        wake_up_time_ns_(0),
         ctx_(nullptr),
         pp_info_(nullptr),
         number_of_ctx_switch_(0),
         proc_time_femto_sec_(0),
         sys_time_femto_sec_(0),
         copied_bytes_in_ctx_sw_(0),
+        full_copy_bytes_in_ctx_sw_(0),
         num_of_clflush_issued_in_ctx_sw_(0),
-        time_consumed_in_ctx_save_femto_sec_(0){};
+        time_consumed_in_ctx_save_femto_sec_(0),
+        time_consumed_in_bg_checkpoint_femto_sec_(0),
+        num_of_checkpoints_(0),
+        num_of_ctx_sw_since_checkpoint_(0),
+        first_ctx_sw_time_ms_(0),
+        last_ctx_sw_time_ms_(0),
+        last_checkpoint_time_ms_(0),
+        is_checkpoint_requested_(false),
+        checkpoint_ctx_(nullptr),
+        num_of_snapshot_page_copies_(0),
+        num_of_snapshot_pages_copied_(0),
+        pcid_(0),
+        pml4_tagged_with_pcid_(0),
+        num_of_kernel_heap_unmaps_at_load_(0),
+        demand_paged_data_(),
+        demand_paged_stack_(),
+        num_of_demand_paged_pages_(0),
+        num_of_copy_on_write_pages_(0) {
+    anonymous_area_.Init(kAnonymousAreaBase, kAnonymousAreaByteSize);
+  };
   uint64_t id_;
   volatile Status status_;
-  int scheduler_index_;
+  int priority_;
+  int cpu_index_;
+  bool is_migratable_;
+  volatile bool is_on_cpu_;
+  RunQueueLink<Process> run_queue_link_;
+  // Next process in the same WaitQueue or sleeping on the same processor.
+  Process* next_waiter_;
+  uint64_t wake_up_time_ns_;
   ExecutionContext* ctx_;
   PersistentProcessInfo* pp_info_;
   uint64_t number_of_ctx_switch_;
   uint64_t proc_time_femto_sec_;
   uint64_t sys_time_femto_sec_;
   uint64_t copied_bytes_in_ctx_sw_;
+  // Bytes that would have been copied if every copy were a full copy.
+  uint64_t full_copy_bytes_in_ctx_sw_;
   uint64_t num_of_clflush_issued_in_ctx_sw_;
   uint64_t time_consumed_in_ctx_save_femto_sec_;
+  // Wall clock time of background checkpoints, including preempted time.
+  uint64_t time_consumed_in_bg_checkpoint_femto_sec_;
+  CheckpointPolicy checkpoint_policy_;
+  uint64_t num_of_checkpoints_;
+  uint64_t num_of_ctx_sw_since_checkpoint_;
+  uint64_t first_ctx_sw_time_ms_;
+  uint64_t last_ctx_sw_time_ms_;
+  uint64_t last_checkpoint_time_ms_;
+  bool is_checkpoint_requested_;
+  bool ShouldCheckpoint(uint64_t now_ms);
+  bool BeginCheckpoint();
+  // Called by the checkpointer task after the new working context is made.
+  void WriteBackSnapshotPageCopies();
+  // Non-null while the snapshot in *checkpoint_ctx_ is being made durable by
+  // the checkpointer task. Meanwhile, the process keeps running on the
+  // snapshot with the copied segments write-protected and its registers are
+  // saved in cpu_context_in_checkpoint_. Pages written by the process are
+  // mapped to copies in DRAM, which are written back to the new working
+  // context at the end of the checkpoint.
+  ExecutionContext* checkpoint_ctx_;
+  bool is_checkpoint_incremental_;
+  CPUContext cpu_context_in_checkpoint_;
+  struct SnapshotPageCopy {
+    uint64_t vaddr;
+    uint64_t copy_paddr;
+  };
+  // The process is blocked until the end of the checkpoint on more writes.
+  // Limited so that Process fits in a slab object.
+  static constexpr int kMaxNumOfSnapshotPageCopies = 24;
+  SnapshotPageCopy snapshot_page_copies_[kMaxNumOfSnapshotPageCopies];
+  int num_of_snapshot_page_copies_;
+  uint64_t num_of_snapshot_pages_copied_;
+  uint16_t pcid_;
+  uint64_t pml4_tagged_with_pcid_;
+  uint64_t num_of_kernel_heap_unmaps_at_load_;
+  DemandPagedSegment demand_paged_data_;
+  DemandPagedSegment demand_paged_stack_;
+  uint64_t num_of_demand_paged_pages_;
+  uint64_t num_of_copy_on_write_pages_;
+  // Pages of anonymous mappings are mapped on the first access as well.
+  static constexpr uint64_t kAnonymousAreaBase = 0x0000'7000'0000'0000ULL;
+  static constexpr uint64_t kAnonymousAreaByteSize = 1ULL << 40;
+  static constexpr int kMaxNumOfAnonymousAreaFreeExtents = 64;
+  AddressRangeAllocator<kMaxNumOfAnonymousAreaFreeExtents> anonymous_area_;
+  bool IsInAnonymousMapping(uint64_t vaddr);
 };
 
 class ProcessController {
  public:
-  ProcessController(KernelVirtualHeapAllocator& kernel_heap_allocator)
-      : last_id_(0), kernel_heap_allocator_(kernel_heap_allocator){};
+  ProcessController(KernelSlabAllocator& slab_allocator)
+      : last_id_(0),
+        process_cache_(slab_allocator, "Process"),
+        ctx_cache_(slab_allocator, "ExecutionContext"),
+        pcid_bitmap_(){};
   Process& Create();
+  ExecutionContext& AllocExecutionContext() { return *ctx_cache_.Alloc(); }
+  void FreeExecutionContext(ExecutionContext& ctx) { ctx_cache_.Free(&ctx); }
   Process& RestoreFromPersistentProcessInfo(PersistentProcessInfo& pp_info);
+  // Creates a copy of an ephemeral process which shares pages with the
+  // parent by copy-on-write and starts with cpu_context. Page tables and
+  // pages are accessed with their physical addresses, so this should be
+  // called with the kernel page tables. The caller flushes the TLB of the
+  // parent.
+  Process& Fork(Process& parent, const CPUContext& cpu_context);
+  // Releases all resources of a killed process except persistent ones.
+  void Destroy(Process& proc);
 
  private:
   uint64_t last_id_;
-  KernelVirtualHeapAllocator& kernel_heap_allocator_;
+  ObjectCache<Process> process_cache_;
+  ObjectCache<ExecutionContext> ctx_cache_;
+  // PCID 0 is shared by processes that could not get their own one.
+  static constexpr int kNumOfPCIDs = 256;
+  uint16_t AllocPCID();
+  void FreePCID(uint16_t pcid);
+  uint64_t pcid_bitmap_[kNumOfPCIDs / 64];
+  // Protects last_id_ and pcid_bitmap_. Processes are forked on any processor.
+  SpinLock lock_;
 };
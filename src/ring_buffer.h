@@ -18,6 +18,10 @@ class RingBuffer {
     writep_ = nextp;
   }
   bool IsEmpty() { return readp_ == writep_; }
+  bool IsFull() {
+    int nextp = (writep_ + 1) % n;
+    return nextp == readp_;
+  }
 
  private:
   T elements_[n];
@@ -14,9 +14,11 @@ int main() {
   assert(!rbuf.IsEmpty());
   rbuf.Push(5);
   rbuf.Push(7);
+  assert(rbuf.IsFull());
   rbuf.Push(11);
   rbuf.Push(13);
   assert(rbuf.Pop() == 3);
+  assert(!rbuf.IsFull());
   rbuf.Push(17);
   assert(rbuf.Pop() == 5);
   assert(rbuf.Pop() == 7);
@@ -0,0 +1,149 @@
+#pragma once
+
+#include "generic.h"
+
+template <class T>
+class LinkedQueue;
+
+// Embedded in each T so that queues do not need to allocate nodes.
+// T returns it from GetRunQueueLink(). An element is in at most one queue.
+template <class T>
+struct RunQueueLink {
+  T* prev;
+  T* next;
+  LinkedQueue<T>* queue;  // nullptr if it is not in any queue
+};
+
+// FIFO of elements which is O(1) to push, pop and remove from the middle.
+template <class T>
+class LinkedQueue {
+ public:
+  void Init() {
+    head_ = nullptr;
+    tail_ = nullptr;
+    num_of_elements_ = 0;
+  }
+  void PushBack(T& e) {
+    RunQueueLink<T>& link = e.GetRunQueueLink();
+    assert(!link.queue);
+    link.prev = tail_;
+    link.next = nullptr;
+    link.queue = this;
+    if (tail_)
+      tail_->GetRunQueueLink().next = &e;
+    else
+      head_ = &e;
+    tail_ = &e;
+    num_of_elements_++;
+  }
+  T* PopFront() {
+    T* e = head_;
+    if (e)
+      Remove(*e);
+    return e;
+  }
+  void Remove(T& e) {
+    RunQueueLink<T>& link = e.GetRunQueueLink();
+    assert(link.queue == this);
+    if (link.prev)
+      link.prev->GetRunQueueLink().next = link.next;
+    else
+      head_ = link.next;
+    if (link.next)
+      link.next->GetRunQueueLink().prev = link.prev;
+    else
+      tail_ = link.prev;
+    link.prev = nullptr;
+    link.next = nullptr;
+    link.queue = nullptr;
+    num_of_elements_--;
+  }
+  bool Contains(T& e) { return e.GetRunQueueLink().queue == this; }
+  bool IsEmpty() const { return !head_; }
+  T* GetTail() const { return tail_; }
+  int GetNumOfElements() const { return num_of_elements_; }
+
+ private:
+  T* head_;
+  T* tail_;
+  int num_of_elements_;
+};
+
+// Elements ready to run, one FIFO per priority level. Level 0 is the highest.
+// A bitmap of non-empty levels makes picking the next element O(1) regardless
+// of the number of elements.
+template <class T, int TNumOfPriorities>
+class PriorityRunQueue {
+ public:
+  static_assert(0 < TNumOfPriorities && TNumOfPriorities <= 64);
+  static constexpr int kNumOfPriorities = TNumOfPriorities;
+
+  void Init() {
+    for (auto& q : queues_) {
+      q.Init();
+    }
+    non_empty_levels_ = 0;
+  }
+  void PushBack(T& e, int priority) {
+    assert(0 <= priority && priority < TNumOfPriorities);
+    queues_[priority].PushBack(e);
+    non_empty_levels_ |= 1ULL << priority;
+  }
+  // Returns the first element of the highest non-empty level.
+  T* PopFront() {
+    if (!non_empty_levels_)
+      return nullptr;
+    const int priority = GetHighestPriority();
+    T* e = queues_[priority].PopFront();
+    if (queues_[priority].IsEmpty())
+      non_empty_levels_ &= ~(1ULL << priority);
+    return e;
+  }
+  void Remove(T& e) {
+    LinkedQueue<T>* q = e.GetRunQueueLink().queue;
+    assert(queues_ <= q && q < queues_ + TNumOfPriorities);
+    q->Remove(e);
+    if (q->IsEmpty())
+      non_empty_levels_ &= ~(1ULL << (q - queues_));
+  }
+  // Removes and returns the last element which satisfies pred, searching from
+  // the tail of the lowest priority level. Returns nullptr if there is none.
+  template <class TPred>
+  T* PopBackIf(TPred pred) {
+    uint64_t levels = non_empty_levels_;
+    while (levels) {
+      const int priority = 63 - __builtin_clzll(levels);
+      levels &= ~(1ULL << priority);
+      for (T* e = queues_[priority].GetTail(); e;
+           e = e->GetRunQueueLink().prev) {
+        if (!pred(*e))
+          continue;
+        Remove(*e);
+        return e;
+      }
+    }
+    return nullptr;
+  }
+  bool Contains(T& e) {
+    LinkedQueue<T>* q = e.GetRunQueueLink().queue;
+    return queues_ <= q && q < queues_ + TNumOfPriorities;
+  }
+  // Returns TNumOfPriorities if the queue is empty.
+  int GetHighestPriority() const {
+    if (!non_empty_levels_)
+      return TNumOfPriorities;
+    return __builtin_ctzll(non_empty_levels_);
+  }
+  bool IsEmpty() const { return !non_empty_levels_; }
+  int GetNumOfElements() const {
+    int sum = 0;
+    for (auto& q : queues_) {
+      sum += q.GetNumOfElements();
+    }
+    return sum;
+  }
+
+ private:
+  LinkedQueue<T> queues_[TNumOfPriorities];
+  uint64_t non_empty_levels_;
+};
@@ -1,49 +1,272 @@
 #include "scheduler.h"
 
+#include "clock.h"
 #include "liumos.h"
+#include "timer.h"
+
+void Scheduler::InitCPU(int cpu_index, Process& proc) {
+  assert(0 <= cpu_index && cpu_index < kMaxNumOfCPUs);
+  PerCPU& cpu = cpus_[cpu_index];
+  SpinLockGuard guard(cpu.lock);
+  assert(!cpu.is_online);
+  assert(proc.GetStatus() == Process::Status::kNotScheduled);
+  proc.cpu_index_ = cpu_index;
+  proc.SetStatus(Process::Status::kRunning);
+  proc.is_on_cpu_ = true;
+  cpu.current = &proc;
+  cpu.num_of_processes++;
+  cpu.is_online = true;
+}
+
+// The checkpointer task on the bootstrap processor switches working contexts
+// of persistent processes while they are switched out, so they are pinned
+// there. So are kernel tasks, which includes idle processes.
+bool Scheduler::IsMigratable(Process& proc) {
+  return !proc.IsPersistent() && (proc.GetCPUContext().int_ctx.cs & 3);
+}
+
+int Scheduler::ChooseCPU(Process& proc) {
+  if (!proc.is_migratable_)
+    return 0;
+  int chosen = 0;
+  for (int i = 1; i < kMaxNumOfCPUs; i++) {
+    if (cpus_[i].is_online &&
+        cpus_[i].num_of_processes < cpus_[chosen].num_of_processes)
+      chosen = i;
+  }
+  return chosen;
+}
+
+Scheduler::PerCPU& Scheduler::LockCPUOf(Process& proc) {
+  for (;;) {
+    const int cpu_index = proc.cpu_index_;
+    PerCPU& cpu = cpus_[cpu_index];
+    cpu.lock.Lock();
+    // Stealing changes cpu_index_ with the lock of the victim held.
+    if (proc.cpu_index_ == cpu_index)
+      return cpu;
+    cpu.lock.Unlock();
+  }
+}
+
+// Returns -1 if no processor has enough processes to give.
+int Scheduler::ChooseCPUToStealFrom(int cpu_index) {
+  const uint32_t proximity_domain = GetCPU(cpu_index).GetProximityDomain();
+  const int min_num_of_procs =
+      cpus_[cpu_index].num_of_migratable_processes + 2;
+  int chosen = -1;
+  bool is_chosen_local = false;
+  for (int i = 0; i < kMaxNumOfCPUs; i++) {
+    const PerCPU& cpu = cpus_[i];
+    if (i == cpu_index || !cpu.is_online ||
+        cpu.num_of_migratable_processes < min_num_of_procs)
+      continue;
+    const bool is_local =
+        GetCPU(i).GetProximityDomain() == proximity_domain;
+    if (chosen < 0 || (is_local && !is_chosen_local) ||
+        (is_local == is_chosen_local &&
+         cpu.num_of_migratable_processes >
+             cpus_[chosen].num_of_migratable_processes)) {
+      chosen = i;
+      is_chosen_local = is_local;
+    }
+  }
+  return chosen;
+}
+
+// Called with the lock of cpu_index held, so the processor cannot switch to
+// its idle process without seeing what was added to its run queue.
+void Scheduler::WakeUpCPUIfIdle(int cpu_index) {
+  if (cpu_index == GetCurrentCPU().GetIndex())
+    return;
+  if (cpus_[cpu_index].current->GetPriority() == Process::kIdlePriority)
+    liumos->timer->Interrupt(cpu_index);
+}
+
+// Reads other processors without their locks. A missed one is woken up on
+// the next switch.
+void Scheduler::WakeUpCPUToStealFrom(int cpu_index) {
+  if (cpus_[cpu_index].num_of_migratable_processes < 2)
+    return;
+  for (int i = 0; i < kMaxNumOfCPUs; i++) {
+    const PerCPU& cpu = cpus_[i];
+    if (i == cpu_index || !cpu.is_online || cpu.num_of_processes != 1 ||
+        cpu.current->GetPriority() != Process::kIdlePriority)
+      continue;
+    liumos->timer->Interrupt(i);
+    return;
+  }
+}
+
+void Scheduler::Steal(int cpu_index) {
+  const int victim_index = ChooseCPUToStealFrom(cpu_index);
+  if (victim_index < 0)
+    return;
+  PerCPU& victim = cpus_[victim_index];
+  // The victim may be stealing from this processor at the same time, so it
+  // gives up instead of waiting for the lock.
+  if (!victim.lock.TryLock())
+    return;
+  // A process put back to the run queue by SwitchProcess has its registers
+  // saved only after the lock is released, so it is left until then.
+  Process* proc = victim.run_queue.PopBackIf([](Process& candidate) {
+    return candidate.is_migratable_ && !candidate.IsOnCPU();
+  });
+  if (proc) {
+    victim.num_of_processes--;
+    victim.num_of_migratable_processes--;
+    proc->cpu_index_ = cpu_index;
+  }
+  victim.lock.Unlock();
+  if (!proc)
+    return;
+  PerCPU& cpu = cpus_[cpu_index];
+  proc->ForgetTLBEntries();
+  cpu.run_queue.PushBack(*proc, proc->GetPriority());
+  cpu.num_of_processes++;
+  cpu.num_of_migratable_processes++;
+  cpu.num_of_steals++;
+}
+
+int Scheduler::GetNumOfProcesses() const {
+  int sum = 0;
+  for (auto& cpu : cpus_) {
+    sum += cpu.num_of_processes;
+  }
+  return sum;
+}
 
 void Scheduler::RegisterProcess(Process& proc) {
   using Status = Process::Status;
-  assert(number_of_process_ < kNumberOfProcess);
+  assert(GetNumOfProcesses() < kNumberOfProcess);
   assert(proc.GetStatus() == Process::Status::kNotScheduled);
-  process_[number_of_process_] = &proc;
-  proc.SetSchedulerIndex(number_of_process_);
-  number_of_process_++;
-
+  proc.is_migratable_ = IsMigratable(proc);
+  proc.cpu_index_ = ChooseCPU(proc);
+  PerCPU& cpu = cpus_[proc.cpu_index_];
+  SpinLockGuard guard(cpu.lock);
+  cpu.num_of_processes++;
+  if (proc.is_migratable_)
+    cpu.num_of_migratable_processes++;
   proc.SetStatus(Status::kSleeping);
+  cpu.run_queue.PushBack(proc, proc.GetPriority());
+  WakeUpCPUIfIdle(proc.cpu_index_);
+}
+
+void Scheduler::UnregisterProcess(Process& proc) {
+  // Its stack and page tables are freed after this returns. Another
+  // processor may still be using them after dropping it from cpu.current,
+  // until SwitchContext is done with it.
+  while (proc.IsOnCPU()) {
+    assert(proc.cpu_index_ != GetCurrentCPU().GetIndex());
+    Sleep();
+  }
+  PerCPU& cpu = LockCPUOf(proc);
+  if (cpu.run_queue.Contains(proc)) {
+    cpu.run_queue.Remove(proc);
+  } else if (cpu.blocked_queue.Contains(proc)) {
+    cpu.blocked_queue.Remove(proc);
+  } else {
+    // Already dropped by SwitchProcess after it was killed.
+    assert(proc.GetStatus() == Process::Status::kKilled);
+    cpu.lock.Unlock();
+    return;
+  }
+  cpu.num_of_processes--;
+  if (proc.is_migratable_)
+    cpu.num_of_migratable_processes--;
+  cpu.lock.Unlock();
+}
+
+void Scheduler::WaitUntilExit(Process& proc) {
+  exit_waiters_.WaitUntil(
+      [&proc] { return proc.GetStatus() == Process::Status::kKilled; });
 }
 
 uint64_t Scheduler::LaunchAndWaitUntilExit(Process& proc) {
-  uint64_t t0 = liumos->hpet->ReadMainCounterValue();
+  uint64_t t0 = Clock::NowNs();
   RegisterProcess(proc);
-  proc.WaitUntilExit();
-  uint64_t t1 = liumos->hpet->ReadMainCounterValue();
-  uint64_t real_femto_sec = (t1 - t0) * liumos->hpet->GetFemtosecondPerCount();
+  WaitUntilExit(proc);
+  uint64_t t1 = Clock::NowNs();
+  uint64_t real_femto_sec = (t1 - t0) * kFemtosecondPerNs;
   PutStringAndDecimalWithPointPos("  realtime           (sec)", real_femto_sec,
                                   15);
   proc.PrintStatistics();
+  UnregisterProcess(proc);
+  liumos->proc_ctrl->Destroy(proc);
   return real_femto_sec / 1000000;
 }
 
 Process* Scheduler::SwitchProcess() {
   using Status = Process::Status;
-  const int base_index = current_->GetSchedulerIndex();
-  for (int i = 1; i < number_of_process_; i++) {
-    Process* proc = process_[(base_index + i) % number_of_process_];
-    if (!proc)
-      continue;
-    if (proc->GetStatus() == Status::kSleeping) {
-      if (current_->GetStatus() == Status::kRunning)
-        current_->SetStatus(Status::kSleeping);
-      proc->SetStatus(Status::kRunning);
-      current_ = proc;
-      return proc;
-    }
+  const int cpu_index = GetCurrentCPU().GetIndex();
+  PerCPU& cpu = cpus_[cpu_index];
+  SpinLockGuard guard(cpu.lock);
+  Process* current = cpu.current;
+  const Status status = current->GetStatus();
+  if (cpu.run_queue.GetHighestPriority() >= Process::kIdlePriority &&
+      (status != Status::kRunning ||
+       current->GetPriority() >= Process::kIdlePriority))
+    Steal(cpu_index);
+  WakeUpCPUToStealFrom(cpu_index);
+  // A running process is not preempted by lower priority ones. Neither is
+  // one woken up before it is switched out.
+  if ((status == Status::kRunning || status == Status::kSleeping) &&
+      current->GetPriority() < cpu.run_queue.GetHighestPriority()) {
+    current->SetStatus(Status::kRunning);
+    return nullptr;
+  }
+  Process* proc = cpu.run_queue.PopFront();
+  if (!proc) {
+    if (status == Status::kSleeping)
+      current->SetStatus(Status::kRunning);
+    return nullptr;
+  }
+  if (status == Status::kWaiting) {
+    cpu.blocked_queue.PushBack(*current);
+  } else if (status == Status::kKilled) {
+    cpu.num_of_processes--;
+    if (current->is_migratable_)
+      cpu.num_of_migratable_processes--;
+  } else {
+    current->SetStatus(Status::kSleeping);
+    cpu.run_queue.PushBack(*current, current->GetPriority());
   }
-  return nullptr;
+  proc->SetStatus(Status::kRunning);
+  proc->is_on_cpu_ = true;
+  cpu.current = proc;
+  return proc;
 }
 
 void Scheduler::KillCurrentProcess() {
   using Status = Process::Status;
-  current_->SetStatus(Status::kKilled);
+  GetCurrentProcess().SetStatus(Status::kKilled);
+  exit_waiters_.WakeUpAll();
+}
+
+void Scheduler::WakeUp(Process& proc) {
+  using Status = Process::Status;
+  PerCPU& cpu = LockCPUOf(proc);
+  if (proc.GetStatus() != Status::kWaiting) {
+    cpu.lock.Unlock();
+    return;
+  }
+  proc.SetStatus(Status::kSleeping);
+  // The current process is put back to the run queue by SwitchProcess.
+  if (cpu.blocked_queue.Contains(proc)) {
+    cpu.blocked_queue.Remove(proc);
+    cpu.run_queue.PushBack(proc, proc.GetPriority());
+    WakeUpCPUIfIdle(proc.cpu_index_);
+  }
+  cpu.lock.Unlock();
+}
+
+void Scheduler::SetPriority(Process& proc, int priority) {
+  assert(0 <= priority && priority < Process::kNumOfPriorities);
+  PerCPU& cpu = LockCPUOf(proc);
+  if (cpu.run_queue.Contains(proc)) {
+    cpu.run_queue.Remove(proc);
+    cpu.run_queue.PushBack(proc, priority);
+  }
+  proc.priority_ = priority;
+  cpu.lock.Unlock();
 }
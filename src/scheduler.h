@@ -1,25 +1,95 @@
 #pragma once
 #include "process.h"
+#include "run_queue.h"
+#include "smp.h"
+#include "spin_lock.h"
+#include "wait_queue.h"
 
+// Each processor has its own run queues, so picking the next process does not
+// depend on the number of processes. Processors contend for the queues of
+// another only when they steal from it.
+// Processes ready to run are kept in a run queue per priority. Processes
+// waiting for the checkpointer are kept in the blocked queue until WakeUp is
+// called. Killed processes are dropped from the queues when they are switched
+// out.
+// Persistent processes and kernel tasks are pinned to the bootstrap processor
+// together with the checkpointer task. Other processes are registered to the
+// processor with the fewest processes, and a processor with nothing but its
+// idle process to run steals one of them from the tail of the run queue of
+// the busiest processor, preferring ones in the same proximity domain.
+// Idle processors halt without time slices, so they are interrupted when a
+// process is added to their run queues or another processor has processes
+// to give.
 class Scheduler {
  public:
-  Scheduler(Process& root_process)
-      : number_of_process_(0), current_(&root_process) {
-    RegisterProcess(root_process);
-    root_process.SetStatus(Process::Status::kRunning);
+  Scheduler(Process& root_process) {
+    for (auto& cpu : cpus_) {
+      cpu.run_queue.Init();
+      cpu.blocked_queue.Init();
+      cpu.current = nullptr;
+      cpu.num_of_processes = 0;
+      cpu.num_of_migratable_processes = 0;
+      cpu.num_of_steals = 0;
+      cpu.is_online = false;
+    }
+    InitCPU(0, root_process);
   }
+  // Makes proc the running process of the processor cpu_index and starts
+  // scheduling processes on it. Called on the processor itself.
+  void InitCPU(int cpu_index, Process& proc);
   void RegisterProcess(Process& proc);
+  // Waits until proc is switched out if it is running on another processor.
+  void UnregisterProcess(Process& proc);
+  // Blocks the current process until proc exits.
+  void WaitUntilExit(Process& proc);
   uint64_t LaunchAndWaitUntilExit(Process& proc);
+  // Called with interrupts disabled on the processor to be switched.
   Process* SwitchProcess();
   Process& GetCurrentProcess() {
-    assert(current_);
-    return *current_;
+    Process* proc = cpus_[GetCurrentCPU().GetIndex()].current;
+    assert(proc);
+    return *proc;
   }
   void KillCurrentProcess();
+  // Makes proc ready to run if it is waiting.
+  void WakeUp(Process& proc);
+  void SetPriority(Process& proc, int priority);
+  int GetNumOfProcesses() const;
+  int GetNumOfProcessesOnCPU(int cpu_index) const {
+    return cpus_[cpu_index].num_of_processes;
+  }
+  // Number of processes the processor has taken from others.
+  uint64_t GetNumOfStealsOnCPU(int cpu_index) const {
+    return cpus_[cpu_index].num_of_steals;
+  }
 
  private:
+  struct PerCPU {
+    SpinLock lock;
+    PriorityRunQueue<Process, Process::kNumOfPriorities> run_queue;
+    LinkedQueue<Process> blocked_queue;
+    Process* volatile current;
+    volatile int num_of_processes;
+    // Processes which are not pinned, including the running one. Read by
+    // other processors without the lock to choose one to steal from.
+    volatile int num_of_migratable_processes;
+    uint64_t num_of_steals;
+    volatile bool is_online;
+  };
   const static int kNumberOfProcess = 256;
-  Process* process_[kNumberOfProcess];
-  int number_of_process_;
-  Process* current_;
+  static bool IsMigratable(Process& proc);
+  int ChooseCPU(Process& proc);
+  // Returns the locked PerCPU which proc belongs to.
+  PerCPU& LockCPUOf(Process& proc);
+  int ChooseCPUToStealFrom(int cpu_index);
+  // Interrupts cpu_index if it is halted in its idle process.
+  void WakeUpCPUIfIdle(int cpu_index);
+  // Wakes up an idle processor to steal from cpu_index if it has processes
+  // to give.
+  void WakeUpCPUToStealFrom(int cpu_index);
+  // Moves a process from another processor to the run queue of cpu_index.
+  // Called with the lock of cpu_index held.
+  void Steal(int cpu_index);
+  PerCPU cpus_[kMaxNumOfCPUs];
+  WaitQueue exit_waiters_;
 };
@@ -0,0 +1,166 @@
+#ifdef LIUMOS_TEST
+#include "console.h"
+#include "paging.h"
+#include "slab_allocator.h"
+#else
+#include "liumos.h"
+#endif
+
+void SlabCache::Init(const char* name,
+                     uint64_t object_size,
+                     KernelVirtualHeapAllocator& heap_allocator) {
+  assert(0 < object_size &&
+         object_size <= KernelSlabAllocator::kMaxObjectSize);
+  name_ = name;
+  // Keep objects 16-byte aligned and large enough to hold a free list entry.
+  object_size_ = (object_size + 15) & ~15ULL;
+  objects_per_slab_ = (kSlabSize - kSlabHeaderSize) / object_size_;
+  assert(objects_per_slab_ > 0);
+  heap_allocator_ = &heap_allocator;
+  partial_slabs_ = nullptr;
+  full_slabs_ = nullptr;
+  num_of_slabs_ = 0;
+  num_of_objects_in_use_ = 0;
+  next_ = nullptr;
+}
+
+SlabCache::Slab* SlabCache::CreateSlab() {
+  Slab* slab = heap_allocator_->AllocPages<Slab*>(
+      kSlabSize >> kPageSizeExponent, kPageAttrPresent | kPageAttrWritable);
+  assert((reinterpret_cast<uint64_t>(slab) & (kSlabSize - 1)) == 0);
+  slab->cache = this;
+  slab->free_list = nullptr;
+  slab->num_of_objects_in_use = 0;
+  uint64_t obj_addr = reinterpret_cast<uint64_t>(slab) + kSlabHeaderSize;
+  for (uint64_t i = 0; i < objects_per_slab_; i++) {
+    FreeObject* obj = reinterpret_cast<FreeObject*>(
+        obj_addr + (objects_per_slab_ - 1 - i) * object_size_);
+    obj->next = slab->free_list;
+    slab->free_list = obj;
+  }
+  num_of_slabs_++;
+  return slab;
+}
+
+void* SlabCache::Alloc() {
+  SpinLockGuard guard(lock_);
+  if (!partial_slabs_)
+    PushSlab(partial_slabs_, CreateSlab());
+  Slab* slab = partial_slabs_;
+  FreeObject* obj = slab->free_list;
+  assert(obj);
+  slab->free_list = obj->next;
+  slab->num_of_objects_in_use++;
+  num_of_objects_in_use_++;
+  if (!slab->free_list) {
+    RemoveSlab(partial_slabs_, slab);
+    PushSlab(full_slabs_, slab);
+  }
+  return obj;
+}
+
+// Freeing pages of the heap waits for the other processors to flush their
+// TLB, so an empty slab is returned after lock_ is released. Otherwise, a
+// processor spinning on lock_ with interrupts disabled would never flush.
+void SlabCache::Free(void* p) {
+  if (!p)
+    return;
+  Slab* slab = GetSlabOf(p);
+  assert(slab->cache == this);
+  lock_.Lock();
+  assert(slab->num_of_objects_in_use > 0);
+  FreeObject* obj = reinterpret_cast<FreeObject*>(p);
+  if (!slab->free_list) {
+    RemoveSlab(full_slabs_, slab);
+    PushSlab(partial_slabs_, slab);
+  }
+  obj->next = slab->free_list;
+  slab->free_list = obj;
+  slab->num_of_objects_in_use--;
+  num_of_objects_in_use_--;
+  // Keep one slab for later allocations and return other empty ones.
+  const bool should_release =
+      slab->num_of_objects_in_use == 0 && (slab->prev || slab->next);
+  if (should_release) {
+    RemoveSlab(partial_slabs_, slab);
+    num_of_slabs_--;
+  }
+  lock_.Unlock();
+  if (should_release)
+    heap_allocator_->FreePages(slab, kSlabSize >> kPageSizeExponent);
+}
+
+void SlabCache::Print() {
+  PutString(name_);
+  PutString(": obj size = ");
+  PutDecimal64(object_size_);
+  PutString(", in use = ");
+  PutDecimal64(num_of_objects_in_use_);
+  PutString(" / ");
+  PutDecimal64(GetCapacity());
+  PutString(", slabs = ");
+  PutDecimal64(num_of_slabs_);
+  PutString(", utilization = ");
+  PutDecimal64(GetCapacity() ? num_of_objects_in_use_ * 100 / GetCapacity()
+                             : 0);
+  PutString("%\n");
+}
+
+static const char* const
+    kSizeClassNames[KernelSlabAllocator::kNumOfSizeClasses] = {
+        "kmalloc-16",  "kmalloc-32",  "kmalloc-64",   "kmalloc-128",
+        "kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-2048"};
+
+KernelSlabAllocator::KernelSlabAllocator(
+    KernelVirtualHeapAllocator& heap_allocator)
+    : heap_allocator_(heap_allocator), cache_head_(nullptr) {
+  for (int i = 0; i < kNumOfSizeClasses; i++) {
+    size_classes_[i].Init(kSizeClassNames[i], kMinObjectSize << i,
+                          heap_allocator_);
+    RegisterCache(size_classes_[i]);
+  }
+}
+
+void* KernelSlabAllocator::Alloc(uint64_t byte_size) {
+  if (byte_size > kMaxObjectSize)
+    Panic("kmalloc: too large");
+  int size_class = 0;
+  while ((kMinObjectSize << size_class) < byte_size)
+    size_class++;
+  return size_classes_[size_class].Alloc();
+}
+
+void KernelSlabAllocator::Free(void* obj) {
+  if (!obj)
+    return;
+  SlabCache::GetCacheOf(obj).Free(obj);
+}
+
+void KernelSlabAllocator::RegisterCache(SlabCache& cache) {
+  if (!cache_head_) {
+    cache_head_ = &cache;
+    return;
+  }
+  SlabCache* last = cache_head_;
+  while (last->GetNext())
+    last = last->GetNext();
+  last->SetNext(&cache);
+}
+
+void KernelSlabAllocator::Print() {
+  PutString("Slab caches:\n");
+  for (SlabCache* cache = cache_head_; cache; cache = cache->GetNext()) {
+    PutString("  ");
+    cache->Print();
+  }
+}
+
+#ifndef LIUMOS_TEST
+void* kmalloc(size_t byte_size) {
+  return liumos->slab_allocator->Alloc(byte_size);
+}
+
+void kfree(void* obj) {
+  liumos->slab_allocator->Free(obj);
+}
+#endif
@@ -0,0 +1,130 @@
+#pragma once
+
+#include "generic.h"
+#include "spin_lock.h"
+
+#ifdef LIUMOS_TEST
+// Pages of slabs are provided by tests.
+void* AllocPagesForTest(uint64_t num_of_pages);
+void FreePagesForTest(void* addr, uint64_t num_of_pages);
+class KernelVirtualHeapAllocator {
+ public:
+  template <typename T>
+  T AllocPages(uint64_t num_of_pages, uint64_t) {
+    return reinterpret_cast<T>(AllocPagesForTest(num_of_pages));
+  }
+  void FreePages(void* vaddr, uint64_t num_of_pages) {
+    FreePagesForTest(vaddr, num_of_pages);
+  }
+};
+#else
+#include "kernel_virtual_heap_allocator.h"
+#endif
+
+// Object caches for small kernel objects.
+// Every slab is one page of the kernel virtual heap, starts with a Slab
+// header and is followed by fixed-size objects. Freed objects are kept in a
+// per-slab free list and reused by later allocations. Empty slabs are
+// returned to the heap except the last partial one.
+// Each cache has its own lock since objects are allocated on every processor.
+class SlabCache {
+ public:
+  static constexpr uint64_t kSlabSize = kPageSize;
+  void Init(const char* name,
+            uint64_t object_size,
+            KernelVirtualHeapAllocator& heap_allocator);
+  void* Alloc();
+  void Free(void* obj);
+  static SlabCache& GetCacheOf(void* obj) {
+    return *GetSlabOf(obj)->cache;
+  }
+  const char* GetName() const { return name_; }
+  uint64_t GetObjectSize() const { return object_size_; }
+  uint64_t GetNumOfObjectsInUse() const { return num_of_objects_in_use_; }
+  uint64_t GetNumOfSlabs() const { return num_of_slabs_; }
+  uint64_t GetCapacity() const { return num_of_slabs_ * objects_per_slab_; }
+  void Print();
+  SlabCache* GetNext() { return next_; }
+  void SetNext(SlabCache* next) { next_ = next; }
+
+ private:
+  struct FreeObject {
+    FreeObject* next;
+  };
+  struct Slab {
+    SlabCache* cache;
+    Slab* next;
+    Slab* prev;
+    FreeObject* free_list;
+    uint64_t num_of_objects_in_use;
+  };
+  static constexpr uint64_t kSlabHeaderSize = 64;
+  static_assert(sizeof(Slab) <= kSlabHeaderSize);
+
+  static Slab* GetSlabOf(void* obj) {
+    return reinterpret_cast<Slab*>(reinterpret_cast<uint64_t>(obj) &
+                                   ~(kSlabSize - 1));
+  }
+  static void PushSlab(Slab*& head, Slab* slab) {
+    slab->prev = nullptr;
+    slab->next = head;
+    if (head)
+      head->prev = slab;
+    head = slab;
+  }
+  static void RemoveSlab(Slab*& head, Slab* slab) {
+    if (slab->prev)
+      slab->prev->next = slab->next;
+    else
+      head = slab->next;
+    if (slab->next)
+      slab->next->prev = slab->prev;
+  }
+  Slab* CreateSlab();
+
+  const char* name_;
+  uint64_t object_size_;
+  uint64_t objects_per_slab_;
+  KernelVirtualHeapAllocator* heap_allocator_;
+  // Slabs with at least one free object / with no free objects.
+  Slab* partial_slabs_;
+  Slab* full_slabs_;
+  uint64_t num_of_slabs_;
+  uint64_t num_of_objects_in_use_;
+  SlabCache* next_;
+  SpinLock lock_;
+};
+
+// General purpose allocator for small kernel objects (kmalloc / kfree)
+// and the registry of every SlabCache in the kernel.
+class KernelSlabAllocator {
+ public:
+  static constexpr uint64_t kMinObjectSize = 16;
+  static constexpr int kNumOfSizeClasses = 8;  // 16 .. 2048 bytes
+  static constexpr uint64_t kMaxObjectSize = kMinObjectSize
+                                             << (kNumOfSizeClasses - 1);
+
+  KernelSlabAllocator(KernelVirtualHeapAllocator& heap_allocator);
+  void* Alloc(uint64_t byte_size);
+  void Free(void* obj);
+  void RegisterCache(SlabCache& cache);
+  KernelVirtualHeapAllocator& GetHeapAllocator() { return heap_allocator_; }
+  void Print();
+
+ private:
+  KernelVirtualHeapAllocator& heap_allocator_;
+  SlabCache size_classes_[kNumOfSizeClasses];
+  SlabCache* cache_head_;
+};
+
+template <typename T>
+class ObjectCache : public SlabCache {
+ public:
+  static_assert(sizeof(T) <= KernelSlabAllocator::kMaxObjectSize);
+  ObjectCache(KernelSlabAllocator& slab_allocator, const char* name) {
+    Init(name, sizeof(T), slab_allocator.GetHeapAllocator());
+    slab_allocator.RegisterCache(*this);
+  }
+  T* Alloc() { return reinterpret_cast<T*>(SlabCache::Alloc()); }
+  void Free(T* obj) { SlabCache::Free(obj); }
+};
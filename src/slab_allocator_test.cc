@@ -0,0 +1,161 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <cassert>
+#include <set>
+#include <vector>
+
+#include "slab_allocator.h"
+
+[[noreturn]] void Panic(const char* s) {
+  puts(s);
+  exit(EXIT_FAILURE);
+}
+
+void PutString(const char* s) {
+  fputs(s, stdout);
+}
+
+void PutDecimal64(uint64_t value) {
+  printf("%llu", static_cast<unsigned long long>(value));
+}
+
+static std::set<void*> pages_in_use;
+
+void* AllocPagesForTest(uint64_t num_of_pages) {
+  assert(num_of_pages == 1);
+  void* page = aligned_alloc(kPageSize, kPageSize);
+  if (!page) {
+    perror("aligned_alloc failed.\n");
+    exit(EXIT_FAILURE);
+  }
+  pages_in_use.insert(page);
+  return page;
+}
+
+void FreePagesForTest(void* addr, uint64_t num_of_pages) {
+  assert(num_of_pages == 1);
+  assert(pages_in_use.erase(addr) == 1);
+  free(addr);
+}
+
+static KernelVirtualHeapAllocator heap_allocator;
+
+void TestPartialAndFullSlabs() {
+  puts("TestPartialAndFullSlabs");
+  SlabCache cache;
+  cache.Init("test", 64, heap_allocator);
+  assert(cache.GetCapacity() == 0);
+  std::vector<void*> objs;
+  objs.push_back(cache.Alloc());
+  assert(cache.GetNumOfSlabs() == 1);
+  const uint64_t capacity = cache.GetCapacity();
+  assert(capacity == (kPageSize - 64) / 64);
+  for (uint64_t i = 1; i < capacity; i++) {
+    objs.push_back(cache.Alloc());
+  }
+  std::set<void*> distinct(objs.begin(), objs.end());
+  assert(distinct.size() == capacity);
+  // Objects are aligned and know their cache from the page of their slab.
+  for (void* obj : objs) {
+    assert((reinterpret_cast<uint64_t>(obj) & 15) == 0);
+    assert(&SlabCache::GetCacheOf(obj) == &cache);
+  }
+  assert(cache.GetNumOfSlabs() == 1);
+  assert(cache.GetNumOfObjectsInUse() == capacity);
+
+  // The first slab is full, so another one is made.
+  void* extra = cache.Alloc();
+  assert(cache.GetNumOfSlabs() == 2);
+  assert(pages_in_use.size() == 2);
+
+  // An object freed in the full slab is reused by the next allocation.
+  cache.Free(objs[10]);
+  assert(cache.GetNumOfObjectsInUse() == capacity);
+  void* reused = cache.Alloc();
+  assert(reused == objs[10]);
+  assert(cache.GetNumOfSlabs() == 2);
+
+  for (void* obj : objs) {
+    cache.Free(obj);
+  }
+  cache.Free(extra);
+  assert(cache.GetNumOfObjectsInUse() == 0);
+  assert(cache.GetNumOfSlabs() == 1);
+  assert(pages_in_use.size() == 1);
+  pages_in_use.clear();
+}
+
+void TestEmptySlabsAreReturned() {
+  puts("TestEmptySlabsAreReturned");
+  SlabCache cache;
+  cache.Init("test", 1000, heap_allocator);
+  // Sizes are rounded up to 16 bytes.
+  assert(cache.GetObjectSize() == 1008);
+  constexpr int kNumOfObjects = 32;
+  void* objs[kNumOfObjects];
+  for (int i = 0; i < kNumOfObjects; i++) {
+    objs[i] = cache.Alloc();
+  }
+  const uint64_t num_of_slabs = cache.GetNumOfSlabs();
+  // A slab holds 4 objects after its header.
+  assert(num_of_slabs == kNumOfObjects / 4);
+  assert(pages_in_use.size() == num_of_slabs);
+
+  // Freeing every other object keeps all slabs in use.
+  for (int i = 0; i < kNumOfObjects; i += 2) {
+    cache.Free(objs[i]);
+  }
+  assert(cache.GetNumOfSlabs() == num_of_slabs);
+  // Empty slabs are returned to the heap except the last one.
+  for (int i = 1; i < kNumOfObjects; i += 2) {
+    cache.Free(objs[i]);
+  }
+  assert(cache.GetNumOfSlabs() == 1);
+  assert(pages_in_use.size() == 1);
+  assert(cache.GetNumOfObjectsInUse() == 0);
+
+  // The kept slab is used again without asking the heap.
+  void* obj = cache.Alloc();
+  assert(pages_in_use.size() == 1);
+  cache.Free(obj);
+  pages_in_use.clear();
+}
+
+void TestKmallocSizeClasses() {
+  puts("TestKmallocSizeClasses");
+  KernelSlabAllocator allocator(heap_allocator);
+  const struct {
+    uint64_t byte_size;
+    uint64_t object_size;
+  } cases[] = {{1, 16},    {16, 16},   {17, 32},    {64, 64},
+               {65, 128},  {200, 256}, {512, 512},  {513, 1024},
+               {1500, 2048}, {2048, 2048}};
+  for (const auto& c : cases) {
+    void* obj = allocator.Alloc(c.byte_size);
+    SlabCache& cache = SlabCache::GetCacheOf(obj);
+    assert(cache.GetObjectSize() == c.object_size);
+    assert(cache.GetNumOfObjectsInUse() == 1);
+    // A freed object is reused by the next allocation of the same class.
+    allocator.Free(obj);
+    assert(cache.GetNumOfObjectsInUse() == 0);
+    assert(allocator.Alloc(c.object_size) == obj);
+    allocator.Free(obj);
+  }
+  allocator.Free(nullptr);
+
+  // Objects of different classes come from different slabs.
+  void* small = allocator.Alloc(8);
+  void* large = allocator.Alloc(1024);
+  assert(&SlabCache::GetCacheOf(small) != &SlabCache::GetCacheOf(large));
+  allocator.Free(small);
+  allocator.Free(large);
+}
+
+int main() {
+  TestPartialAndFullSlabs();
+  TestEmptySlabsAreReturned();
+  TestKmallocSizeClasses();
+  puts("PASS");
+  return 0;
+}
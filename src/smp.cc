@@ -0,0 +1,265 @@
+#include "smp.h"
+
+#include "liumos.h"
+#include "timer.h"
+
+// @ap_boot.S
+extern "C" {
+extern uint8_t APBootCode[];
+extern uint8_t APBootCode64[];
+extern uint8_t APBootParams[];
+extern uint8_t APBootCodeEnd[];
+}
+
+// Filled in the copy of the trampoline. The layout should match ap_boot.S.
+packed_struct APBootParameters {
+  uint64_t gdt[3];
+  uint16_t gdtr_limit;
+  uint32_t gdtr_base;
+  uint32_t entry64_addr;
+  uint16_t entry64_selector;
+  uint32_t cr0;
+  uint32_t cr3_below_4g;
+  uint32_t cr4;
+  uint32_t efer;
+  uint64_t kernel_cr3;
+  uint64_t stack_pointer;
+  uint64_t cpu;
+  uint64_t entry_point;
+};
+static_assert(offsetof(APBootParameters, gdtr_limit) == 24);
+static_assert(offsetof(APBootParameters, entry64_addr) == 30);
+static_assert(offsetof(APBootParameters, cr0) == 36);
+static_assert(offsetof(APBootParameters, cr3_below_4g) == 40);
+static_assert(offsetof(APBootParameters, cr4) == 44);
+static_assert(offsetof(APBootParameters, efer) == 48);
+static_assert(offsetof(APBootParameters, kernel_cr3) == 52);
+static_assert(offsetof(APBootParameters, stack_pointer) == 60);
+static_assert(offsetof(APBootParameters, cpu) == 68);
+static_assert(offsetof(APBootParameters, entry_point) == 76);
+static_assert(sizeof(APBootParameters) == 84);
+
+constexpr uint64_t kNumOfAPStackPages = 16;
+constexpr uint64_t kAPStartTimeoutMs = 100;
+
+static CPU cpus_[kMaxNumOfCPUs];
+static int num_of_cpus_;
+static uint64_t cr4_for_application_processors_;
+
+CPU& GetCPU(int index) {
+  assert(0 <= index && index < num_of_cpus_);
+  return cpus_[index];
+}
+
+int GetNumOfCPUs() {
+  return num_of_cpus_;
+}
+
+void CPU::FlushTLBIfKernelHeapIsUnmapped() {
+  const uint64_t num_of_unmaps =
+      liumos->kernel_heap_allocator->GetNumOfUnmaps();
+  if (num_of_unmaps == num_of_kernel_heap_unmaps_at_flush_)
+    return;
+  WriteCR3(ReadCR3());
+  // Tells ShootDownKernelHeapTLB that the flush is done.
+  num_of_kernel_heap_unmaps_at_flush_ = num_of_unmaps;
+}
+
+// Should be called without locks which the other processors may spin on with
+// interrupts disabled. Interrupts are disabled while waiting, so shootdowns
+// from the other processors are served here instead of their interrupts.
+void ShootDownKernelHeapTLB() {
+  const bool was_int_enabled = ReadRFlags() & kRFlagsInterruptEnable;
+  ClearIntFlag();
+  CPU& self = GetCurrentCPU();
+  const uint64_t num_of_unmaps =
+      liumos->kernel_heap_allocator->GetNumOfUnmaps();
+  for (int i = 0; i < num_of_cpus_; i++) {
+    CPU& cpu = cpus_[i];
+    if (&cpu != &self && cpu.IsStarted())
+      self.GetLocalAPIC().SendFixedInterrupt(cpu.GetAPICID(),
+                                             kTLBShootdownIntVector);
+  }
+  for (int i = 0; i < num_of_cpus_; i++) {
+    CPU& cpu = cpus_[i];
+    if (&cpu == &self || !cpu.IsStarted())
+      continue;
+    while (cpu.num_of_kernel_heap_unmaps_at_flush_ < num_of_unmaps) {
+      self.FlushTLBIfKernelHeapIsUnmapped();
+      __builtin_ia32_pause();
+    }
+  }
+  if (was_int_enabled)
+    StoreIntFlag();
+}
+
+void InitBootstrapProcessor() {
+  CPU& cpu = cpus_[0];
+  cpu.index_ = 0;
+  cpu.is_started_ = true;
+  num_of_cpus_ = 1;
+  WriteMSR(MSRIndex::kKernelGSBase, reinterpret_cast<uint64_t>(&cpu));
+}
+
+void InitProximityDomain(CPU& cpu) {
+  cpu.proximity_domain_ =
+      liumos->acpi.srat
+          ? liumos->acpi.srat->GetProximityDomainForLocalAPIC(cpu.local_apic_)
+          : 0;
+}
+
+static bool IsAPICIDListed(uint32_t apic_id) {
+  for (int i = 0; i < num_of_cpus_; i++) {
+    if (cpus_[i].GetAPICID() == apic_id)
+      return true;
+  }
+  return false;
+}
+
+static void DetectApplicationProcessors() {
+  using namespace ACPI;
+  if (!liumos->acpi.madt)
+    return;
+  MADT& madt = *liumos->acpi.madt;
+  for (int i = 0; i < (int)(madt.length - offsetof(MADT, entries));
+       i += madt.entries[i + 1]) {
+    const uint8_t type = madt.entries[i];
+    uint32_t apic_id;
+    bool is_enabled;
+    if (type == kProcessorLocalAPICInfo) {
+      apic_id = madt.entries[i + 3];
+      is_enabled = madt.entries[i + 4] & 1;
+    } else if (type == kProcessorLocalx2APICStruct) {
+      apic_id = *reinterpret_cast<uint32_t*>(&madt.entries[i + 4]);
+      is_enabled = madt.entries[i + 8] & 1;
+    } else {
+      continue;
+    }
+    if (!is_enabled || IsAPICIDListed(apic_id))
+      continue;
+    if (num_of_cpus_ >= kMaxNumOfCPUs) {
+      PutStringAndHex("Too many processors. Ignored APIC ID", apic_id);
+      continue;
+    }
+    cpus_[num_of_cpus_].Init(num_of_cpus_, apic_id);
+    num_of_cpus_++;
+  }
+}
+
+static uint64_t AllocAPStack() {
+  const uint64_t base = liumos->kernel_heap_allocator->AllocPages<uint64_t>(
+      kNumOfAPStackPages, kPageAttrPresent | kPageAttrWritable);
+  return base + (kNumOfAPStackPages << kPageSizeExponent);
+}
+
+__attribute__((ms_abi)) void ApplicationProcessorEntry(CPU* cpu) {
+  // CR4.PCIDE can be set only in long mode.
+  WriteCR4(cr4_for_application_processors_);
+  WriteMSR(MSRIndex::kKernelGSBase, reinterpret_cast<uint64_t>(cpu));
+  cpu->gdt_.Init(cpu->kernel_stack_pointer_, cpu->ist1_pointer_);
+  liumos->idt->Load();
+  // Set by the bootstrap processor before it started this one, but checked
+  // here since copy-on-write of user stacks relies on it.
+  WriteCR0(ReadCR0() | kCR0BitWriteProtect);
+  EnableSyscall();
+  cpu->local_apic_.Init();
+  InitProximityDomain(*cpu);
+
+  // This processor keeps running as the idle process from now on.
+  ExecutionContext& idle_context = liumos->proc_ctrl->AllocExecutionContext();
+  idle_context.SetRegisters(nullptr, 0, nullptr, 0, ReadCR3(), 0, 0);
+  Process& idle_process = liumos->proc_ctrl->Create();
+  idle_process.InitAsEphemeralProcess(idle_context);
+  liumos->scheduler->InitCPU(cpu->index_, idle_process);
+  liumos->scheduler->SetPriority(idle_process, Process::kIdlePriority);
+  cpu->is_started_ = true;
+  liumos->timer->StartTimeSlice(idle_process);
+  for (;;) {
+    StoreIntFlagAndHalt();
+  }
+}
+
+static APBootParameters& PrepareAPBootPages() {
+  const uint64_t code_size = APBootCodeEnd - APBootCode;
+  assert(code_size <= kPageSize);
+  uint8_t* code = reinterpret_cast<uint8_t*>(liumos->ap_boot_pages_paddr);
+  memcpy(code, APBootCode, code_size);
+  // CR3 is 32-bit until the processor enters long mode, so a copy of the
+  // kernel PML4 below 4GB is used there.
+  IA_PML4* pml4 =
+      reinterpret_cast<IA_PML4*>(liumos->ap_boot_pages_paddr + kPageSize);
+  memcpy(pml4, &GetKernelPML4(), sizeof(IA_PML4));
+
+  APBootParameters& params = *reinterpret_cast<APBootParameters*>(
+      code + (APBootParams - APBootCode));
+  // Same as the first entries of GDT, which ap_boot.S relies on.
+  params.gdt[0] = 0;
+  params.gdt[GDT::kKernelCSIndex] = GDT::kDescBitTypeCode |
+                                    GDT::kDescBitPresent |
+                                    GDT::kCSDescBitLongMode |
+                                    GDT::kCSDescBitReadable;
+  params.gdt[GDT::kKernelDSIndex] = GDT::kDescBitTypeData |
+                                    GDT::kDescBitPresent |
+                                    GDT::kDSDescBitWritable;
+  params.gdtr_limit = sizeof(params.gdt) - 1;
+  params.gdtr_base = static_cast<uint32_t>(
+      reinterpret_cast<uint64_t>(&params) + offsetof(APBootParameters, gdt));
+  params.entry64_addr = static_cast<uint32_t>(liumos->ap_boot_pages_paddr +
+                                              (APBootCode64 - APBootCode));
+  params.entry64_selector = GDT::kKernelCSSelector;
+  params.cr0 = static_cast<uint32_t>(ReadCR0());
+  params.cr3_below_4g =
+      static_cast<uint32_t>(reinterpret_cast<uint64_t>(pml4));
+  params.cr4 = static_cast<uint32_t>(ReadCR4() & ~kCR4BitPCIDE);
+  IA32_EFER efer;
+  efer.data = ReadMSR(MSRIndex::kEFER);
+  efer.bits.LMA = 0;
+  params.efer = static_cast<uint32_t>(efer.data);
+  params.kernel_cr3 = reinterpret_cast<uint64_t>(&GetKernelPML4());
+  params.entry_point = reinterpret_cast<uint64_t>(ApplicationProcessorEntry);
+  return params;
+}
+
+static bool StartApplicationProcessor(CPU& cpu) {
+  LocalAPIC& local_apic = GetCurrentCPU().GetLocalAPIC();
+  local_apic.SendINIT(cpu.GetAPICID());
+  liumos->timer->SleepForMs(10);
+  for (int i = 0; i < 2; i++) {
+    local_apic.SendStartup(cpu.GetAPICID(), liumos->ap_boot_pages_paddr);
+    liumos->timer->SleepForMs(1);
+  }
+  for (uint64_t ms = 0; ms < kAPStartTimeoutMs && !cpu.IsStarted(); ms++) {
+    liumos->timer->SleepForMs(1);
+  }
+  return cpu.IsStarted();
+}
+
+void StartApplicationProcessors() {
+  CPU& bsp = cpus_[0];
+  assert(&GetCurrentCPU() == &bsp);
+  bsp.apic_id_ = bsp.local_apic_.GetID();
+  DetectApplicationProcessors();
+  if (num_of_cpus_ == 1)
+    return;
+  if (!liumos->ap_boot_pages_paddr) {
+    PutString("No pages below 1MB to start application processors.\n");
+    return;
+  }
+  cr4_for_application_processors_ = ReadCR4();
+  APBootParameters& params = PrepareAPBootPages();
+  // Processors are started one by one since they share the parameters.
+  for (int i = 1; i < num_of_cpus_; i++) {
+    CPU& cpu = cpus_[i];
+    cpu.boot_stack_pointer_ = AllocAPStack();
+    cpu.kernel_stack_pointer_ = AllocAPStack();
+    cpu.ist1_pointer_ = AllocAPStack();
+    params.stack_pointer = cpu.boot_stack_pointer_;
+    params.cpu = reinterpret_cast<uint64_t>(&cpu);
+    if (!StartApplicationProcessor(cpu)) {
+      // It may still be using the parameters.
+      PutStringAndHex("Failed to start processor. APIC ID", cpu.GetAPICID());
+      return;
+    }
+  }
+  PutStringAndHex("Number of processors started", num_of_cpus_);
+}
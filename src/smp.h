@@ -0,0 +1,79 @@
+#pragma once
+
+#include "apic.h"
+#include "asm.h"
+#include "gdt.h"
+#include "generic.h"
+
+constexpr int kMaxNumOfCPUs = 16;
+constexpr uint8_t kTLBShootdownIntVector = 0x22;
+
+// State owned by each processor. The processor with index 0 is the bootstrap
+// processor which runs KernelEntry. Other processors listed in MADT are
+// started by StartApplicationProcessors.
+class CPU {
+ public:
+  // Registers a processor which is not started yet.
+  void Init(int index, uint32_t apic_id) {
+    index_ = index;
+    apic_id_ = apic_id;
+    is_started_ = false;
+  }
+  int GetIndex() const { return index_; }
+  uint32_t GetAPICID() const { return apic_id_; }
+  bool IsBootstrapProcessor() const { return index_ == 0; }
+  bool IsStarted() const { return is_started_; }
+  // SRAT proximity domain of the processor, or 0 if SRAT is not available.
+  uint32_t GetProximityDomain() const { return proximity_domain_; }
+  GDT& GetGDT() { return gdt_; }
+  LocalAPIC& GetLocalAPIC() { return local_apic_; }
+  // Clock::NowNs at the last context switch on this processor.
+  uint64_t GetLastSwitchTimeNs() const { return last_switch_time_ns_; }
+  void SetLastSwitchTimeNs(uint64_t ns) { last_switch_time_ns_ = ns; }
+  // Flushes TLB entries of the current PCID if kernel heap pages were
+  // unmapped since the last flush on this processor. Called on TLB shootdown
+  // interrupts.
+  void FlushTLBIfKernelHeapIsUnmapped();
+  friend void InitBootstrapProcessor();
+  friend void InitProximityDomain(CPU& cpu);
+  friend void StartApplicationProcessors();
+  friend void ShootDownKernelHeapTLB();
+  friend __attribute__((ms_abi)) void ApplicationProcessorEntry(CPU* cpu);
+
+ private:
+  int index_;
+  uint32_t apic_id_;
+  volatile bool is_started_;
+  uint32_t proximity_domain_;
+  GDT gdt_;
+  LocalAPIC local_apic_;
+  uint64_t last_switch_time_ns_;
+  // Read by the processor waiting for a TLB shootdown.
+  volatile uint64_t num_of_kernel_heap_unmaps_at_flush_;
+  // Stacks allocated by the bootstrap processor for application processors.
+  uint64_t boot_stack_pointer_;
+  uint64_t kernel_stack_pointer_;
+  uint64_t ist1_pointer_;
+};
+
+// KernelGSBase holds the CPU of each processor. It is never swapped into
+// GSBase, so user processes cannot change it.
+inline CPU& GetCurrentCPU() {
+  return *reinterpret_cast<CPU*>(ReadMSR(MSRIndex::kKernelGSBase));
+}
+
+// @smp.cc
+CPU& GetCPU(int index);
+// Number of processors found in MADT, including ones not started yet.
+int GetNumOfCPUs();
+// Makes the running processor CPU 0. Its GDT and LocalAPIC are initialized
+// by KernelEntry.
+void InitBootstrapProcessor();
+// Called after the LocalAPIC of cpu is initialized.
+void InitProximityDomain(CPU& cpu);
+// Starts the other processors one by one with INIT-SIPI-SIPI. Each of them
+// becomes the idle process of its own run queue.
+void StartApplicationProcessors();
+// Interrupts the other started processors to flush TLB entries of unmapped
+// kernel heap pages, and waits until all of them have done so.
+void ShootDownKernelHeapTLB();
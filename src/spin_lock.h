@@ -0,0 +1,66 @@
+#pragma once
+
+#include "generic.h"
+#ifndef LIUMOS_TEST
+#include "asm.h"
+#endif
+
+// Lock for data shared among processors. Interrupts are disabled while it is
+// held, so the holder is never preempted by a process which spins on the same
+// lock on that processor. Zero-filled memory is an unlocked SpinLock.
+class SpinLock {
+ public:
+  constexpr SpinLock() : is_locked_(0), was_int_enabled_(false) {}
+  void Lock() {
+    const bool int_enabled = DisableInterrupts();
+    while (__atomic_exchange_n(&is_locked_, 1, __ATOMIC_ACQUIRE)) {
+      while (__atomic_load_n(&is_locked_, __ATOMIC_RELAXED)) {
+        __builtin_ia32_pause();
+      }
+    }
+    was_int_enabled_ = int_enabled;
+  }
+  // Returns false without waiting if the lock is held by others.
+  bool TryLock() {
+    const bool int_enabled = DisableInterrupts();
+    if (__atomic_exchange_n(&is_locked_, 1, __ATOMIC_ACQUIRE)) {
+      if (int_enabled)
+        EnableInterrupts();
+      return false;
+    }
+    was_int_enabled_ = int_enabled;
+    return true;
+  }
+  void Unlock() {
+    const bool int_enabled = was_int_enabled_;
+    __atomic_store_n(&is_locked_, 0, __ATOMIC_RELEASE);
+    if (int_enabled)
+      EnableInterrupts();
+  }
+
+ private:
+#ifdef LIUMOS_TEST
+  static bool DisableInterrupts() { return false; }
+  static void EnableInterrupts() {}
+#else
+  // Returns true if interrupts were enabled.
+  static bool DisableInterrupts() {
+    const bool int_enabled = ReadRFlags() & kRFlagsInterruptEnable;
+    ClearIntFlag();
+    return int_enabled;
+  }
+  static void EnableInterrupts() { StoreIntFlag(); }
+#endif
+
+  int is_locked_;
+  bool was_int_enabled_;
+};
+
+class SpinLockGuard {
+ public:
+  SpinLockGuard(SpinLock& lock) : lock_(lock) { lock_.Lock(); }
+  ~SpinLockGuard() { lock_.Unlock(); }
+
+ private:
+  SpinLock& lock_;
+};
@@ -2,6 +2,7 @@
 
 #include "liumos.h"
 #include "sheet.h"
+#include "timer.h"
 
 class PolygonCube {
  public:
@@ -198,7 +199,7 @@ void CellularAutomaton() {
     }
     liumos->screen_sheet->Flush(liumos->screen_sheet->GetXSize() - canvas_xsize,
                                 0, canvas_xsize, canvas_ysize);
-    liumos->hpet->BusyWait(200);
+    liumos->timer->SleepForMs(200);
   }
 }
 
@@ -206,6 +207,6 @@ void SubTask() {
   PolygonCube pcube;
   for (;;) {
     pcube.Draw();
-    liumos->hpet->BusyWait(10);
+    liumos->timer->SleepForMs(10);
   }
 }
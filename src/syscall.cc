@@ -1,17 +1,197 @@
+#include "clock.h"
+#include "copy_on_write.h"
 #include "liumos.h"
 
 constexpr uint64_t kSyscallIndex_sys_write = 1;
+constexpr uint64_t kSyscallIndex_sys_mmap = 9;
+constexpr uint64_t kSyscallIndex_sys_munmap = 11;
+constexpr uint64_t kSyscallIndex_sys_brk = 12;
+constexpr uint64_t kSyscallIndex_sys_fork = 57;
 constexpr uint64_t kSyscallIndex_sys_exit = 60;
 constexpr uint64_t kSyscallIndex_arch_prctl = 158;
+// Not in Linux. Requests a checkpoint of the calling persistent process.
+constexpr uint64_t kSyscallIndex_liumos_checkpoint = 0x1000;
+// Not in Linux. Sets the checkpoint policy of the calling process.
+// args: CheckpointPolicy::Trigger, period
+constexpr uint64_t kSyscallIndex_liumos_set_checkpoint_policy = 0x1001;
 // constexpr uint64_t kArchSetGS = 0x1001;
 constexpr uint64_t kArchSetFS = 0x1002;
 // constexpr uint64_t kArchGetFS = 0x1003;
 // constexpr uint64_t kArchGetGS = 0x1004;
 
+constexpr uint64_t kMapPrivate = 0x02;
+constexpr uint64_t kMapFixed = 0x10;
+constexpr uint64_t kMapAnonymous = 0x20;
+
+// Syscalls return negated errno values on errors.
+constexpr uint64_t kErrorNoMemory = static_cast<uint64_t>(-12);
+constexpr uint64_t kErrorInvalidArgument = static_cast<uint64_t>(-22);
+
+// Syscall handlers run on the user stack, where registers of the caller are
+// saved by AsmSyscallHandler in this order.
+struct SyscallFrame {
+  uint64_t rax, rdi, rsi, rdx, r10, r8, r9;
+  uint64_t r15, r14, r13, r12, rbp, rbx;
+  uint64_t r11;  // RFLAGS
+  uint64_t rcx;  // RIP
+};
+
+template <class TFunc>
+struct KernelStackCall {
+  TFunc func;
+  bool should_flush_tlb;
+  uint64_t result;
+};
+
+template <class TFunc>
+__attribute__((ms_abi)) static void CallOnKernelStack(void* arg) {
+  auto& call = *reinterpret_cast<KernelStackCall<TFunc>*>(arg);
+  // Copied since the call is on the user stack.
+  TFunc func = call.func;
+  uint64_t cr3 = ReadCR3();
+  WriteCR3(reinterpret_cast<uint64_t>(&GetKernelPML4()));
+  const uint64_t result = func();
+  if (!call.should_flush_tlb && (cr3 & kCR3PCIDMask))
+    cr3 |= kCR3BitNoFlush;
+  WriteCR3(cr3);
+  call.result = result;
+}
+
+// Calls func with the kernel page tables, where page tables and pages are
+// accessible with their physical addresses. It runs on the kernel stack of
+// the current process since the user stack is not mapped there, so func
+// should capture variables by value. should_flush_tlb should be true if func
+// unmaps pages or makes them read-only.
+template <class TFunc>
+static uint64_t CallWithKernelPageTables(TFunc func, bool should_flush_tlb) {
+  KernelStackCall<TFunc> call = {func, should_flush_tlb, 0};
+  Process& proc = liumos->scheduler->GetCurrentProcess();
+  CallWithStack(proc.GetExecutionContext().GetKernelRSP(),
+                CallOnKernelStack<TFunc>, &call);
+  return call.result;
+}
+
+// Page faults in syscall handlers cannot be handled on the user stack, so
+// demand paged pages of user buffers are mapped in advance.
+static void MapUserBuffer(const void* buf, uint64_t byte_size) {
+  Process& proc = liumos->scheduler->GetCurrentProcess();
+  if (!byte_size || proc.IsPersistent())
+    return;
+  const uint64_t begin = FloorToPageAlignment(reinterpret_cast<uint64_t>(buf));
+  const uint64_t end = reinterpret_cast<uint64_t>(buf) + byte_size;
+  CallWithKernelPageTables(
+      [=, &proc]() {
+        IA_PML4& pml4 = proc.GetExecutionContext().GetCR3();
+        for (uint64_t vaddr = begin; vaddr < end; vaddr += kPageSize) {
+          if (v2p(pml4, vaddr) == kAddrCannotTranslate)
+            proc.HandleDemandPageFault(vaddr);
+        }
+        return 0;
+      },
+      false);
+}
+
+// Returns the ID of the child to the parent and 0 to the child.
+static uint64_t Fork(SyscallFrame& frame) {
+  Process& parent = liumos->scheduler->GetCurrentProcess();
+  if (parent.IsPersistent())
+    return static_cast<uint64_t>(-1);
+  CPUContext cpu_context;
+  GeneralRegisterContext& greg = cpu_context.greg;
+  greg.rax = 0;
+  greg.rdx = frame.rdx;
+  greg.rbx = frame.rbx;
+  greg.rbp = frame.rbp;
+  greg.rsi = frame.rsi;
+  greg.rdi = frame.rdi;
+  greg.r8 = frame.r8;
+  greg.r9 = frame.r9;
+  greg.r10 = frame.r10;
+  greg.r11 = frame.r11;
+  greg.r12 = frame.r12;
+  greg.r13 = frame.r13;
+  greg.r14 = frame.r14;
+  greg.r15 = frame.r15;
+  greg.rcx = frame.rcx;
+  InterruptContext& int_ctx = cpu_context.int_ctx;
+  int_ctx.rip = frame.rcx;
+  int_ctx.cs = GDT::kUserCS64Selector;
+  int_ctx.rflags = frame.r11;
+  int_ctx.rsp = reinterpret_cast<uint64_t>(&frame + 1);
+  int_ctx.ss = GDT::kUserDSSelector;
+  const uint64_t frame_vaddr = reinterpret_cast<uint64_t>(&frame);
+  Process* child =
+      reinterpret_cast<Process*>(CallWithKernelPageTables([=, &parent]() {
+        Process& forked = liumos->proc_ctrl->Fork(parent, cpu_context);
+        // The parent keeps using the syscall frame and the stack below it
+        // until it returns to the user mode.
+        IA_PML4& pml4 = parent.GetExecutionContext().GetCR3();
+        for (uint64_t vaddr = FloorToPageAlignment(frame_vaddr - kPageSize);
+             vaddr < frame_vaddr + sizeof(SyscallFrame); vaddr += kPageSize) {
+          ResolveCopyOnWrite(*liumos->dram_allocator,
+                             *liumos->page_frame_table, pml4, vaddr);
+        }
+        return reinterpret_cast<uint64_t>(&forked);
+      },
+      true));
+  liumos->scheduler->RegisterProcess(*child);
+  return child->GetID();
+}
+
+// Only private anonymous mappings are supported. Address hints are ignored.
+static uint64_t MapAnonymousPages(uint64_t byte_size,
+                                  uint64_t flags,
+                                  int64_t fd) {
+  Process& proc = liumos->scheduler->GetCurrentProcess();
+  if (proc.IsPersistent() || !byte_size || fd != -1 ||
+      (flags & (kMapPrivate | kMapAnonymous | kMapFixed)) !=
+          (kMapPrivate | kMapAnonymous))
+    return kErrorInvalidArgument;
+  const uint64_t vaddr = proc.MapAnonymousPages(byte_size);
+  return vaddr ? vaddr : kErrorNoMemory;
+}
+
+static uint64_t UnmapAnonymousPages(uint64_t vaddr, uint64_t byte_size) {
+  Process& proc = liumos->scheduler->GetCurrentProcess();
+  if (proc.IsPersistent())
+    return kErrorInvalidArgument;
+  return CallWithKernelPageTables(
+      [=, &proc]() {
+        return proc.UnmapAnonymousPages(vaddr, byte_size)
+                   ? 0
+                   : kErrorInvalidArgument;
+      },
+      true);
+}
+
+static uint64_t SetProgramBreak(uint64_t brk) {
+  Process& proc = liumos->scheduler->GetCurrentProcess();
+  ExecutionContext& ctx = proc.GetExecutionContext();
+  if (proc.IsPersistent() || !brk)
+    return ctx.GetHeapEndVirtAddr();
+  return CallWithKernelPageTables(
+      [=, &proc]() { return proc.SetProgramBreak(brk); }, true);
+}
+
+// Processes are restored with the policy for new processes, so a process
+// calls this again after it is restored to keep its own policy.
+static uint64_t SetCheckpointPolicy(uint64_t trigger, uint64_t period) {
+  using Trigger = CheckpointPolicy::Trigger;
+  if (trigger > static_cast<uint64_t>(Trigger::kSyscall))
+    return kErrorInvalidArgument;
+  CheckpointPolicy policy;
+  policy.trigger = static_cast<Trigger>(trigger);
+  policy.period = period;
+  if (policy.trigger != Trigger::kSyscall && !period)
+    return kErrorInvalidArgument;
+  liumos->scheduler->GetCurrentProcess().SetCheckpointPolicy(policy);
+  return 0;
+}
+
 __attribute__((ms_abi)) extern "C" void SyscallHandler(uint64_t* args) {
   uint64_t idx = args[0];
   if (idx == kSyscallIndex_sys_write) {
-    uint64_t t0 = liumos->hpet->ReadMainCounterValue();
+    uint64_t t0 = Clock::NowNs();
     const uint64_t fildes = args[1];
     const uint8_t* buf = reinterpret_cast<uint8_t*>(args[2]);
     uint64_t nbyte = args[3];
@@ -19,23 +199,48 @@ __attribute__((ms_abi)) extern "C" void SyscallHandler(uint64_t* args) {
       PutStringAndHex("fildes", fildes);
       Panic("Only stdout is supported for now.");
     }
+    MapUserBuffer(buf, nbyte);
     while (nbyte--) {
       PutChar(*(buf++));
     }
-    uint64_t t1 = liumos->hpet->ReadMainCounterValue();
+    uint64_t t1 = Clock::NowNs();
     liumos->scheduler->GetCurrentProcess().AddSysTimeFemtoSec(
-        (t1 - t0) * liumos->hpet->GetFemtosecondPerCount());
+        (t1 - t0) * kFemtosecondPerNs);
+    return;
+  } else if (idx == kSyscallIndex_sys_mmap) {
+    args[0] =
+        MapAnonymousPages(args[2], args[4], static_cast<int64_t>(args[5]));
+    return;
+  } else if (idx == kSyscallIndex_sys_munmap) {
+    args[0] = UnmapAnonymousPages(args[1], args[2]);
+    return;
+  } else if (idx == kSyscallIndex_sys_brk) {
+    args[0] = SetProgramBreak(args[1]);
+    return;
+  } else if (idx == kSyscallIndex_sys_fork) {
+    args[0] = Fork(*reinterpret_cast<SyscallFrame*>(args));
     return;
   } else if (idx == kSyscallIndex_sys_exit) {
     const uint64_t exit_code = args[1];
     PutStringAndHex("exit: exit_code", exit_code);
     liumos->scheduler->KillCurrentProcess();
-    ExecutionContext& ctx =
-        liumos->scheduler->GetCurrentProcess().GetExecutionContext();
-    ChangeRSP(ctx.GetKernelRSP());
+    // The kernel stack of the process may be freed as soon as it is switched
+    // out, while the frame of Sleep is still to be returned from. So the
+    // stack of the processor is used instead, which is free while the
+    // processor is in the kernel.
+    ChangeRSP(GetCurrentCPU().GetGDT().GetKernelStackPointer());
+    // Switched out for good without waiting for the end of the time slice.
     for (;;) {
-      StoreIntFlagAndHalt();
+      Sleep();
     };
+  } else if (idx == kSyscallIndex_liumos_checkpoint) {
+    // Taken on the next context switch since registers of the process are
+    // saved only there.
+    liumos->scheduler->GetCurrentProcess().RequestCheckpoint();
+    return;
+  } else if (idx == kSyscallIndex_liumos_set_checkpoint_policy) {
+    args[0] = SetCheckpointPolicy(args[1], args[2]);
+    return;
   } else if (idx == kSyscallIndex_arch_prctl) {
     Panic("arch_prctl!");
     if (args[1] == kArchSetFS) {
@@ -0,0 +1,140 @@
+#include "timer.h"
+
+#include "clock.h"
+#include "liumos.h"
+#include "smp.h"
+
+constexpr uint64_t kMaxLocalAPICTimerCount = 0xFFFF'FFFF;
+
+void Timer::Init(HPET& hpet, uint8_t vector) {
+  vector_ = vector;
+  time_slice_ns_ = kDefaultTimeSliceNs;
+  for (auto& cpu : cpus_) {
+    cpu.sleepers = nullptr;
+    cpu.slice_end_ns = 0;
+  }
+  // Deadlines in TSC are not kept if TSC stops or changes its rate, so the
+  // mode is used only with the invariant TSC that Clock relies on.
+  is_tsc_deadline_mode_ =
+      Clock::IsTSCUsed() && liumos->cpu_features->tsc_deadline;
+  local_apic_count_per_ms_ = 0;
+  if (is_tsc_deadline_mode_) {
+    Print();
+    return;
+  }
+
+  LocalAPIC& local_apic = GetCurrentCPU().GetLocalAPIC();
+  const uint64_t hpet_count_per_ms =
+      1000'000'000'000ULL / hpet.GetFemtosecondPerCount();
+  const uint64_t hpet_end =
+      hpet.ReadMainCounterValue() + hpet_count_per_ms * kCalibrationMs;
+  // Interrupts are disabled, so it does not matter if the timer expires.
+  local_apic.StartOneShotTimer(vector_, kMaxLocalAPICTimerCount);
+  while (hpet.ReadMainCounterValue() < hpet_end) {
+    __builtin_ia32_pause();
+  }
+  const uint32_t local_apic_count_left = local_apic.ReadTimerCurrentCount();
+  local_apic.StopTimer();
+
+  local_apic_count_per_ms_ =
+      (kMaxLocalAPICTimerCount - local_apic_count_left) / kCalibrationMs;
+  if (!local_apic_count_per_ms_)
+    Panic("LocalAPIC timer is not running");
+  Print();
+}
+
+// Sleeping processes are accessed only on their processor with interrupts
+// disabled. They are not stolen by other processors while they are blocked.
+void Timer::SleepFor(uint64_t ns) {
+  const bool was_int_enabled = ReadRFlags() & kRFlagsInterruptEnable;
+  ClearIntFlag();
+  Process& proc = liumos->scheduler->GetCurrentProcess();
+  assert(proc.GetPriority() != Process::kIdlePriority);
+  PerCPU& cpu = cpus_[GetCurrentCPU().GetIndex()];
+  const uint64_t now = Clock::NowNs();
+  proc.wake_up_time_ns_ = now + ns;
+  Process** link = &cpu.sleepers;
+  while (*link && (*link)->wake_up_time_ns_ <= proc.wake_up_time_ns_) {
+    link = &(*link)->next_waiter_;
+  }
+  proc.next_waiter_ = *link;
+  *link = &proc;
+  proc.SetStatus(Process::Status::kWaiting);
+  Arm(cpu, now);
+  // Returns when HandleInterrupt wakes it up. The idle process is always
+  // there to be switched to.
+  Sleep();
+  if (was_int_enabled)
+    StoreIntFlag();
+}
+
+void Timer::StartTimeSlice(Process& proc) {
+  PerCPU& cpu = cpus_[GetCurrentCPU().GetIndex()];
+  const uint64_t now = Clock::NowNs();
+  cpu.slice_end_ns = proc.GetPriority() == Process::kIdlePriority
+                         ? 0
+                         : now + time_slice_ns_;
+  Arm(cpu, now);
+}
+
+bool Timer::HandleInterrupt(Process& current) {
+  PerCPU& cpu = cpus_[GetCurrentCPU().GetIndex()];
+  const uint64_t now = Clock::NowNs();
+  while (cpu.sleepers && cpu.sleepers->wake_up_time_ns_ <= now) {
+    Process& proc = *cpu.sleepers;
+    cpu.sleepers = proc.next_waiter_;
+    proc.next_waiter_ = nullptr;
+    liumos->scheduler->WakeUp(proc);
+  }
+  if (current.GetPriority() == Process::kIdlePriority ||
+      (cpu.slice_end_ns && cpu.slice_end_ns <= now))
+    return true;
+  // Woken up processes wait for the end of the slice.
+  Arm(cpu, now);
+  return false;
+}
+
+void Timer::Interrupt(int cpu_index) {
+  GetCurrentCPU().GetLocalAPIC().SendFixedInterrupt(
+      GetCPU(cpu_index).GetAPICID(), vector_);
+}
+
+void Timer::Arm(PerCPU& cpu, uint64_t now_ns) {
+  uint64_t deadline = cpu.slice_end_ns;
+  if (cpu.sleepers &&
+      (!deadline || cpu.sleepers->wake_up_time_ns_ < deadline))
+    deadline = cpu.sleepers->wake_up_time_ns_;
+  if (!deadline) {
+    GetCurrentCPU().GetLocalAPIC().StopTimer();
+    return;
+  }
+  SetDeadlineAfterNs(deadline > now_ns ? deadline - now_ns : 0);
+}
+
+void Timer::SetDeadlineAfterNs(uint64_t ns) {
+  if (ns > kMaxDeadlineNs)
+    ns = kMaxDeadlineNs;
+  LocalAPIC& local_apic = GetCurrentCPU().GetLocalAPIC();
+  if (is_tsc_deadline_mode_) {
+    local_apic.StartTSCDeadlineTimer(vector_,
+                                     ReadTSC() + Clock::NsToTSCCount(ns));
+    return;
+  }
+  uint64_t count = ns * local_apic_count_per_ms_ / kNsPerMs;
+  if (count == 0)
+    count = 1;
+  if (count > kMaxLocalAPICTimerCount)
+    count = kMaxLocalAPICTimerCount;
+  local_apic.StartOneShotTimer(vector_, static_cast<uint32_t>(count));
+}
+
+void Timer::Print() {
+  PutString("Timer: LocalAPIC ");
+  PutString(is_tsc_deadline_mode_ ? "TSC-deadline" : "one-shot");
+  PutString(" mode\n");
+  if (!is_tsc_deadline_mode_) {
+    PutStringAndDecimal("  LocalAPIC timer count per ms",
+                        local_apic_count_per_ms_);
+  }
+  PutStringAndDecimal("  time slice (us)", time_slice_ns_ / 1000);
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include "clock.h"
+#include "generic.h"
+#include "smp.h"
+
+class HPET;
+class Process;
+
+// Preempts processes and wakes up sleeping ones with the LocalAPIC timer of
+// each processor. The timer is armed as a one-shot at the earlier of the end
+// of the time slice of the running process and the deadline of the first
+// sleeping process, so a processor is not interrupted on every HPET tick.
+// Idle processes run without time slices, so an idle processor halts until
+// the next deadline or an interrupt from another processor.
+// The TSC-deadline mode is used if the processor supports it and TSC is
+// invariant.
+// TSC deadlines are computed with the rate of TSC measured by Clock. In the
+// one-shot mode, the rate of the LocalAPIC timer is measured against HPET on
+// the bootstrap processor, and shared with the other processors.
+class Timer {
+ public:
+  // Called on the bootstrap processor with interrupts disabled.
+  void Init(HPET& hpet, uint8_t vector);
+  // Blocks the current process for ns at least. Each processor keeps its
+  // sleeping processes sorted by their deadlines.
+  void SleepFor(uint64_t ns);
+  void SleepForMs(uint64_t ms) { SleepFor(ms * kNsPerMs); }
+  // Called when proc is switched in on the current processor.
+  void StartTimeSlice(Process& proc);
+  // Called on every timer interrupt. Wakes up processes whose deadlines have
+  // passed, and returns true if the running process should be switched out.
+  bool HandleInterrupt(Process& current);
+  // Raises the timer interrupt on another processor.
+  void Interrupt(int cpu_index);
+  uint64_t GetTimeSliceNs() const { return time_slice_ns_; }
+  void SetTimeSliceNs(uint64_t ns) {
+    assert(ns);
+    time_slice_ns_ = ns;
+  }
+  bool IsTSCDeadlineMode() const { return is_tsc_deadline_mode_; }
+  void Print();
+
+ private:
+  struct PerCPU {
+    Process* sleepers;
+    uint64_t slice_end_ns;  // 0 while the idle process is running.
+  };
+  static constexpr uint64_t kCalibrationMs = 10;
+  static constexpr uint64_t kDefaultTimeSliceNs = 10'000'000;
+  // Longer deadlines are split, so that counts do not overflow.
+  static constexpr uint64_t kMaxDeadlineNs = 1000'000'000;
+
+  // Arms the timer of the current processor for the next deadline, or stops
+  // it if there is none.
+  void Arm(PerCPU& cpu, uint64_t now_ns);
+  // Interrupts the current processor with the vector after ns.
+  void SetDeadlineAfterNs(uint64_t ns);
+
+  uint8_t vector_;
+  bool is_tsc_deadline_mode_;
+  uint64_t local_apic_count_per_ms_;
+  volatile uint64_t time_slice_ns_;
+  PerCPU cpus_[kMaxNumOfCPUs];
+};
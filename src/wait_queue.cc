@@ -0,0 +1,22 @@
+#include "wait_queue.h"
+
+#include "liumos.h"
+
+void WaitQueue::AddCurrentProcess() {
+  Process& proc = liumos->scheduler->GetCurrentProcess();
+  proc.SetStatus(Process::Status::kWaiting);
+  proc.next_waiter_ = head_;
+  head_ = &proc;
+}
+
+void WaitQueue::WakeUpAll() {
+  SpinLockGuard guard(lock_);
+  Process* proc = head_;
+  head_ = nullptr;
+  while (proc) {
+    Process* next = proc->next_waiter_;
+    proc->next_waiter_ = nullptr;
+    liumos->scheduler->WakeUp(*proc);
+    proc = next;
+  }
+}
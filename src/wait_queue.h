@@ -0,0 +1,38 @@
+#pragma once
+
+#include "generic.h"
+#include "spin_lock.h"
+
+class Process;
+
+// Processes blocked until an event happens. A waker changes the state which
+// the waiters check and then calls WakeUpAll.
+// A process waits in at most one WaitQueue at a time, or sleeps in Timer,
+// since both link it with Process::next_waiter_.
+class WaitQueue {
+ public:
+  constexpr WaitQueue() : lock_(), head_(nullptr) {}
+  // Blocks the current process until cond() returns true. cond is called with
+  // the queue locked, so a WakeUpAll after the state changes is never missed.
+  template <class TCond>
+  void WaitUntil(TCond cond) {
+    for (;;) {
+      lock_.Lock();
+      if (cond()) {
+        lock_.Unlock();
+        return;
+      }
+      AddCurrentProcess();
+      lock_.Unlock();
+      Sleep();
+    }
+  }
+  void WakeUpAll();
+
+ private:
+  // Called with the lock held.
+  void AddCurrentProcess();
+
+  SpinLock lock_;
+  Process* head_;
+};